@@ -10,6 +10,9 @@
 //= The "Return" button is available in client versions
 //= from approximately 2022-03-30 and later.
 //= Successfully tested on 2022-04-06 and 2025-03-19 clients.
+//===== Setup: ===============================================
+//= Copy \plugins\ns_common\ns_trace.h next to this file. Returns are traced into
+//= \log\ns_rodex_return.trace; use @rodextrace on|off <category>, @rodextrace dump [records].
 //===== Repository Link: =====================================
 //= https://github.com/AcidMarco/ro-releases
 //============================================================
@@ -31,6 +34,8 @@
 #include "plugins/HPMHooking.h"
 #include "common/HPMDataCheck.h"
 
+#include "ns_trace.h"
+
 HPExport struct hplugin_info pinfo = {
 	"ns_button_rodex_return",
 	SERVER_TYPE_MAP,
@@ -44,6 +49,25 @@ HPExport struct hplugin_info pinfo = {
 char rodex_db[64] = "rodex_mail";	// Name of the SQL table used for Rodex mail data
 char char_db[64] = "char";			// Name of the SQL table containing character data (used for mail auto-deletion)
 bool is_auto_del_mail = true;		// Automatically delete returned mail if the sender character no longer exists
+uint32 rodex_trace_categories_default = 0x1;	// Trace categories enabled at startup (0x1 return), see @rodextrace
+
+enum rodex_return_trace_category {
+	RODEX_TRACE_RETURN = 0x1,
+};
+
+enum rodex_return_trace_event {
+	RODEX_EV_RETURN = 1,
+	RODEX_EV_AUTO_DELETE,
+};
+
+static const char* const rodex_trace_categories[] = { "return", NULL };
+
+static const struct ns_trace_event rodex_trace_events[] = {
+	{ RODEX_EV_RETURN, "clif_parse_mail_return_btn", "CID=%d, mail_id=%u, status=%d" },
+	{ RODEX_EV_AUTO_DELETE, "clif_parse_mail_return_btn", "auto-deleted mail_id=%u, sender_id=%d" },
+};
+
+static struct ns_trace rodex_trace;
 
 enum rodex_return_status {
 	RODEX_RETURN_STATUS_SUCCESS = 0,
@@ -76,6 +100,7 @@ void clif_mail_return_result(struct map_session_data* sd, uint32 mail_id, enum r
 	p.packetType = HEADER_ZC_RODEX_RETURN_RESULT;
 	p.msgId = mail_id;
 	p.status = (uint32)result;
+	ns_trace(&rodex_trace, RODEX_TRACE_RETURN, RODEX_EV_RETURN, sd->status.char_id, mail_id, result, 0);
 	clif->send(&p, sizeof(p), &sd->bl, SELF);
 }
 
@@ -119,8 +144,10 @@ void clif_parse_mail_return_btn(int fd)
 			if (SQL_ERROR == SQL->Query(map->mysql_handle, "SELECT `char_id` FROM `%s` WHERE `char_id` = '%d' LIMIT 1", char_db, msg->sender_id)) {
 				Sql_ShowDebug(map->mysql_handle);
 			} else {
-				if (SQL_SUCCESS != SQL->NextRow(map->mysql_handle))
+				if (SQL_SUCCESS != SQL->NextRow(map->mysql_handle)) {
 					intif->rodex_updatemail(sd, mail_id, 0, 3);
+					ns_trace(&rodex_trace, RODEX_TRACE_RETURN, RODEX_EV_AUTO_DELETE, mail_id, msg->sender_id, 0, 0);
+				}
 				SQL->FreeResult(map->mysql_handle);
 			}
 		}
@@ -129,11 +156,29 @@ void clif_parse_mail_return_btn(int fd)
 	rodex->refresh(sd, RODEX_OPENTYPE_UNSET, 0);
 }
 
+// Toggles trace categories and decodes the trace file, see ns_trace_command
+ACMD(rodextrace)
+{
+	char reply[CHAT_SIZE_MAX];
+
+	ns_trace_command(&rodex_trace, message, reply, sizeof(reply));
+	clif->message(fd, reply);
+	return true;
+}
+
 #if PACKETVER >= 20220330
 HPExport void plugin_init(void)
 {
 	addPacket(HEADER_CZ_RODEX_RETURN, sizeof(struct PACKET_CZ_RODEX_RETURN), clif_parse_mail_return_btn, hpClif_Parse);
 	packets->addLen(HEADER_ZC_RODEX_RETURN_RESULT, sizeof(struct PACKET_ZC_RODEX_RETURN_RESULT));
+
+	addAtcommand("rodextrace", rodextrace);
+	ns_trace_init(&rodex_trace, "ns_rodex_return", rodex_trace_categories, rodex_trace_events, ARRAYLENGTH(rodex_trace_events), rodex_trace_categories_default);
+}
+
+HPExport void plugin_final(void)
+{
+	ns_trace_final(&rodex_trace);
 }
 #else
 HPExport void plugin_init(void)
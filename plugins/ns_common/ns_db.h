@@ -0,0 +1,198 @@
+//===== Hercules Plugin Helper ===============================
+//= Worker-Thread SQL Connection
+//===== By: =================================================
+//= AcidMarco
+//===== Description: =========================================
+//= SQL access for background threads of the ns_* plugins.
+//= Hercules' Sql handles are main-thread only: they allocate
+//= through memmgr, format queries with StrBuf, and Connect
+//= registers a keepalive timer that the main loop then runs
+//= against the handle. A worker thread uses this raw
+//= libmysqlclient connection and plain libc buffers instead.
+//===== Note: ================================================
+//= ns_db_setup copies the connection settings and must be
+//= called on the map-server thread. Everything else runs on
+//= the thread that owns the connection. Errors are kept in
+//= db->error for the main thread to report. An idle link is
+//= pinged before use, and a lost link is reconnected on the
+//= next ns_db_ready.
+//===== Setup: ===============================================
+//= Copy this file next to the plugin sources that include it
+//= (\src\plugins\) and build the plugin with the MySQL client
+//= flags the map-server uses (MYSQL_CFLAGS / MYSQL_LIBS).
+//===== Repository Link: =====================================
+//= https://github.com/AcidMarco/ro-releases
+//============================================================
+#ifndef NS_DB_H
+#define NS_DB_H
+
+#include "common/hercules.h"
+
+#ifdef WIN32
+#include <winsock2.h>
+#endif
+#include <mysql.h>
+#include <errmsg.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_DB_PING_IDLE 60		// Seconds a connection may idle before it is pinged
+
+struct ns_db {
+	MYSQL* mysql;				// NULL while disconnected
+	time_t last_used;
+	char host[64];
+	uint16 port;
+	char user[32];
+	char pass[100];
+	char name[32];
+	char codepage[32];
+	char error[256];			// Last error, for the main thread to report
+};
+
+// Growable query buffer on the libc heap, safe to use off the main thread
+struct ns_db_buf {
+	char* data;
+	size_t len;
+	size_t max;
+	bool failed;				// An allocation failed, the content is incomplete
+};
+
+// Copies the connection settings. Call on the map-server thread.
+static inline void ns_db_setup(struct ns_db* db, const char* host, uint16 port, const char* user,
+	const char* pass, const char* name, const char* codepage)
+{
+	memset(db, 0, sizeof(*db));
+	snprintf(db->host, sizeof(db->host), "%s", host);
+	db->port = port;
+	snprintf(db->user, sizeof(db->user), "%s", user);
+	snprintf(db->pass, sizeof(db->pass), "%s", pass);
+	snprintf(db->name, sizeof(db->name), "%s", name);
+	snprintf(db->codepage, sizeof(db->codepage), "%s", codepage ? codepage : "");
+}
+
+static inline void ns_db_close(struct ns_db* db)
+{
+	if (db->mysql)
+		mysql_close(db->mysql);
+	db->mysql = NULL;
+}
+
+// Closes the connection and releases the thread's client state. Call last on the owning thread.
+static inline void ns_db_final(struct ns_db* db)
+{
+	ns_db_close(db);
+	mysql_thread_end();
+}
+
+// Connects if needed and checks an idle connection. Returns false with db->error set.
+static inline bool ns_db_ready(struct ns_db* db)
+{
+	time_t now = time(NULL);
+
+	if (db->mysql && now - db->last_used >= NS_DB_PING_IDLE && mysql_ping(db->mysql) != 0)
+		ns_db_close(db);
+
+	if (!db->mysql) {
+		db->mysql = mysql_init(NULL);
+		if (!db->mysql) {
+			snprintf(db->error, sizeof(db->error), "Out of memory for the SQL connection.");
+			return false;
+		}
+		if (!mysql_real_connect(db->mysql, db->host, db->user, db->pass, db->name, db->port, NULL, 0)) {
+			snprintf(db->error, sizeof(db->error), "Cannot connect to the SQL server: %s", mysql_error(db->mysql));
+			ns_db_close(db);
+			return false;
+		}
+		if (db->codepage[0] != '\0')
+			mysql_set_character_set(db->mysql, db->codepage);
+	}
+
+	db->last_used = now;
+	return true;
+}
+
+// Runs one statement. A lost connection is closed so the next ns_db_ready reconnects.
+static inline bool ns_db_query(struct ns_db* db, const char* query, size_t len)
+{
+	if (!db->mysql) {
+		snprintf(db->error, sizeof(db->error), "Not connected to the SQL server.");
+		return false;
+	}
+
+	if (mysql_real_query(db->mysql, query, (unsigned long)len) != 0) {
+		unsigned int code = mysql_errno(db->mysql);
+		snprintf(db->error, sizeof(db->error), "DB error %u: %s", code, mysql_error(db->mysql));
+		if (code == CR_SERVER_GONE_ERROR || code == CR_SERVER_LOST)
+			ns_db_close(db);
+		return false;
+	}
+
+	db->last_used = time(NULL);
+	return true;
+}
+
+// Escapes len bytes of in into out, which must hold 2 * len + 1 bytes
+static inline size_t ns_db_escape(struct ns_db* db, char* out, const char* in, size_t len)
+{
+	return (size_t)mysql_real_escape_string(db->mysql, out, in, (unsigned long)len);
+}
+
+static inline void ns_db_buf_clear(struct ns_db_buf* b)
+{
+	b->len = 0;
+	b->failed = false;
+	if (b->data)
+		b->data[0] = '\0';
+}
+
+static inline void ns_db_buf_free(struct ns_db_buf* b)
+{
+	free(b->data);
+	memset(b, 0, sizeof(*b));
+}
+
+static inline bool ns_db_buf_printf(struct ns_db_buf* b, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static inline bool ns_db_buf_printf(struct ns_db_buf* b, const char* fmt, ...)
+{
+	if (b->failed)
+		return false;
+
+	for (;;) {
+		size_t avail = b->max - b->len;
+		va_list ap;
+
+		va_start(ap, fmt);
+		int n = vsnprintf(b->data ? b->data + b->len : NULL, avail, fmt, ap);
+		va_end(ap);
+
+		if (n < 0) {
+			b->failed = true;
+			return false;
+		}
+		if ((size_t)n < avail) {
+			b->len += (size_t)n;
+			return true;
+		}
+
+		size_t size = b->max * 2;
+		if (size < b->len + (size_t)n + 1)
+			size = b->len + (size_t)n + 1;
+		if (size < 1024)
+			size = 1024;
+
+		char* data = (char*)realloc(b->data, size);
+		if (!data) {
+			b->failed = true;
+			return false;
+		}
+		b->data = data;
+		b->max = size;
+	}
+}
+
+#endif /* NS_DB_H */
@@ -0,0 +1,94 @@
+//===== Hercules Plugin Helper ===============================
+//= Encode-Once Packet Fan-Out
+//===== By: =================================================
+//= AcidMarco
+//===== Description: =========================================
+//= Broadcast helper shared by the ns_* plugins. A packet is
+//= encoded once into a buffer owned by the caller (usually a
+//= static one, reused for every broadcast) and then copied
+//= straight into each recipient's send buffer in one pass
+//= over a list of sockets. No heap allocation per message
+//= and no per-recipient lookups.
+//===== Note: ================================================
+//= Hercules gives every socket its own send buffer, so one
+//= copy per recipient is the floor; the fan-out removes the
+//= allocation and the intermediate clif->send() walk.
+//= Recipients are kept as socket plus character ID: a
+//= socket is only written while it still carries that
+//= logged-in character, so a stale list never reaches a
+//= closed, reused or not yet authenticated connection.
+//= Map-server only, and not thread-safe: use it from the
+//= server thread only.
+//===== Setup: ===============================================
+//= Copy this file next to the plugin sources that include it
+//= (\src\plugins\).
+//===== Repository Link: =====================================
+//= https://github.com/AcidMarco/ro-releases
+//============================================================
+#ifndef NS_FANOUT_H
+#define NS_FANOUT_H
+
+#include "common/hercules.h"
+#include "common/socket.h"
+#include "map/pc.h"
+
+#include <string.h>
+
+#define NS_FANOUT_MAX_PACKET 0xFFFF		// Largest packet a fan-out buffer holds
+
+struct ns_fanout {
+	uint8 buf[NS_FANOUT_MAX_PACKET];
+	size_t len;				// Length of the encoded packet, 0 when none
+	uint64 packets;			// Packets encoded
+	uint64 recipients;		// Copies written to sockets
+};
+
+struct ns_fanout_target {
+	int fd;
+	int char_id;			// Character the socket was listed for
+};
+
+// Starts encoding a packet of len bytes. Returns the buffer to fill, or NULL if
+// the packet does not fit. The previous packet is discarded.
+static inline uint8* ns_fanout_begin(struct ns_fanout* fo, size_t len)
+{
+	if (len == 0 || len > sizeof(fo->buf)) {
+		fo->len = 0;
+		return NULL;
+	}
+	fo->len = len;
+	fo->packets++;
+	return fo->buf;
+}
+
+// Writes the encoded packet to the socket of a target if it still belongs to the
+// target's logged-in character. Returns 1 if it was written.
+static inline int ns_fanout_write(struct ns_fanout* fo, const struct ns_fanout_target* t)
+{
+	int fd = t->fd;
+
+	if (fo->len == 0 || fd <= 0 || !sockt->session_is_active(fd))
+		return 0;
+
+	struct map_session_data* sd = (struct map_session_data*)sockt->session[fd]->session_data;
+	if (!sd || !sd->state.active || sd->status.char_id != t->char_id)
+		return 0;
+
+	WFIFOHEAD(fd, fo->len);
+	memcpy(WFIFOP(fd, 0), fo->buf, fo->len);
+	WFIFOSET(fd, fo->len);
+	fo->recipients++;
+	return 1;
+}
+
+// Writes the encoded packet to every target of the list, returns how many got it
+static inline int ns_fanout_send(struct ns_fanout* fo, const struct ns_fanout_target* targets, int count)
+{
+	int sent = 0;
+
+	for (int i = 0; i < count; i++)
+		sent += ns_fanout_write(fo, &targets[i]);
+	return sent;
+}
+
+#endif /* NS_FANOUT_H */
@@ -0,0 +1,305 @@
+//===== Hercules Plugin Helper ===============================
+//= Binary Trace Ring Buffer
+//===== By: =================================================
+//= AcidMarco
+//===== Description: =========================================
+//= Low-overhead tracing for packet handlers, shared by the
+//= ns_* plugins in this repository. Instead of formatting
+//= console output on the map-server thread, handlers store
+//= fixed-size binary records in a lock-free ring buffer.
+//= A background thread drains the ring to a file in \log\,
+//= and the dump command decodes that file to text.
+//= Categories can be switched on and off at runtime.
+//===== Note: ================================================
+//= The ring has a single producer (the map-server thread)
+//= and a single consumer (the writer thread). When the
+//= writer falls behind, new records are dropped and counted;
+//= the map-server thread never blocks.
+//===== Setup: ===============================================
+//= Copy this file next to the plugin sources that include it
+//= (\src\plugins\).
+//===== Repository Link: =====================================
+//= https://github.com/AcidMarco/ro-releases
+//============================================================
+#ifndef NS_TRACE_H
+#define NS_TRACE_H
+
+#include "common/hercules.h"
+#include "common/atomic.h"
+#include "common/memmgr.h"
+#include "common/mutex.h"
+#include "common/thread.h"
+#include "common/timer.h"
+
+#include <stdio.h>
+
+#define NS_TRACE_RING_SIZE 8192					// Records in the ring, must be a power of two
+#define NS_TRACE_MAX_FILE (64 * 1024 * 1024)	// Trace file size before it is rotated to <file>.old
+#define NS_TRACE_FLUSH_MS 100					// How often the writer thread drains the ring
+
+// One trace record, 32 bytes on disk and in the ring
+struct ns_trace_record {
+	int64 tick;			// timer->gettick() when the record was made
+	uint16 event;		// Plugin-defined event ID
+	uint16 category;	// Category bit the event belongs to
+	int32 args[4];		// Event arguments, decoded by the event's format
+	uint32 reserved;
+};
+
+// Decoding table entry supplied by the plugin. format receives the four
+// arguments as ints, e.g. "AID=%d, packId=%d".
+struct ns_trace_event {
+	uint16 event;
+	const char* name;
+	const char* format;
+};
+
+struct ns_trace {
+	struct ns_trace_record ring[NS_TRACE_RING_SIZE];
+	volatile int32 head;		// Next slot to write, owned by the producer
+	volatile int32 tail;		// Next slot to drain, owned by the writer thread
+	volatile int32 dropped;		// Records lost because the ring was full
+	volatile int32 running;
+	uint32 categories;			// Enabled category bits, only touched on the map-server thread
+	const char* const* category_names;	// Name of category bit i, NULL terminated
+	const struct ns_trace_event* events;
+	int event_count;
+	char path[256];
+	struct thread_handle* writer;
+	struct mutex_data* lock;
+	struct cond_data* wake;
+};
+
+// Stores one record. Only call from the map-server thread, through ns_trace().
+static inline void ns_trace_write(struct ns_trace* tr, uint16 category, uint16 event, int32 a0, int32 a1, int32 a2, int32 a3)
+{
+	uint32 head = (uint32)tr->head;
+
+	if (head - (uint32)InterlockedExchangeAdd(&tr->tail, 0) >= NS_TRACE_RING_SIZE) {
+		InterlockedIncrement(&tr->dropped);
+		return;
+	}
+
+	struct ns_trace_record* rec = &tr->ring[head & (NS_TRACE_RING_SIZE - 1)];
+	rec->tick = timer->gettick();
+	rec->event = event;
+	rec->category = category;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	rec->args[3] = a3;
+	rec->reserved = 0;
+
+	InterlockedExchange(&tr->head, (int32)(head + 1)); // Publishes the record to the writer
+}
+
+#define ns_trace(tr, category, event, a0, a1, a2, a3) \
+	do { \
+		if (((tr)->categories & (category)) != 0) \
+			ns_trace_write((tr), (category), (event), (int32)(a0), (int32)(a1), (int32)(a2), (int32)(a3)); \
+	} while (0)
+
+static inline FILE* ns_trace_open(struct ns_trace* tr)
+{
+	FILE* fp = fopen(tr->path, "ab");
+	if (fp && ftell(fp) >= NS_TRACE_MAX_FILE) {
+		char old_path[300];
+		fclose(fp);
+		snprintf(old_path, sizeof(old_path), "%s.old", tr->path);
+		remove(old_path);
+		rename(tr->path, old_path);
+		fp = fopen(tr->path, "ab");
+	}
+	return fp;
+}
+
+static inline void* ns_trace_writer_main(void* param)
+{
+	struct ns_trace* tr = (struct ns_trace*)param;
+	FILE* fp = ns_trace_open(tr);
+
+	for (;;) {
+		bool running = InterlockedExchangeAdd(&tr->running, 0) != 0;
+		uint32 tail = (uint32)tr->tail;
+		uint32 head = (uint32)InterlockedExchangeAdd(&tr->head, 0);
+
+		if (head != tail && fp != NULL) {
+			// Write up to the end of the ring, the wrapped part goes in the next pass
+			uint32 start = tail & (NS_TRACE_RING_SIZE - 1);
+			uint32 count = min(head - tail, NS_TRACE_RING_SIZE - start);
+			fwrite(&tr->ring[start], sizeof(struct ns_trace_record), count, fp);
+			InterlockedExchange(&tr->tail, (int32)(tail + count));
+			if (head - tail > count)
+				continue;
+
+			fflush(fp);
+			if (ftell(fp) >= NS_TRACE_MAX_FILE) {
+				fclose(fp);
+				fp = ns_trace_open(tr);
+			}
+		}
+		else if (head != tail) {
+			InterlockedExchange(&tr->tail, (int32)head); // No file, discard
+		}
+
+		if (!running)
+			break;
+
+		mutex->lock(tr->lock);
+		mutex->cond_wait(tr->wake, tr->lock, NS_TRACE_FLUSH_MS);
+		mutex->unlock(tr->lock);
+	}
+
+	if (fp)
+		fclose(fp);
+	return NULL;
+}
+
+// Starts tracing to log/<name>.trace with the given categories enabled.
+static inline void ns_trace_init(struct ns_trace* tr, const char* name, const char* const* category_names,
+	const struct ns_trace_event* events, int event_count, uint32 categories)
+{
+	memset(tr, 0, sizeof(*tr));
+	snprintf(tr->path, sizeof(tr->path), "log/%s.trace", name);
+	tr->category_names = category_names;
+	tr->events = events;
+	tr->event_count = event_count;
+	tr->categories = categories;
+	tr->running = 1;
+	tr->lock = mutex->create();
+	tr->wake = mutex->cond_create();
+	tr->writer = thread->create(ns_trace_writer_main, tr);
+
+	if (tr->writer == NULL) {
+		ShowError("ns_trace_init: Could not start the trace writer for '%s', tracing disabled.\n", name);
+		tr->categories = 0;
+	}
+}
+
+// Stops the writer thread after it has drained the ring.
+static inline void ns_trace_final(struct ns_trace* tr)
+{
+	if (tr->writer) {
+		InterlockedExchange(&tr->running, 0);
+		mutex->lock(tr->lock);
+		mutex->cond_signal(tr->wake);
+		mutex->unlock(tr->lock);
+		thread->wait(tr->writer, NULL);
+		tr->writer = NULL;
+	}
+
+	if (tr->wake)
+		mutex->cond_destroy(tr->wake);
+	if (tr->lock)
+		mutex->destroy(tr->lock);
+	tr->wake = NULL;
+	tr->lock = NULL;
+}
+
+static inline const struct ns_trace_event* ns_trace_event_get(const struct ns_trace* tr, uint16 event)
+{
+	for (int i = 0; i < tr->event_count; ++i) {
+		if (tr->events[i].event == event)
+			return &tr->events[i];
+	}
+	return NULL;
+}
+
+static inline int ns_trace_category_bit(const struct ns_trace* tr, const char* name)
+{
+	for (int i = 0; tr->category_names[i] != NULL; ++i) {
+		if (strcmpi(tr->category_names[i], name) == 0)
+			return 1 << i;
+	}
+	return strcmpi(name, "all") == 0 ? -1 : 0;
+}
+
+// Decodes the last 'limit' records of the trace file into log/<name>.trace.txt.
+// Returns the number of records written, or -1 if the files cannot be opened.
+static inline int ns_trace_dump(const struct ns_trace* tr, int limit, char* out_path, size_t out_len)
+{
+	FILE* in = fopen(tr->path, "rb");
+	if (!in)
+		return -1;
+
+	snprintf(out_path, out_len, "%s.txt", tr->path);
+	FILE* out = fopen(out_path, "w");
+	if (!out) {
+		fclose(in);
+		return -1;
+	}
+
+	fseek(in, 0, SEEK_END);
+	long total = ftell(in) / (long)sizeof(struct ns_trace_record);
+	long first = (limit > 0 && total > limit) ? total - limit : 0;
+	fseek(in, first * (long)sizeof(struct ns_trace_record), SEEK_SET);
+
+	struct ns_trace_record rec;
+	int written = 0;
+	while (fread(&rec, sizeof(rec), 1, in) == 1) {
+		const struct ns_trace_event* ev = ns_trace_event_get(tr, rec.event);
+		char args[256];
+
+		if (ev)
+			snprintf(args, sizeof(args), ev->format, rec.args[0], rec.args[1], rec.args[2], rec.args[3]);
+		else
+			snprintf(args, sizeof(args), "%d %d %d %d", rec.args[0], rec.args[1], rec.args[2], rec.args[3]);
+
+		fprintf(out, "[%"PRId64"] %s: %s\n", rec.tick, ev ? ev->name : "unknown", args);
+		written++;
+	}
+
+	fclose(out);
+	fclose(in);
+	return written;
+}
+
+// Handles the plugin's trace command:
+//   on <category|all>, off <category|all>, dump [records], status (default)
+// and writes a one-line reply.
+static inline void ns_trace_command(struct ns_trace* tr, const char* message, char* reply, size_t reply_len)
+{
+	char action[16] = "", arg[32] = "";
+
+	if (message)
+		sscanf(message, "%15s %31s", action, arg);
+
+	if (strcmpi(action, "on") == 0 || strcmpi(action, "off") == 0) {
+		int bit = ns_trace_category_bit(tr, arg);
+		if (bit == 0) {
+			snprintf(reply, reply_len, "Unknown trace category '%s'.", arg);
+			return;
+		}
+		if (tr->writer == NULL) {
+			snprintf(reply, reply_len, "Tracing is unavailable, the writer thread is not running.");
+			return;
+		}
+		if (strcmpi(action, "on") == 0)
+			tr->categories |= (uint32)bit;
+		else
+			tr->categories &= ~(uint32)bit;
+	}
+	else if (strcmpi(action, "dump") == 0) {
+		char out_path[300];
+		int limit = arg[0] ? atoi(arg) : 1000;
+		int written = ns_trace_dump(tr, limit, out_path, sizeof(out_path));
+
+		if (written < 0)
+			snprintf(reply, reply_len, "Cannot read trace file '%s'.", tr->path);
+		else
+			snprintf(reply, reply_len, "Decoded %d trace record(s) into '%s'.", written, out_path);
+		return;
+	}
+
+	char enabled[128] = "";
+	size_t pos = 0;
+	for (int i = 0; tr->category_names[i] != NULL && pos < sizeof(enabled); ++i) {
+		if (tr->categories & (1U << i))
+			pos += snprintf(enabled + pos, sizeof(enabled) - pos, "%s%s", pos ? "," : "", tr->category_names[i]);
+	}
+
+	snprintf(reply, reply_len, "Trace '%s': categories [%s], %d record(s) dropped. Usage: on|off <category|all>, dump [records].",
+		tr->path, pos ? enabled : "none", (int)InterlockedExchangeAdd(&tr->dropped, 0));
+}
+
+#endif /* NS_TRACE_H */
@@ -0,0 +1,26 @@
+--
+-- Alliance chat log for ns_client_ally_chat_handler.
+-- Import into the main (map-server) database.
+--
+-- One row per message, written in batches by the map-server's log thread.
+-- recipients counts the alliance members reached on the sender's map-server.
+-- message holds the sent "Name : text" line; its width matches the plugin's
+-- log record (CHAT_SIZE_MAX + NAME_LENGTH * 2) so no row can overflow it.
+--
+CREATE TABLE IF NOT EXISTS `ally_chat_log` (
+  `id` BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
+  `time` DATETIME NOT NULL,
+  `account_id` INT UNSIGNED NOT NULL,
+  `char_id` INT UNSIGNED NOT NULL,
+  `name` VARCHAR(23) NOT NULL DEFAULT '',
+  `guild_id` INT UNSIGNED NOT NULL,
+  `recipients` SMALLINT UNSIGNED NOT NULL DEFAULT '0',
+  `message` VARCHAR(304) NOT NULL DEFAULT '',
+  PRIMARY KEY (`id`),
+  KEY `time` (`time`),
+  KEY `char_id` (`char_id`, `time`),
+  KEY `guild_id` (`guild_id`, `time`)
+) ENGINE=InnoDB;
+
+-- Tables created before the message column was widened:
+-- ALTER TABLE `ally_chat_log` MODIFY `message` VARCHAR(304) NOT NULL DEFAULT '';
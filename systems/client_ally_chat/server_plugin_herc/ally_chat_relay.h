@@ -0,0 +1,44 @@
+//===== Hercules Plugin Helper ===============================
+//= Ally Chat Relay Packets
+//===== By: =================================================
+//= AcidMarco
+//===== Description: =========================================
+//= Inter-server packets shared by ns_client_ally_chat_handler
+//= (map-server) and ns_client_ally_chat_relay (char-server).
+//= Map-servers batch the alliance messages of one tick into a
+//= single packet to the char-server, which batches them again
+//= per destination map-server and forwards them once a tick.
+//===== Setup: ===============================================
+//= Copy this file next to both plugin sources (\src\plugins\).
+//===== Repository Link: =====================================
+//= https://github.com/AcidMarco/ro-releases
+//============================================================
+#ifndef ALLY_CHAT_RELAY_H
+#define ALLY_CHAT_RELAY_H
+
+#include "common/hercules.h"
+
+#define HEADER_ALLY_CHAT_RELAY_SEND 0x2b73		// map -> char
+#define HEADER_ALLY_CHAT_RELAY_DELIVER 0x2b74	// char -> map
+#define ALLY_CHAT_RELAY_MAX 0xFFFF				// Largest relay packet
+
+#pragma pack(push, 1)
+// 0x2B73/0x2B74 <packet len>.W <count>.W { <entry> <allies>.?L <message>.?B }*count
+struct PACKET_ALLY_CHAT_RELAY {
+	int16 packetType;
+	uint16 packetLength;
+	uint16 count;		// Entries in data[]
+	uint8 data[];
+} __attribute__((packed));
+
+// One message: the sender's guild, the non-opposition allies it reaches (so the
+// receiving map-server does not need the sender's guild loaded) and the text.
+struct ally_chat_relay_entry {
+	int32 guild_id;
+	uint16 message_len;	// Without terminator
+	uint8 ally_count;	// int32 guild IDs following the entry
+	uint8 reserved;
+} __attribute__((packed));
+#pragma pack(pop)
+
+#endif /* ALLY_CHAT_RELAY_H */
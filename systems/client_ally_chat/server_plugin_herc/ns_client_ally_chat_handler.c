@@ -20,6 +20,15 @@
 //= 1. Set PACKETVER >= 20230607 in \src\common\mmo.h
 //= 2. Use a compatible client supporting the feature
 //= 3. Optionally patch the client symbol behavior if needed
+//= 4. Copy \plugins\ns_common\ns_trace.h, ns_fanout.h and ns_db.h next to this file. Alliance chat traces into
+//=    \log\ns_ally_chat.trace; use @allytrace on|off <category>, @allytrace dump [records].
+//= 5. On clusters with several map-servers, copy ally_chat_relay.h next to this file, load
+//=    ns_client_ally_chat_relay.c on the char-server and set ALLY_CHAT_RELAY to true.
+//=    Without the char-server plugin leave it off: the char-server drops unknown packets.
+//= 6. Flood control is on by default, tune the ALLY_FLOOD_* settings below and
+//=    check the drop counters with @allyflood.
+//= 7. Import ally_chat_log.sql into your main database. Alliance chat is logged there
+//=    by a background thread (set ALLY_LOG to false to turn it off); see @allylog.
 //===== Repository Link: =====================================
 //= https://github.com/AcidMarco/ro-releases
 //============================================================
@@ -30,15 +39,28 @@
 #include "common/socket.h"
 #include "common/nullpo.h"
 #include "common/packets.h"
+#include "common/db.h"
+#include "common/atomic.h"
+#include "common/mutex.h"
+#include "common/strlib.h"
+#include "common/thread.h"
+#include "common/timer.h"
 
+#include "map/chrif.h"
 #include "map/clif.h"
 #include "map/guild.h"
+#include "map/map.h"
 #include "map/pc.h"
 #include "map/packets.h"
 
 #include "plugins/HPMHooking.h"
 #include "common/HPMDataCheck.h"
 
+#include "ns_trace.h"
+#include "ns_fanout.h"
+#include "ns_db.h"
+#include "ally_chat_relay.h"
+
 HPExport struct hplugin_info pinfo = {
 	"ns_client_ally_chat_handler",
 	SERVER_TYPE_MAP,
@@ -46,6 +68,48 @@ HPExport struct hplugin_info pinfo = {
 	HPM_VERSION,
 };
 
+uint32 ALLY_TRACE_CATEGORIES = 0x1;	// Trace categories enabled at startup (0x1 chat, 0x2 flood), see @allytrace
+bool ALLY_CHAT_RELAY = false;		// Forward ally chat to the other map-servers through the char-server (needs ns_client_ally_chat_relay)
+bool ALLY_FLOOD_CONTROL = true;		// Rate limit ally chat per sender and per alliance group
+int ALLY_FLOOD_SENDER_BURST = 5;		// Messages a sender may post at once
+int ALLY_FLOOD_SENDER_REFILL_MS = 1500;	// A sender regains one message every this many ms
+int ALLY_FLOOD_GROUP_BURST = 30;		// Messages an alliance group may post at once
+int ALLY_FLOOD_GROUP_REFILL_MS = 200;	// An alliance group regains one message every this many ms
+int ALLY_FLOOD_STRIKES = 3;			// Dropped messages before a sender is muted (0 = never mute)
+int ALLY_FLOOD_STRIKE_RESET_MS = 30000;	// A sender who drops nothing for this long starts over
+int ALLY_FLOOD_MUTE_MS = 10000;		// First mute, doubled for every further mute
+int ALLY_FLOOD_MUTE_MAX_MS = 600000;	// Longest mute
+bool ALLY_LOG = true;				// Log ally chat to ALLY_LOG_TABLE
+char ALLY_LOG_TABLE[32] = "ally_chat_log";	// Table of logged ally chat (see ally_chat_log.sql)
+int ALLY_LOG_BATCH = 100;			// Rows per INSERT, a full batch is written right away
+int ALLY_LOG_FLUSH_MS = 1000;		// Queued messages are written at least this often
+
+// Trace categories and events of alliance chat
+enum ally_trace_category {
+	ALLY_TRACE_CHAT = 0x1,
+	ALLY_TRACE_FLOOD = 0x2,
+};
+
+enum ally_trace_event {
+	ALLY_EV_MESSAGE = 1,
+	ALLY_EV_TRUNCATED,
+	ALLY_EV_RELAYED,
+	ALLY_EV_FLOOD_DROP,
+	ALLY_EV_FLOOD_MUTE,
+};
+
+static const char* const ally_trace_categories[] = { "chat", "flood", NULL };
+
+static const struct ns_trace_event ally_trace_events[] = {
+	{ ALLY_EV_MESSAGE, "clif_send_guild_alliance_message", "CID=%d, guild_id=%d, len=%d, recipients=%d" },
+	{ ALLY_EV_TRUNCATED, "clif_parse_guild_alliance_message", "truncated guild_id=%d, len=%d, max=%d" },
+	{ ALLY_EV_RELAYED, "chrif_parse_ally_chat_relay", "guild_id=%d, len=%d, recipients=%d" },
+	{ ALLY_EV_FLOOD_DROP, "ally_flood_check", "CID=%d, guild_id=%d, group=%d, recipients=%d" },
+	{ ALLY_EV_FLOOD_MUTE, "ally_flood_strike", "CID=%d, mute_ms=%d, mutes=%d" },
+};
+
+static struct ns_trace ally_trace;
+
 // Packet headers for alliance chat
 enum ally_chat_packet_headers {
 	HEADER_ZC_ALLY_CHAT = 0x0bde,
@@ -70,50 +134,591 @@ struct PACKET_ZC_ALLY_CHAT {
 } __attribute__((packed));
 #pragma pack(pop)
 
-// Sends the chat message to all guild and allied members
-static void clif_send_guild_alliance_message(struct guild* g, const char* mes, int len)
+// Longest message text a ZC_ALLY_CHAT packet carries, longer ones are truncated
+#define ALLY_CHAT_MESSAGE_MAX ((int)(CHAT_SIZE_MAX - sizeof(struct PACKET_ZC_ALLY_CHAT) - 1))
+
+// Token bucket of the flood control, see ally_flood_check
+struct ally_bucket {
+	int tokens;
+	int64 last_tick;		// Tick of the last refill
+};
+
+// Recipient roster of a guild's alliance chat: socket and character ID of the online
+// members of the guild and of its non-opposition allies, in one flat array. Hooks on member login and
+// logout, join and leave, guild info updates and alliance changes mark the rosters
+// they touch as stale; a stale roster is rebuilt by the next message, so sending is
+// one pass over the array instead of a guild lookup and member walk per ally.
+struct ally_roster {
+	int guild_id;
+	bool dirty;
+	int count;
+	int max;
+	struct ns_fanout_target* targets;
+};
+
+static struct DBMap* ally_rosters = NULL;	// guild_id -> struct ally_roster
+static struct ns_fanout ally_fanout;		// Encode buffer shared by all messages
+
+static void ally_roster_add_guild(struct ally_roster* r, const struct guild* g)
+{
+	for (int i = 0; i < g->max_member && i < MAX_GUILD; i++) {
+		struct map_session_data* sd = g->member[i].sd;
+		if (!sd)
+			continue;
+
+		if (r->count >= r->max) {
+			r->max = max(r->max * 2, 32);
+			RECREATE(r->targets, struct ns_fanout_target, r->max);
+		}
+		r->targets[r->count].fd = sd->fd;
+		r->targets[r->count].char_id = sd->status.char_id;
+		r->count++;
+	}
+}
+
+static void ally_roster_rebuild(struct ally_roster* r, const struct guild* g)
+{
+	r->count = 0;
+	ally_roster_add_guild(r, g);
+
+	for (int i = 0; i < MAX_GUILDALLIANCE; i++) {
+		if (g->alliance[i].guild_id && g->alliance[i].opposition == 0) {
+			const struct guild* ag = guild->search(g->alliance[i].guild_id);
+			if (ag)
+				ally_roster_add_guild(r, ag);
+		}
+	}
+	r->dirty = false;
+}
+
+// Returns the up to date roster of a guild, creating it on first use
+static struct ally_roster* ally_roster_get(const struct guild* g)
+{
+	struct ally_roster* r = idb_get(ally_rosters, g->guild_id);
+
+	if (!r) {
+		CREATE(r, struct ally_roster, 1);
+		r->guild_id = g->guild_id;
+		r->dirty = true;
+		idb_put(ally_rosters, g->guild_id, r);
+	}
+	if (r->dirty)
+		ally_roster_rebuild(r, g);
+	return r;
+}
+
+// Marks the roster of a guild and the rosters of its allies (which list its members) stale
+static void ally_roster_invalidate(int guild_id)
 {
-	struct map_session_data* sd = guild->getavailablesd(g);
-	size_t max_len = CHAT_SIZE_MAX - sizeof(struct PACKET_ZC_ALLY_CHAT) - 1;
+	struct ally_roster* r;
+	const struct guild* g;
 
-	if (!sd || len <= 0)
+	if (guild_id == 0 || !ally_rosters)
 		return;
 
-	if ((size_t)len > max_len) {
-		ShowWarning("clif_send_guild_alliance_message: Truncated message '%s' (len=%d, max=%zu, guild_id=%u).\n",
-			mes, len, max_len, (unsigned int)g->guild_id);
-		len = (int)max_len;
+	if ((r = idb_get(ally_rosters, guild_id)) != NULL)
+		r->dirty = true;
+
+	if ((g = guild->search(guild_id)) == NULL)
+		return;
+
+	for (int i = 0; i < MAX_GUILDALLIANCE; i++) {
+		if (g->alliance[i].guild_id && (r = idb_get(ally_rosters, g->alliance[i].guild_id)) != NULL)
+			r->dirty = true;
 	}
+}
 
-	size_t packet_len = sizeof(struct PACKET_ZC_ALLY_CHAT) + len + 1;
-	struct PACKET_ZC_ALLY_CHAT* p = (struct PACKET_ZC_ALLY_CHAT*)aMalloc(packet_len);
-	if (!p)
+static void ally_roster_invalidate_all(void)
+{
+	struct DBIterator* iter = db_iterator(ally_rosters);
+
+	for (struct ally_roster* r = dbi_first(iter); dbi_exists(iter); r = dbi_next(iter))
+		r->dirty = true;
+	dbi_destroy(iter);
+}
+
+static void ally_roster_final(void)
+{
+	struct DBIterator* iter = db_iterator(ally_rosters);
+
+	for (struct ally_roster* r = dbi_first(iter); dbi_exists(iter); r = dbi_next(iter)) {
+		aFree(r->targets);
+		aFree(r);
+	}
+	dbi_destroy(iter);
+	db_destroy(ally_rosters);
+	ally_rosters = NULL;
+}
+
+//===== Cross-server relay =====
+// With ALLY_CHAT_RELAY, every message is also queued for the other map-servers of
+// the cluster. The messages of one tick go to the char-server in one packet; the
+// ns_client_ally_chat_relay char-server plugin forwards them to every other
+// map-server, which delivers them to the local members of the sender's guild and
+// of the allies listed in the entry.
+struct ally_relay_batch {
+	uint8 buf[ALLY_CHAT_RELAY_MAX];
+	size_t len;
+	int count;
+	int timer;
+};
+
+static struct ally_relay_batch ally_relay_out;
+static struct ally_roster ally_relay_scratch;	// Recipients of one relayed message
+
+static void ally_relay_flush(void)
+{
+	struct ally_relay_batch* b = &ally_relay_out;
+	struct PACKET_ALLY_CHAT_RELAY* p = (struct PACKET_ALLY_CHAT_RELAY*)b->buf;
+
+	if (b->count == 0)
 		return;
 
-	p->packetType = HEADER_ZC_ALLY_CHAT;
-	p->packetLength = (uint16)packet_len;
-	memcpy(p->message, mes, len);
-	p->message[len] = '\0';
+	if (chrif->isconnected()) {
+		p->packetType = HEADER_ALLY_CHAT_RELAY_SEND;
+		p->packetLength = (uint16)b->len;
+		p->count = (uint16)b->count;
 
-	clif->send(p, p->packetLength, &sd->bl, GUILD);
+		WFIFOHEAD(chrif->fd, b->len);
+		memcpy(WFIFOP(chrif->fd, 0), b->buf, b->len);
+		WFIFOSET(chrif->fd, b->len);
+	}
+
+	b->len = sizeof(struct PACKET_ALLY_CHAT_RELAY);
+	b->count = 0;
+}
+
+static int ally_relay_flush_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	ally_relay_out.timer = INVALID_TIMER;
+	ally_relay_flush();
+	return 0;
+}
+
+// Queues a message for the other map-servers, sent at the end of the tick
+static void ally_relay_queue(const struct guild* g, const char* mes, int len)
+{
+	struct ally_relay_batch* b = &ally_relay_out;
+	int32 allies[MAX_GUILDALLIANCE];
+	int ally_count = 0;
 
 	for (int i = 0; i < MAX_GUILDALLIANCE; i++) {
-		if (g->alliance[i].guild_id && g->alliance[i].opposition == 0) {
-			struct guild* ag = guild->search(g->alliance[i].guild_id);
-			struct map_session_data* allysd;
+		if (g->alliance[i].guild_id && g->alliance[i].opposition == 0)
+			allies[ally_count++] = g->alliance[i].guild_id;
+	}
+
+	size_t size = sizeof(struct ally_chat_relay_entry) + ally_count * sizeof(int32) + len;
+	if (b->len + size > sizeof(b->buf))
+		ally_relay_flush();
+
+	struct ally_chat_relay_entry entry;
+	entry.guild_id = g->guild_id;
+	entry.message_len = (uint16)len;
+	entry.ally_count = (uint8)ally_count;
+	entry.reserved = 0;
+
+	memcpy(b->buf + b->len, &entry, sizeof(entry));
+	memcpy(b->buf + b->len + sizeof(entry), allies, ally_count * sizeof(int32));
+	memcpy(b->buf + b->len + sizeof(entry) + ally_count * sizeof(int32), mes, len);
+	b->len += size;
+	b->count++;
+
+	if (b->timer == INVALID_TIMER)
+		b->timer = timer->add(timer->gettick(), ally_relay_flush_timer, 0, 0);
+}
+
+// Delivers the messages other map-servers relayed through the char-server
+static void chrif_parse_ally_chat_relay(int fd)
+{
+	const struct PACKET_ALLY_CHAT_RELAY* p = (const struct PACKET_ALLY_CHAT_RELAY*)RFIFOP(fd, 0);
+	const uint8* pos = p->data;
+	const uint8* end = (const uint8*)p + p->packetLength;
+	for (int n = 0; n < p->count; n++) {
+		struct ally_chat_relay_entry entry;
+
+		if (pos + sizeof(entry) > end)
+			break;
+		memcpy(&entry, pos, sizeof(entry));
+
+		size_t allies_len = entry.ally_count * sizeof(int32);
+		if (pos + sizeof(entry) + allies_len + entry.message_len > end)
+			break;
+
+		const uint8* allies = pos + sizeof(entry);
+		const char* mes = (const char*)(allies + allies_len);
+		int len = (int)min((int)entry.message_len, ALLY_CHAT_MESSAGE_MAX);
+		pos += sizeof(entry) + allies_len + entry.message_len;
+
+		struct ally_roster* r = &ally_relay_scratch;
+		const struct guild* g;
+		r->count = 0;
+		if ((g = guild->search(entry.guild_id)) != NULL)
+			ally_roster_add_guild(r, g);
+		for (int i = 0; i < entry.ally_count; i++) {
+			int32 ally_id;
+			memcpy(&ally_id, allies + i * sizeof(int32), sizeof(ally_id));
+			if ((g = guild->search(ally_id)) != NULL)
+				ally_roster_add_guild(r, g);
+		}
+		if (r->count == 0)
+			continue;
+
+		size_t packet_len = sizeof(struct PACKET_ZC_ALLY_CHAT) + len + 1;
+		struct PACKET_ZC_ALLY_CHAT* out = (struct PACKET_ZC_ALLY_CHAT*)ns_fanout_begin(&ally_fanout, packet_len);
+		if (!out)
+			continue;
+
+		out->packetType = HEADER_ZC_ALLY_CHAT;
+		out->packetLength = (uint16)packet_len;
+		memcpy(out->message, mes, len);
+		out->message[len] = '\0';
+
+		int sent = ns_fanout_send(&ally_fanout, r->targets, r->count);
+		ns_trace(&ally_trace, ALLY_TRACE_CHAT, ALLY_EV_RELAYED, entry.guild_id, len, sent, 0);
+	}
+}
+
+//===== Flood control =====
+// Two token buckets are checked before a valid message is encoded or relayed: one
+// per sender and one per alliance group, so neither one player nor a whole alliance
+// can flood the recipients. A token is only taken when both buckets have one. The
+// alliance group of a guild is keyed by the lowest guild ID among the guild and its
+// non-opposition allies, so all guilds of a fully allied group share one bucket.
+// A sender who runs dry ALLY_FLOOD_STRIKES times without pausing for
+// ALLY_FLOOD_STRIKE_RESET_MS is muted; each further mute doubles, up to
+// ALLY_FLOOD_MUTE_MAX_MS.
+struct ally_flood_data {
+	struct ally_bucket bucket;
+	int strikes;			// Drops since the last pause
+	int mutes;				// Mutes since the last pause, doubles the next one
+	int64 last_drop;
+	int64 muted_until;
+};
+
+struct ally_flood_stat {
+	uint64 dropped_sender;		// Messages over the sender limit
+	uint64 dropped_group;		// Messages over the alliance group limit
+	uint64 dropped_muted;		// Messages of muted senders
+	uint64 mutes;
+	uint64 bytes_avoided;		// Bytes the dropped messages would have sent
+};
+
+static struct ally_flood_stat ally_flood;
+static struct DBMap* ally_group_buckets = NULL;	// Alliance group ID -> struct ally_bucket
+
+// Refills the bucket for the time elapsed since the last refill
+static void ally_bucket_refill(struct ally_bucket* b, int burst, int refill_ms, int64 tick)
+{
+	if (b->last_tick == 0) {
+		b->tokens = burst;
+		b->last_tick = tick;
+	}
+	else if (refill_ms > 0 && tick - b->last_tick >= refill_ms) {
+		int64 add = (tick - b->last_tick) / refill_ms;
+		b->tokens = (int)min((int64)burst, b->tokens + add);
+		b->last_tick = (b->tokens == burst) ? tick : b->last_tick + add * refill_ms;
+	}
+}
+
+// Returns the ID the alliance group of the guild is keyed by
+static int ally_group_id(const struct guild* g)
+{
+	int group_id = g->guild_id;
+
+	for (int i = 0; i < MAX_GUILDALLIANCE; i++) {
+		if (g->alliance[i].guild_id && g->alliance[i].opposition == 0)
+			group_id = min(group_id, g->alliance[i].guild_id);
+	}
+	return group_id;
+}
+
+static struct ally_bucket* ally_group_bucket_get(int group_id)
+{
+	struct ally_bucket* b = idb_get(ally_group_buckets, group_id);
+	if (!b) {
+		CREATE(b, struct ally_bucket, 1);
+		idb_put(ally_group_buckets, group_id, b);
+	}
+	return b;
+}
+
+static struct ally_flood_data* ally_flood_data_get(struct map_session_data* sd)
+{
+	struct ally_flood_data* fl = getFromMSD(sd, 0);
+	if (!fl) {
+		CREATE(fl, struct ally_flood_data, 1);
+		addToMSD(sd, fl, 0, true);
+	}
+	return fl;
+}
+
+// Counts a dropped message against the sender and mutes repeat offenders.
+// The pause that resets the strikes and mutes is counted from the end of the
+// last mute, so a mute never counts as a pause and mutes keep doubling.
+static void ally_flood_strike(struct map_session_data* sd, struct ally_flood_data* fl, int64 tick)
+{
+	if (tick - max(fl->last_drop, fl->muted_until) >= ALLY_FLOOD_STRIKE_RESET_MS) {
+		fl->strikes = 0;
+		fl->mutes = 0;
+	}
+	fl->last_drop = tick;
+
+	if (ALLY_FLOOD_STRIKES <= 0 || ++fl->strikes < ALLY_FLOOD_STRIKES)
+		return;
+
+	int64 mute = (int64)ALLY_FLOOD_MUTE_MS << min(fl->mutes, 16);
+	mute = min(mute, (int64)ALLY_FLOOD_MUTE_MAX_MS);
+	fl->muted_until = tick + mute;
+	fl->strikes = 0;
+	fl->mutes++;
+	ally_flood.mutes++;
+
+	char output[CHAT_SIZE_MAX];
+	safesnprintf(output, sizeof(output), "Alliance chat is muted for %d seconds for flooding.", (int)(mute / 1000));
+	clif->message(sd->fd, output);
+	ns_trace(&ally_trace, ALLY_TRACE_FLOOD, ALLY_EV_FLOOD_MUTE, sd->status.char_id, (int32)mute, fl->mutes, 0);
+}
+
+// Returns true if the sender may post a message of len bytes to the guild's roster
+static bool ally_flood_check(struct map_session_data* sd, const struct guild* g, const struct ally_roster* r, int len)
+{
+	if (!ALLY_FLOOD_CONTROL)
+		return true;
+
+	struct ally_flood_data* fl = ally_flood_data_get(sd);
+	int64 tick = timer->gettick();
+	uint64 avoided = (uint64)(sizeof(struct PACKET_ZC_ALLY_CHAT) + len + 1) * r->count;
+
+	if (fl->muted_until > tick) {
+		ally_flood.dropped_muted++;
+		ally_flood.bytes_avoided += avoided;
+		return false;
+	}
+
+	int group_id = ally_group_id(g);
+	struct ally_bucket* group = ally_group_bucket_get(group_id);
+	ally_bucket_refill(&fl->bucket, ALLY_FLOOD_SENDER_BURST, ALLY_FLOOD_SENDER_REFILL_MS, tick);
+	ally_bucket_refill(group, ALLY_FLOOD_GROUP_BURST, ALLY_FLOOD_GROUP_REFILL_MS, tick);
+
+	if (fl->bucket.tokens <= 0) {
+		ally_flood.dropped_sender++;
+		ally_flood.bytes_avoided += avoided;
+		ns_trace(&ally_trace, ALLY_TRACE_FLOOD, ALLY_EV_FLOOD_DROP, sd->status.char_id, g->guild_id, 0, r->count);
+		ally_flood_strike(sd, fl, tick);
+		return false;
+	}
+
+	if (group->tokens <= 0) {
+		ally_flood.dropped_group++;
+		ally_flood.bytes_avoided += avoided;
+		ns_trace(&ally_trace, ALLY_TRACE_FLOOD, ALLY_EV_FLOOD_DROP, sd->status.char_id, group_id, 1, r->count);
+		return false;
+	}
+
+	fl->bucket.tokens--;
+	group->tokens--;
+	return true;
+}
 
-			if (!ag)
-				continue;
+//===== Chat log =====
+// Every alliance message is logged to ALLY_LOG_TABLE for GM audits. The map-server
+// thread only copies the message into a lock-free single-producer ring; a writer
+// thread with its own SQL connection drains it in multi-row INSERTs of up to
+// ALLY_LOG_BATCH rows, every ALLY_LOG_FLUSH_MS or as soon as a full batch is queued.
+// When the database falls behind and the ring fills up, new messages are dropped
+// and counted: the map-server thread never waits on SQL. A failed INSERT is counted
+// and not retried, for the same reason; a lost connection is reopened for the next
+// batch. The writer only uses its raw ns_db connection and libc memory (see ns_db.h).
+#define ALLY_LOG_RING_SIZE 4096		// Messages in the ring, must be a power of two
 
-			allysd = guild->getavailablesd(ag);
-			if (!allysd)
-				continue;
+struct ally_log_record {
+	uint32 time;
+	int account_id;
+	int char_id;
+	int guild_id;
+	int recipients;			// Alliance members the message reached on this map-server
+	uint16 len;
+	char name[NAME_LENGTH];
+	char message[CHAT_SIZE_MAX + NAME_LENGTH * 2];
+};
+
+struct ally_log_data {
+	struct ally_log_record ring[ALLY_LOG_RING_SIZE];
+	volatile int32 head;		// Next slot to write, owned by the map-server thread
+	volatile int32 tail;		// Next slot to write to SQL, owned by the writer thread
+	volatile int32 dropped;		// Messages lost because the ring was full
+	volatile int32 written;		// Rows inserted
+	volatile int32 failed;		// Rows lost to failed INSERTs
+	volatile int32 running;
+	struct thread_handle* writer;
+	struct mutex_data* lock;
+	struct cond_data* wake;
+	struct ns_db db;			// Owned by the writer thread once it runs
+	char error[256];			// Last writer error, guarded by lock
+};
+
+static struct ally_log_data ally_log;
 
-			clif->send(p, p->packetLength, &allysd->bl, GUILD);
+// Inserts records [tail, tail + count) of the ring in one statement
+static bool ally_log_insert(struct ns_db* db, struct ns_db_buf* buf, uint32 tail, int count)
+{
+	char esc_name[NAME_LENGTH * 2 + 1];
+	char esc_message[(CHAT_SIZE_MAX + NAME_LENGTH * 2) * 2 + 1];
+
+	ns_db_buf_clear(buf);
+	ns_db_buf_printf(buf, "INSERT INTO `%s` (`time`, `account_id`, `char_id`, `name`, `guild_id`, `recipients`, `message`) VALUES ", ALLY_LOG_TABLE);
+	for (int i = 0; i < count; i++) {
+		const struct ally_log_record* rec = &ally_log.ring[(tail + i) & (ALLY_LOG_RING_SIZE - 1)];
+
+		ns_db_escape(db, esc_name, rec->name, strnlen(rec->name, NAME_LENGTH));
+		ns_db_escape(db, esc_message, rec->message, rec->len);
+		ns_db_buf_printf(buf, "%s(FROM_UNIXTIME('%u'), '%d', '%d', '%s', '%d', '%d', '%s')", i > 0 ? "," : "",
+			rec->time, rec->account_id, rec->char_id, esc_name, rec->guild_id, rec->recipients, esc_message);
+	}
+
+	if (buf->failed) {
+		snprintf(db->error, sizeof(db->error), "Out of memory for the INSERT.");
+		return false;
+	}
+	return ns_db_query(db, buf->data, buf->len);
+}
+
+static void* ally_log_writer_main(void* param)
+{
+	struct ns_db* db = &ally_log.db;
+	struct ns_db_buf buf = { 0 };
+
+	for (;;) {
+		bool running = InterlockedExchangeAdd(&ally_log.running, 0) != 0;
+		uint32 tail = (uint32)ally_log.tail;
+		uint32 head = (uint32)InterlockedExchangeAdd(&ally_log.head, 0);
+
+		while (head != tail) {
+			int count = (int)min(head - tail, (uint32)ALLY_LOG_BATCH);
+
+			// ns_db_ready reconnects when a previous query lost the connection
+			if (ns_db_ready(db) && ally_log_insert(db, &buf, tail, count)) {
+				InterlockedExchangeAdd(&ally_log.written, count);
+			} else {
+				InterlockedExchangeAdd(&ally_log.failed, count);
+				mutex->lock(ally_log.lock);
+				snprintf(ally_log.error, sizeof(ally_log.error), "%s", db->error);
+				mutex->unlock(ally_log.lock);
+			}
+
+			tail += count;
+			InterlockedExchange(&ally_log.tail, (int32)tail); // Frees the slots for the map-server thread
 		}
+
+		if (!running)
+			break;
+
+		mutex->lock(ally_log.lock);
+		mutex->cond_wait(ally_log.wake, ally_log.lock, ALLY_LOG_FLUSH_MS);
+		mutex->unlock(ally_log.lock);
+	}
+
+	ns_db_buf_free(&buf);
+	ns_db_final(db);
+	return NULL;
+}
+
+// Queues one message for the log. Only call from the map-server thread.
+static void ally_log_push(struct map_session_data* sd, const struct guild* g, const char* mes, int len, int recipients)
+{
+	if (!ally_log.writer)
+		return;
+
+	uint32 head = (uint32)ally_log.head;
+	uint32 queued = head - (uint32)InterlockedExchangeAdd(&ally_log.tail, 0);
+
+	if (queued >= ALLY_LOG_RING_SIZE) {
+		InterlockedIncrement(&ally_log.dropped);
+		return;
 	}
 
-	aFree(p);
+	struct ally_log_record* rec = &ally_log.ring[head & (ALLY_LOG_RING_SIZE - 1)];
+	rec->time = (uint32)time(NULL);
+	rec->account_id = sd->status.account_id;
+	rec->char_id = sd->status.char_id;
+	rec->guild_id = g->guild_id;
+	rec->recipients = recipients;
+	rec->len = (uint16)min(len, (int)sizeof(rec->message));
+	safestrncpy(rec->name, sd->status.name, sizeof(rec->name));
+	memcpy(rec->message, mes, rec->len);
+
+	InterlockedExchange(&ally_log.head, (int32)(head + 1)); // Publishes the record to the writer
+
+	// Wake the writer for a full batch. Signalled without the lock: a missed
+	// wakeup only delays the batch to the next ALLY_LOG_FLUSH_MS.
+	if (queued + 1 == (uint32)ALLY_LOG_BATCH)
+		mutex->cond_signal(ally_log.wake);
+}
+
+static void ally_log_init(void)
+{
+	memset(&ally_log, 0, sizeof(ally_log));
+	if (!ALLY_LOG)
+		return;
+
+	ally_log.running = 1;
+	ally_log.lock = mutex->create();
+	ally_log.wake = mutex->cond_create();
+	ns_db_setup(&ally_log.db, map->map_server_ip, map->map_server_port, map->map_server_id,
+		map->map_server_pw, map->map_server_db, map->default_codepage);
+	ally_log.writer = thread->create(ally_log_writer_main, NULL);
+
+	if (!ally_log.writer)
+		ShowError("ally_log_init: Could not start the ally chat log writer, alliance chat is not logged.\n");
+}
+
+// Stops the writer after it has written the queued messages
+static void ally_log_final(void)
+{
+	if (ally_log.writer) {
+		InterlockedExchange(&ally_log.running, 0);
+		mutex->lock(ally_log.lock);
+		mutex->cond_signal(ally_log.wake);
+		mutex->unlock(ally_log.lock);
+		thread->wait(ally_log.writer, NULL);
+		ally_log.writer = NULL;
+	}
+
+	if (ally_log.wake)
+		mutex->cond_destroy(ally_log.wake);
+	if (ally_log.lock)
+		mutex->destroy(ally_log.lock);
+	ally_log.wake = NULL;
+	ally_log.lock = NULL;
+}
+
+// Sends the chat message to all guild and allied members, returns how many got it.
+// len must not exceed ALLY_CHAT_MESSAGE_MAX.
+static int clif_send_guild_alliance_message(struct guild* g, int char_id, const char* mes, int len)
+{
+	if (len <= 0 || len > ALLY_CHAT_MESSAGE_MAX)
+		return 0;
+
+	if (ALLY_CHAT_RELAY)
+		ally_relay_queue(g, mes, len);
+
+	struct ally_roster* r = ally_roster_get(g);
+	if (r->count == 0)
+		return 0;
+
+	size_t packet_len = sizeof(struct PACKET_ZC_ALLY_CHAT) + len + 1;
+	struct PACKET_ZC_ALLY_CHAT* p = (struct PACKET_ZC_ALLY_CHAT*)ns_fanout_begin(&ally_fanout, packet_len);
+	if (!p)
+		return 0;
+
+	p->packetType = HEADER_ZC_ALLY_CHAT;
+	p->packetLength = (uint16)packet_len;
+	memcpy(p->message, mes, len);
+	p->message[len] = '\0';
+
+	int sent = ns_fanout_send(&ally_fanout, r->targets, r->count);
+	ns_trace(&ally_trace, ALLY_TRACE_CHAT, ALLY_EV_MESSAGE, char_id, g->guild_id, len, sent);
+	return sent;
 }
 
 // Handles incoming client packet for alliance chat
@@ -123,28 +728,180 @@ static void clif_parse_guild_alliance_message(int fd)
 	if (!sd)
 		return;
 
+	if (sd->status.guild_id == 0)
+		return;
+
+	struct guild* g = guild->search(sd->status.guild_id);
+	if (!g)
+		return;
+
 	char output[CHAT_SIZE_MAX + NAME_LENGTH * 2];
 	const struct packet_chat_message* packet = RP2PTR(fd);
 
 	if (!clif->process_chat_message(sd, packet, output, sizeof output))
 		return;
 
-	if (sd->status.guild_id == 0)
-		return;
+	// Truncated here, so the log holds the text that was actually sent
+	int len = (int)strlen(output);
+	if (len > ALLY_CHAT_MESSAGE_MAX) {
+		ns_trace(&ally_trace, ALLY_TRACE_CHAT, ALLY_EV_TRUNCATED, g->guild_id, len, ALLY_CHAT_MESSAGE_MAX, 0);
+		len = ALLY_CHAT_MESSAGE_MAX;
+	}
 
-	struct guild* g = guild->search(sd->status.guild_id);
-	if (!g)
+	if (!ally_flood_check(sd, g, ally_roster_get(g), len))
 		return;
 
-	clif_send_guild_alliance_message(g, output, (int)strlen(output));
+	int sent = clif_send_guild_alliance_message(g, sd->status.char_id, output, len);
+	if (ALLY_LOG)
+		ally_log_push(sd, g, output, len, sent);
+}
+
+//===== Roster maintenance hooks =====
+static void guild_member_joined_post(struct map_session_data* sd)
+{
+	if (sd)
+		ally_roster_invalidate(sd->status.guild_id);
+}
+
+static int guild_recv_memberinfoshort_post(int retVal, int guild_id, int account_id, int char_id, int online, int lv, int class)
+{
+	ally_roster_invalidate(guild_id);
+	return retVal;
+}
+
+static int guild_recv_info_post(int retVal, const struct guild* sg)
+{
+	if (sg)
+		ally_roster_invalidate(sg->guild_id);
+	return retVal;
+}
+
+static int guild_member_added_post(int retVal, int guild_id, int account_id, int char_id, int flag)
+{
+	ally_roster_invalidate(guild_id);
+	return retVal;
+}
+
+static int guild_member_withdraw_post(int retVal, int guild_id, int account_id, int char_id, int flag, const char* name, const char* mes)
+{
+	ally_roster_invalidate(guild_id);
+	return retVal;
+}
+
+// Both sides, since after a break neither guild lists the other anymore
+static int guild_allianceack_post(int retVal, int guild_id1, int guild_id2, int account_id1, int account_id2, int flag, const char* name1, const char* name2)
+{
+	ally_roster_invalidate(guild_id1);
+	ally_roster_invalidate(guild_id2);
+	return retVal;
+}
+
+static int guild_broken_post(int retVal, int guild_id, int flag)
+{
+	struct ally_roster* r = idb_get(ally_rosters, guild_id);
+
+	if (r) {
+		idb_remove(ally_rosters, guild_id);
+		aFree(r->targets);
+		aFree(r);
+	}
+	ally_roster_invalidate_all(); // The guild is gone, so its allies cannot be looked up anymore
+	return retVal;
+}
+
+static int map_quit_pre(struct map_session_data** sd)
+{
+	if (*sd)
+		ally_roster_invalidate((*sd)->status.guild_id);
+	return 0;
+}
+
+// Toggles trace categories and decodes the trace file, see ns_trace_command
+ACMD(allytrace)
+{
+	char reply[CHAT_SIZE_MAX];
+
+	ns_trace_command(&ally_trace, message, reply, sizeof(reply));
+	clif->message(fd, reply);
+	return true;
+}
+
+// Shows the flood control counters
+ACMD(allyflood)
+{
+	char output[CHAT_SIZE_MAX];
+
+	safesnprintf(output, sizeof(output), "Ally chat flood control: %s, sender %d/%dms, group %d/%dms, mute after %d drops.",
+		ALLY_FLOOD_CONTROL ? "on" : "off", ALLY_FLOOD_SENDER_BURST, ALLY_FLOOD_SENDER_REFILL_MS,
+		ALLY_FLOOD_GROUP_BURST, ALLY_FLOOD_GROUP_REFILL_MS, ALLY_FLOOD_STRIKES);
+	clif->message(fd, output);
+	safesnprintf(output, sizeof(output), "Dropped: %"PRIu64" sender, %"PRIu64" group, %"PRIu64" muted. Mutes: %"PRIu64". Bytes avoided: %"PRIu64".",
+		ally_flood.dropped_sender, ally_flood.dropped_group, ally_flood.dropped_muted, ally_flood.mutes, ally_flood.bytes_avoided);
+	clif->message(fd, output);
+	return true;
+}
+
+// Shows the chat log counters
+ACMD(allylog)
+{
+	char output[CHAT_SIZE_MAX];
+	uint32 queued = (uint32)ally_log.head - (uint32)ally_log.tail;
+
+	safesnprintf(output, sizeof(output), "Ally chat log: %s, %u queued, %d written, %d dropped (queue full), %d failed.",
+		ally_log.writer ? "on" : "off", queued, (int)ally_log.written, (int)ally_log.dropped, (int)ally_log.failed);
+	clif->message(fd, output);
+
+	if (ally_log.lock) {
+		mutex->lock(ally_log.lock);
+		if (ally_log.error[0] != '\0') {
+			safesnprintf(output, sizeof(output), "Last error: %s", ally_log.error);
+			clif->message(fd, output);
+		}
+		mutex->unlock(ally_log.lock);
+	}
+	return true;
 }
 
 #if PACKETVER >= 20230607
 HPExport void plugin_init(void)
 {
 	addPacket(HEADER_CZ_ALLY_CHAT, -1, clif_parse_guild_alliance_message, hpClif_Parse);
+	addPacket(HEADER_ALLY_CHAT_RELAY_DELIVER, -1, chrif_parse_ally_chat_relay, hpChrif_Parse);
 	packets->addLen(HEADER_CZ_ALLY_CHAT, -1);
 	packets->addLen(HEADER_ZC_ALLY_CHAT, -1);
+
+	addAtcommand("allytrace", allytrace);
+	addAtcommand("allyflood", allyflood);
+	addAtcommand("allylog", allylog);
+
+	addHookPost(guild, member_joined, guild_member_joined_post);
+	addHookPost(guild, recv_memberinfoshort, guild_recv_memberinfoshort_post);
+	addHookPost(guild, recv_info, guild_recv_info_post);
+	addHookPost(guild, member_added, guild_member_added_post);
+	addHookPost(guild, member_withdraw, guild_member_withdraw_post);
+	addHookPost(guild, allianceack, guild_allianceack_post);
+	addHookPost(guild, broken, guild_broken_post);
+	addHookPre(map, quit, map_quit_pre);
+
+	ally_rosters = idb_alloc(DB_OPT_BASE);
+	ally_group_buckets = idb_alloc(DB_OPT_RELEASE_DATA);
+
+	ally_relay_out.len = sizeof(struct PACKET_ALLY_CHAT_RELAY);
+	ally_relay_out.timer = INVALID_TIMER;
+	timer->add_func_list(ally_relay_flush_timer, "ally_relay_flush_timer");
+	ally_log_init();
+	ns_trace_init(&ally_trace, "ns_ally_chat", ally_trace_categories, ally_trace_events, ARRAYLENGTH(ally_trace_events), ALLY_TRACE_CATEGORIES);
+}
+
+HPExport void plugin_final(void)
+{
+	ally_roster_final();
+	db_destroy(ally_group_buckets);
+	if (ally_relay_out.timer != INVALID_TIMER)
+		timer->delete(ally_relay_out.timer, ally_relay_flush_timer);
+	aFree(ally_relay_scratch.targets);
+	ally_log_final();
+	ns_trace_final(&ally_trace);
 }
 #else
 HPExport void plugin_init(void)
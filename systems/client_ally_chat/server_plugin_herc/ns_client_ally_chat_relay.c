@@ -0,0 +1,149 @@
+//===== Hercules Plugin ======================================
+//= Client Ally Chat Relay
+//===== By: =================================================
+//= AcidMarco
+//===== Description: =========================================
+//= Companion of ns_client_ally_chat_handler for clusters with
+//= several map-servers. Forwards the alliance messages each
+//= map-server relays to every other map-server, so allied
+//= members hear each other wherever they are logged in.
+//===== Note: ================================================
+//= Messages are collected per destination map-server and sent
+//= once a tick, one packet per map-server however many
+//= messages arrived from however many sources in between.
+//===== Setup: ===============================================
+//= 1. Copy this file and ally_chat_relay.h into \src\plugins\
+//=    and load the plugin on the char-server.
+//= 2. Set ALLY_CHAT_RELAY = true in
+//=    ns_client_ally_chat_handler.c on every map-server.
+//===== Repository Link: =====================================
+//= https://github.com/AcidMarco/ro-releases
+//============================================================
+
+#include "common/hercules.h"
+#include "common/memmgr.h"
+#include "common/socket.h"
+#include "common/showmsg.h"
+#include "common/timer.h"
+
+#include "char/char.h"
+
+#include "common/HPMDataCheck.h"
+
+#include "ally_chat_relay.h"
+
+#include <string.h>
+
+HPExport struct hplugin_info pinfo = {
+	"ns_client_ally_chat_relay",
+	SERVER_TYPE_CHAR,
+	"1.0",
+	HPM_VERSION,
+};
+
+//===== Per-destination batches =====
+// One batch per map-server slot (chr->server[]). The entries are copied as
+// received; the map-servers resolve recipients themselves.
+struct ally_relay_batch {
+	uint8 buf[ALLY_CHAT_RELAY_MAX];
+	size_t len;
+	int count;
+};
+
+struct ally_relay_batch* ally_relay_batches = NULL;
+int ally_relay_timer = INVALID_TIMER;
+
+// Sends the batch of one map-server slot, if any
+void ally_relay_flush_server(int i)
+{
+	struct ally_relay_batch* b = &ally_relay_batches[i];
+	struct PACKET_ALLY_CHAT_RELAY* p = (struct PACKET_ALLY_CHAT_RELAY*)b->buf;
+	int fd = chr->server[i].fd;
+
+	if (b->count == 0)
+		return;
+
+	if (fd > 0 && sockt->session_is_active(fd)) {
+		p->packetType = HEADER_ALLY_CHAT_RELAY_DELIVER;
+		p->packetLength = (uint16)b->len;
+		p->count = (uint16)b->count;
+
+		WFIFOHEAD(fd, b->len);
+		memcpy(WFIFOP(fd, 0), b->buf, b->len);
+		WFIFOSET(fd, b->len);
+	}
+
+	b->len = sizeof(struct PACKET_ALLY_CHAT_RELAY);
+	b->count = 0;
+}
+
+int ally_relay_flush_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	ally_relay_timer = INVALID_TIMER;
+	for (int i = 0; i < MAX_MAP_SERVERS; i++)
+		ally_relay_flush_server(i);
+	return 0;
+}
+
+// Appends one entry to the batch of every map-server but the source
+void ally_relay_append(int source_fd, const uint8* entry, size_t size)
+{
+	for (int i = 0; i < MAX_MAP_SERVERS; i++) {
+		struct ally_relay_batch* b = &ally_relay_batches[i];
+
+		if (chr->server[i].fd <= 0 || chr->server[i].fd == source_fd)
+			continue;
+
+		if (b->len + size > sizeof(b->buf))
+			ally_relay_flush_server(i);
+
+		memcpy(b->buf + b->len, entry, size);
+		b->len += size;
+		b->count++;
+	}
+
+	if (ally_relay_timer == INVALID_TIMER)
+		ally_relay_timer = timer->add(timer->gettick(), ally_relay_flush_timer, 0, 0);
+}
+
+//===== Packets from the map-servers =====
+void mapif_parse_ally_chat_relay(int fd)
+{
+	const struct PACKET_ALLY_CHAT_RELAY* p = (const struct PACKET_ALLY_CHAT_RELAY*)RFIFOP(fd, 0);
+	const uint8* pos = p->data;
+	const uint8* end = (const uint8*)p + p->packetLength;
+
+	for (int n = 0; n < p->count; n++) {
+		struct ally_chat_relay_entry entry;
+
+		if (pos + sizeof(entry) > end)
+			break;
+		memcpy(&entry, pos, sizeof(entry));
+
+		size_t size = sizeof(entry) + entry.ally_count * sizeof(int32) + entry.message_len;
+		if (pos + size > end) {
+			ShowWarning("mapif_parse_ally_chat_relay: Truncated entry from map-server fd %d, dropping the rest of the packet.\n", fd);
+			break;
+		}
+
+		ally_relay_append(fd, pos, size);
+		pos += size;
+	}
+}
+
+HPExport void plugin_init(void)
+{
+	CREATE(ally_relay_batches, struct ally_relay_batch, MAX_MAP_SERVERS);
+	for (int i = 0; i < MAX_MAP_SERVERS; i++)
+		ally_relay_batches[i].len = sizeof(struct PACKET_ALLY_CHAT_RELAY);
+
+	addPacket(HEADER_ALLY_CHAT_RELAY_SEND, -1, mapif_parse_ally_chat_relay, hpParse_FromMap);
+	timer->add_func_list(ally_relay_flush_timer, "ally_relay_flush_timer");
+}
+
+HPExport void plugin_final(void)
+{
+	if (ally_relay_timer != INVALID_TIMER)
+		timer->delete(ally_relay_timer, ally_relay_flush_timer);
+	aFree(ally_relay_batches);
+}
@@ -0,0 +1,625 @@
+//===== Hercules Plugin Helper ===============================
+//= Emotion Pack Catalog
+//===== By: =================================================
+//= AcidMarco
+//===== Description: =========================================
+//= Shared between ns_client_emote_ui_handler (map-server) and
+//= ns_client_emote_ui_catalog (char-server). Holds the client
+//= emotion constants, the fixed-width pack layout, the
+//= emotion_pack_db.conf parser and the versioned binary image
+//= the parsed catalog is stored and distributed as.
+//===== Note: ================================================
+//= Both plugins must be built from the same copy of this file,
+//= an image from a different layout is rejected.
+//===== Setup: ===============================================
+//= Copy this file next to the plugin sources that include it
+//= (\src\plugins\).
+//===== Repository Link: =====================================
+//= https://github.com/AcidMarco/ro-releases
+//============================================================
+#ifndef EMOTE_CATALOG_H
+#define EMOTE_CATALOG_H
+
+#include "common/hercules.h"
+#include "common/conf.h"
+#include "common/memmgr.h"
+#include "common/showmsg.h"
+
+#include <time.h>
+
+//===== Client emotion types =====
+typedef enum client_emotion_type {
+	ET_BLANK = -1,
+	ET_SURPRISE = 0,
+	ET_QUESTION,
+	ET_DELIGHT,
+	ET_THROB,
+	ET_SWEAT,
+	ET_AHA,
+	ET_FRET,
+	ET_ANGER,
+	ET_MONEY,
+	ET_THINK,
+	ET_SCISSOR,
+	ET_ROCK,
+	ET_WRAP,
+	ET_FLAG,
+	ET_BIGTHROB,
+	ET_THANKS,
+	ET_KEK,
+	ET_SORRY,
+	ET_SMILE,
+	ET_PROFUSELY_SWEAT,
+	ET_SCRATCH,
+	ET_BEST,
+	ET_STARE_ABOUT,
+	ET_HUK,
+	ET_O,
+	ET_X,
+	ET_HELP,
+	ET_GO,
+	ET_CRY,
+	ET_KIK,
+	ET_CHUP,
+	ET_CHUPCHUP,
+	ET_HNG,
+	ET_OK,
+	ET_CHAT_PROHIBIT,
+	ET_INDONESIA_FLAG,
+	ET_STARE,
+	ET_HUNGRY,
+	ET_COOL,
+	ET_MERONG,
+	ET_SHY,
+	ET_GOODBOY,
+	ET_SPTIME,
+	ET_SEXY,
+	ET_COMEON,
+	ET_SLEEPY,
+	ET_CONGRATULATION,
+	ET_HPTIME,
+	ET_PH_FLAG,
+	ET_MY_FLAG,
+	ET_SI_FLAG,
+	ET_BR_FLAG,
+	ET_SPARK,
+	ET_CONFUSE,
+	ET_OHNO,
+	ET_HUM,
+	ET_BLABLA,
+	ET_OTL,
+	ET_DICE1,
+	ET_DICE2,
+	ET_DICE3,
+	ET_DICE4,
+	ET_DICE5,
+	ET_DICE6,
+	ET_INDIA_FLAG,
+	ET_LUV,
+	ET_FLAG8,
+	ET_FLAG9,
+	ET_MOBILE,
+	ET_MAIL,
+	ET_ANTENNA0,
+	ET_ANTENNA1,
+	ET_ANTENNA2,
+	ET_ANTENNA3,
+	ET_HUM2,
+	ET_ABS,
+	ET_OOPS,
+	ET_SPIT,
+	ET_ENE,
+	ET_PANIC,
+	ET_WHISP,
+	ET_YUT1,
+	ET_YUT2,
+	ET_YUT3,
+	ET_YUT4,
+	ET_YUT5,
+	ET_YUT6,
+	ET_YUT7,
+	ET_CLICK_ME,
+	ET_DAILY_QUEST,
+	ET_EVENT,
+	ET_JOB_QUEST,
+	ET_TRAFFIC_LINE_QUEST,
+	ET_CUSTOM_1,
+	ET_CUSTOM_2,
+	ET_CUSTOM_3,
+	ET_CUSTOM_4,
+	ET_CUSTOM_5,
+	ET_CUSTOM_6,
+	ET_CUSTOM_7,
+	ET_CUSTOM_8,
+	ET_CUSTOM_9,
+	ET_CUSTOM_10,
+	ET_CUSTOM_11,
+	ET_CUSTOM_12,
+	ET_CUSTOM_13,
+	ET_CUSTOM_14,
+	ET_CUSTOM_15,
+	ET_EMOTION_LAST
+} client_emotion_type;
+
+// Script constant names of the client emotions, registered by the map-server
+// plugin and used to resolve EmotesList entries on either server.
+static const struct emote_catalog_constant {
+	const char* name;
+	int value;
+} emote_catalog_constants[] = {
+	{ "ET_SURPRISE", ET_SURPRISE },
+	{ "ET_QUESTION", ET_QUESTION },
+	{ "ET_DELIGHT", ET_DELIGHT },
+	{ "ET_THROB", ET_THROB },
+	{ "ET_SWEAT", ET_SWEAT },
+	{ "ET_AHA", ET_AHA },
+	{ "ET_FRET", ET_FRET },
+	{ "ET_ANGER", ET_ANGER },
+	{ "ET_MONEY", ET_MONEY },
+	{ "ET_THINK", ET_THINK },
+	{ "ET_SCISSOR", ET_SCISSOR },
+	{ "ET_ROCK", ET_ROCK },
+	{ "ET_WRAP", ET_WRAP },
+	{ "ET_FLAG", ET_FLAG },
+	{ "ET_BIGTHROB", ET_BIGTHROB },
+	{ "ET_THANKS", ET_THANKS },
+	{ "ET_KEK", ET_KEK },
+	{ "ET_SORRY", ET_SORRY },
+	{ "ET_SMILE", ET_SMILE },
+	{ "ET_PROFUSELY_SWEAT", ET_PROFUSELY_SWEAT },
+	{ "ET_SCRATCH", ET_SCRATCH },
+	{ "ET_BEST", ET_BEST },
+	{ "ET_STARE_ABOUT", ET_STARE_ABOUT },
+	{ "ET_HUK", ET_HUK },
+	{ "ET_O", ET_O },
+	{ "ET_X", ET_X },
+	{ "ET_HELP", ET_HELP },
+	{ "ET_GO", ET_GO },
+	{ "ET_CRY", ET_CRY },
+	{ "ET_KIK", ET_KIK },
+	{ "ET_CHUP", ET_CHUP },
+	{ "ET_CHUPCHUP", ET_CHUPCHUP },
+	{ "ET_HNG", ET_HNG },
+	{ "ET_OK", ET_OK },
+	{ "ET_CHAT_PROHIBIT", ET_CHAT_PROHIBIT },
+	{ "ET_INDONESIA_FLAG", ET_INDONESIA_FLAG },
+	{ "ET_STARE", ET_STARE },
+	{ "ET_HUNGRY", ET_HUNGRY },
+	{ "ET_COOL", ET_COOL },
+	{ "ET_MERONG", ET_MERONG },
+	{ "ET_SHY", ET_SHY },
+	{ "ET_GOODBOY", ET_GOODBOY },
+	{ "ET_SPTIME", ET_SPTIME },
+	{ "ET_SEXY", ET_SEXY },
+	{ "ET_COMEON", ET_COMEON },
+	{ "ET_SLEEPY", ET_SLEEPY },
+	{ "ET_CONGRATULATION", ET_CONGRATULATION },
+	{ "ET_HPTIME", ET_HPTIME },
+	{ "ET_PH_FLAG", ET_PH_FLAG },
+	{ "ET_MY_FLAG", ET_MY_FLAG },
+	{ "ET_SI_FLAG", ET_SI_FLAG },
+	{ "ET_BR_FLAG", ET_BR_FLAG },
+	{ "ET_SPARK", ET_SPARK },
+	{ "ET_CONFUSE", ET_CONFUSE },
+	{ "ET_OHNO", ET_OHNO },
+	{ "ET_HUM", ET_HUM },
+	{ "ET_BLABLA", ET_BLABLA },
+	{ "ET_OTL", ET_OTL },
+	{ "ET_DICE1", ET_DICE1 },
+	{ "ET_DICE2", ET_DICE2 },
+	{ "ET_DICE3", ET_DICE3 },
+	{ "ET_DICE4", ET_DICE4 },
+	{ "ET_DICE5", ET_DICE5 },
+	{ "ET_DICE6", ET_DICE6 },
+	{ "ET_INDIA_FLAG", ET_INDIA_FLAG },
+	{ "ET_LUV", ET_LUV },
+	{ "ET_FLAG8", ET_FLAG8 },
+	{ "ET_FLAG9", ET_FLAG9 },
+	{ "ET_MOBILE", ET_MOBILE },
+	{ "ET_MAIL", ET_MAIL },
+	{ "ET_ANTENNA0", ET_ANTENNA0 },
+	{ "ET_ANTENNA1", ET_ANTENNA1 },
+	{ "ET_ANTENNA2", ET_ANTENNA2 },
+	{ "ET_ANTENNA3", ET_ANTENNA3 },
+	{ "ET_HUM2", ET_HUM2 },
+	{ "ET_ABS", ET_ABS },
+	{ "ET_OOPS", ET_OOPS },
+	{ "ET_SPIT", ET_SPIT },
+	{ "ET_ENE", ET_ENE },
+	{ "ET_PANIC", ET_PANIC },
+	{ "ET_WHISP", ET_WHISP },
+	{ "ET_YUT1", ET_YUT1 },
+	{ "ET_YUT2", ET_YUT2 },
+	{ "ET_YUT3", ET_YUT3 },
+	{ "ET_YUT4", ET_YUT4 },
+	{ "ET_YUT5", ET_YUT5 },
+	{ "ET_YUT6", ET_YUT6 },
+	{ "ET_YUT7", ET_YUT7 },
+	{ "ET_CLICK_ME", ET_CLICK_ME },
+	{ "ET_DAILY_QUEST", ET_DAILY_QUEST },
+	{ "ET_EVENT", ET_EVENT },
+	{ "ET_JOB_QUEST", ET_JOB_QUEST },
+	{ "ET_TRAFFIC_LINE_QUEST", ET_TRAFFIC_LINE_QUEST },
+	{ "ET_CUSTOM_1", ET_CUSTOM_1 },
+	{ "ET_CUSTOM_2", ET_CUSTOM_2 },
+	{ "ET_CUSTOM_3", ET_CUSTOM_3 },
+	{ "ET_CUSTOM_4", ET_CUSTOM_4 },
+	{ "ET_CUSTOM_5", ET_CUSTOM_5 },
+	{ "ET_CUSTOM_6", ET_CUSTOM_6 },
+	{ "ET_CUSTOM_7", ET_CUSTOM_7 },
+	{ "ET_CUSTOM_8", ET_CUSTOM_8 },
+	{ "ET_CUSTOM_9", ET_CUSTOM_9 },
+	{ "ET_CUSTOM_10", ET_CUSTOM_10 },
+	{ "ET_CUSTOM_11", ET_CUSTOM_11 },
+	{ "ET_CUSTOM_12", ET_CUSTOM_12 },
+	{ "ET_CUSTOM_13", ET_CUSTOM_13 },
+	{ "ET_CUSTOM_14", ET_CUSTOM_14 },
+	{ "ET_CUSTOM_15", ET_CUSTOM_15 },
+};
+
+// Emotion membership bitmask: one bit per client_emotion_type (ET_EMOTION_LAST fits in 128 bits)
+#define EMOTE_MASK_WORDS ((ET_EMOTION_LAST + 63) / 64)
+
+static inline void emote_mask_set(uint64* mask, int emoteId)
+{
+	mask[emoteId / 64] |= UINT64_C(1) << (emoteId % 64);
+}
+
+static inline bool emote_mask_test(const uint64* mask, int emoteId)
+{
+	return emoteId >= 0 && emoteId < ET_EMOTION_LAST && (mask[emoteId / 64] & (UINT64_C(1) << (emoteId % 64))) != 0;
+}
+
+// Number of emotes in the mask below emoteId
+static inline int emote_mask_rank(const uint64* mask, int emoteId)
+{
+	int rank = 0;
+	for (int w = 0; w <= emoteId / 64; ++w) {
+		uint64 bits = mask[w];
+		if (w == emoteId / 64)
+			bits &= (UINT64_C(1) << (emoteId % 64)) - 1;
+		for (; bits != 0; bits &= bits - 1)
+			rank++;
+	}
+	return rank;
+}
+
+//===== Pack layout =====
+// s_emotion_db only holds fixed-width, pointer-free data so that packs[],
+// index[] and emotes[] can be used straight from a mapped or received image.
+struct s_emotion_db {
+	uint16 packId;
+	uint16 packType;
+	uint16 packPrice;
+	uint16 emote_count;
+	int64 sale_start;
+	int64 sale_end;
+	uint64 rental_period;
+	uint64 emote_mask[EMOTE_MASK_WORDS];	// Membership bitmask of the pack's emotes
+	uint32 emote_offset;	// First emote of this pack in the emote arena
+	uint32 reserved;
+};
+
+static inline time_t plugin_convert_to_unix_timestamp(uint64_t date_val)
+{
+	struct tm tmStruct = { 0 };
+	tmStruct.tm_year = (int)(date_val / 10000) - 1900;
+	tmStruct.tm_mon = (int)((date_val / 100) % 100) - 1;
+	tmStruct.tm_mday = (int)(date_val % 100);
+	return mktime(&tmStruct);
+}
+
+//===== Catalog image =====
+// Image layout: header, packs[], index[], emotes[], each section 8-byte aligned.
+// The checksum doubles as the catalog version: equal checksums mean equal catalogs.
+#define EMOTE_IMAGE_MAGIC 0x42445045	// "EPDB"
+#define EMOTE_IMAGE_VERSION 2
+#define EMOTE_IMAGE_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+struct emote_image_header {
+	uint32 magic;
+	uint32 version;
+	uint32 header_size;
+	uint32 pack_size;		// sizeof(struct s_emotion_db) at compile time
+	uint32 emotion_last;	// ET_EMOTION_LAST at compile time
+	int32 pack_count;
+	int32 index_size;
+	int32 emote_total;
+	int32 max_packs;		// MAX_EMOTION_PACKS the image was parsed with
+	int32 max_emotes;		// MAX_EMOTES_PER_PACK the image was parsed with
+	int64 source_mtime;		// emotion_pack_db.conf modification time
+	int64 source_size;		// emotion_pack_db.conf size
+	uint32 packs_offset;
+	uint32 index_offset;
+	uint32 emotes_offset;
+	uint32 total_size;
+	uint64 checksum;		// FNV-1a 64 of everything after the header
+};
+
+static inline uint64 emote_image_checksum(const uint8* data, size_t len)
+{
+	uint64 hash = UINT64_C(0xcbf29ce484222325);
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= data[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
+// A parsed catalog before it is serialized into an image
+struct emote_catalog {
+	struct s_emotion_db* packs;		// Dense pack array, in load order
+	int count;
+	int32* index;					// packId -> slot in packs[], -1 if the pack does not exist
+	int index_size;					// Highest packId + 1
+	int32* emotes;					// Arena holding the emote lists of all packs (client_emotion_type)
+	int emote_total;
+};
+
+static inline bool emote_catalog_constant(const char* name, int* value)
+{
+	for (size_t i = 0; i < ARRAYLENGTH(emote_catalog_constants); ++i) {
+		if (strcmpi(emote_catalog_constants[i].name, name) == 0) {
+			*value = emote_catalog_constants[i].value;
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline void emote_catalog_clear(struct emote_catalog* cat)
+{
+	aFree(cat->packs);
+	aFree(cat->index);
+	aFree(cat->emotes);
+	memset(cat, 0, sizeof(*cat));
+}
+
+// Parses emotion_pack_db.conf into an empty catalog. On failure the catalog may
+// hold partial data and must be released with emote_catalog_clear().
+static inline bool emote_catalog_parse(struct emote_catalog* cat, const char* filepath, int max_packs, int max_emotes)
+{
+	struct config_t conf;
+	if (libconfig->load_file(&conf, filepath) == 0)
+		return false;
+
+	struct config_setting_t* root = libconfig->setting_get_member(conf.root, "emotion_pack_db");
+	if (!root || !config_setting_is_list(root)) {
+		ShowError("emote_catalog_parse: Setting 'emotion_pack_db' not found or not a list.\n");
+		libconfig->destroy(&conf);
+		return false;
+	}
+
+	// Size the pack array and the emote arena up front so both are single allocations
+	int entries = libconfig->setting_length(root);
+	int arena_size = 0;
+	for (int i = 0; i < entries; ++i) {
+		struct config_setting_t* entry = libconfig->setting_get_elem(root, i);
+		struct config_setting_t* emotes = entry ? libconfig->setting_get_member(entry, "EmotesList") : NULL;
+		if (emotes && config_setting_is_array(emotes))
+			arena_size += min(libconfig->setting_length(emotes), max_emotes);
+	}
+
+	CREATE(cat->packs, struct s_emotion_db, max(entries, 1));
+	CREATE(cat->emotes, int32, max(arena_size, 1));
+
+	for (int i = 0; i < entries; ++i) {
+		struct config_setting_t* entry = libconfig->setting_get_elem(root, i);
+		if (!entry)
+			continue;
+
+		int temp_packId, temp_packType, temp_packPrice;
+		int64_t temp_saleStart, temp_saleEnd, temp_rentalPeriod;
+
+		if (!libconfig->setting_lookup_int(entry, "PackId", &temp_packId)) continue;
+		if (!libconfig->setting_lookup_int(entry, "PackType", &temp_packType)) continue;
+		if (!libconfig->setting_lookup_int(entry, "PackPrice", &temp_packPrice)) continue;
+		if (!libconfig->setting_lookup_int64(entry, "SaleStart", &temp_saleStart)) continue;
+		if (!libconfig->setting_lookup_int64(entry, "SaleEnd", &temp_saleEnd)) continue;
+		if (!libconfig->setting_lookup_int64(entry, "RentalPeriod", &temp_rentalPeriod)) continue;
+
+		if (temp_packId < 0 || temp_packId > UINT16_MAX) {
+			ShowWarning("emote_catalog_parse: Invalid PackId %d, skipping.\n", temp_packId);
+			continue;
+		}
+
+		if (temp_packId >= cat->index_size) {
+			int old_size = cat->index_size;
+			cat->index_size = temp_packId + 1;
+			RECREATE(cat->index, int32, cat->index_size);
+			for (int j = old_size; j < cat->index_size; ++j)
+				cat->index[j] = -1;
+		}
+
+		// A repeated PackId overrides the earlier entry in place
+		int slot = cat->index[temp_packId];
+		if (slot < 0) {
+			if (cat->count >= max_packs) {
+				ShowWarning("emote_catalog_parse: Reached the pack limit (%d), skipping PackId %d.\n", max_packs, temp_packId);
+				continue;
+			}
+			slot = cat->count++;
+			cat->index[temp_packId] = slot;
+		}
+		else {
+			ShowWarning("emote_catalog_parse: Duplicate PackId %d, overriding previous entry.\n", temp_packId);
+		}
+
+		struct s_emotion_db* ce = &cat->packs[slot];
+		memset(ce, 0, sizeof(struct s_emotion_db));
+
+		ce->packId = (uint16)temp_packId;
+		ce->packType = (uint16)temp_packType;
+		ce->packPrice = (uint16)temp_packPrice;
+		ce->sale_start = temp_saleStart ? plugin_convert_to_unix_timestamp((uint64_t)temp_saleStart) : 0;
+		ce->sale_end = temp_saleEnd ? plugin_convert_to_unix_timestamp((uint64_t)temp_saleEnd) : 0;
+		ce->rental_period = (uint64_t)temp_rentalPeriod * 60 * 60 * 24;
+
+		ce->emote_offset = (uint32)cat->emote_total;
+
+		struct config_setting_t* emotes = libconfig->setting_get_member(entry, "EmotesList");
+		if (emotes && config_setting_is_array(emotes)) {
+			int count = libconfig->setting_length(emotes);
+			if (count > max_emotes)
+				ShowWarning("emote_catalog_parse: PackId %d lists %d emotes, only the first %d (the per-pack limit) are used.\n", temp_packId, count, max_emotes);
+			for (int j = 0; j < count && ce->emote_count < max_emotes; ++j) {
+				const char* ename = libconfig->setting_get_string_elem(emotes, j);
+				if (!ename) continue;
+
+				int val;
+				if (emote_catalog_constant(ename, &val)) {
+					if (val >= 0 && val < ET_EMOTION_LAST) {
+						cat->emotes[ce->emote_offset + ce->emote_count++] = val;
+						emote_mask_set(ce->emote_mask, val);
+					}
+					else {
+						ShowWarning("emote_catalog_parse: Invalid emotion constant (out of range): %s\n", ename);
+					}
+				}
+				else {
+					ShowWarning("emote_catalog_parse: Unknown emotion constant: %s\n", ename);
+				}
+			}
+		}
+
+		cat->emote_total += ce->emote_count;
+	}
+
+	libconfig->destroy(&conf);
+	ShowStatus("Done reading '"CL_WHITE"%d"CL_RESET"' packs and '"CL_WHITE"%d"CL_RESET"' total emotes in '"CL_WHITE"%s"CL_RESET"'.\n",
+		cat->count, cat->emote_total, filepath);
+
+	return true;
+}
+
+// Serializes a catalog into an image (aMalloc'd, released with aFree).
+// source_mtime and source_size identify the emotion_pack_db.conf it was parsed from.
+static inline uint8* emote_catalog_serialize(const struct emote_catalog* cat, int64 source_mtime, int64 source_size,
+	int max_packs, int max_emotes, size_t* out_size)
+{
+	struct emote_image_header header;
+	memset(&header, 0, sizeof(header));
+
+	size_t packs_len = cat->count * sizeof(struct s_emotion_db);
+	size_t index_len = cat->index_size * sizeof(int32);
+	size_t emotes_len = cat->emote_total * sizeof(int32);
+
+	header.magic = EMOTE_IMAGE_MAGIC;
+	header.version = EMOTE_IMAGE_VERSION;
+	header.header_size = sizeof(header);
+	header.pack_size = sizeof(struct s_emotion_db);
+	header.emotion_last = ET_EMOTION_LAST;
+	header.pack_count = cat->count;
+	header.index_size = cat->index_size;
+	header.emote_total = cat->emote_total;
+	header.max_packs = max_packs;
+	header.max_emotes = max_emotes;
+	header.source_mtime = source_mtime;
+	header.source_size = source_size;
+	header.packs_offset = (uint32)EMOTE_IMAGE_ALIGN(sizeof(header));
+	header.index_offset = (uint32)EMOTE_IMAGE_ALIGN(header.packs_offset + packs_len);
+	header.emotes_offset = (uint32)EMOTE_IMAGE_ALIGN(header.index_offset + index_len);
+	header.total_size = (uint32)EMOTE_IMAGE_ALIGN(header.emotes_offset + emotes_len);
+
+	uint8* buf = (uint8*)aCalloc(1, header.total_size);
+	if (packs_len > 0)
+		memcpy(buf + header.packs_offset, cat->packs, packs_len);
+	if (index_len > 0)
+		memcpy(buf + header.index_offset, cat->index, index_len);
+	if (emotes_len > 0)
+		memcpy(buf + header.emotes_offset, cat->emotes, emotes_len);
+	header.checksum = emote_image_checksum(buf + sizeof(header), header.total_size - sizeof(header));
+	memcpy(buf, &header, sizeof(header));
+
+	*out_size = header.total_size;
+	return buf;
+}
+
+// Checks that an image has this build's layout, that its sections and every
+// index[] slot, emote range and emote in it are in bounds, and that it is not
+// corrupt. Returns its header, or NULL.
+static inline const struct emote_image_header* emote_catalog_validate(const void* image, size_t size)
+{
+	const struct emote_image_header* header = (const struct emote_image_header*)image;
+	const uint8* base = (const uint8*)image;
+
+	if (size < sizeof(*header))
+		return NULL;
+
+	if (header->magic != EMOTE_IMAGE_MAGIC || header->version != EMOTE_IMAGE_VERSION
+		|| header->header_size != sizeof(*header) || header->pack_size != sizeof(struct s_emotion_db)
+		|| header->emotion_last != ET_EMOTION_LAST || header->total_size != size)
+		return NULL;
+
+	// Sections start after the header, 8-byte aligned, and each one fits in the image
+	if (header->pack_count < 0 || header->index_size < 0 || header->emote_total < 0
+		|| header->index_size > UINT16_MAX + 1 || header->max_emotes < 0
+		|| header->packs_offset < sizeof(*header) || header->index_offset < sizeof(*header) || header->emotes_offset < sizeof(*header)
+		|| header->packs_offset != EMOTE_IMAGE_ALIGN(header->packs_offset)
+		|| header->index_offset != EMOTE_IMAGE_ALIGN(header->index_offset)
+		|| header->emotes_offset != EMOTE_IMAGE_ALIGN(header->emotes_offset)
+		|| header->packs_offset > size || (size - header->packs_offset) / sizeof(struct s_emotion_db) < (size_t)header->pack_count
+		|| header->index_offset > size || (size - header->index_offset) / sizeof(int32) < (size_t)header->index_size
+		|| header->emotes_offset > size || (size - header->emotes_offset) / sizeof(int32) < (size_t)header->emote_total)
+		return NULL;
+
+	if (header->checksum != emote_image_checksum(base + sizeof(*header), size - sizeof(*header)))
+		return NULL;
+
+	// The sections are used in place, so no entry may point outside them
+	const struct s_emotion_db* packs = (const struct s_emotion_db*)(base + header->packs_offset);
+	const int32* index = (const int32*)(base + header->index_offset);
+	const int32* emotes = (const int32*)(base + header->emotes_offset);
+
+	for (int32 i = 0; i < header->index_size; ++i) {
+		if (index[i] < -1 || index[i] >= header->pack_count)
+			return NULL;
+	}
+
+	for (int32 slot = 0; slot < header->pack_count; ++slot) {
+		const struct s_emotion_db* ce = &packs[slot];
+		if (ce->packId >= header->index_size || index[ce->packId] != slot
+			|| ce->emote_count > header->max_emotes || ce->emote_offset > (uint32)header->emote_total
+			|| ce->emote_count > (uint32)header->emote_total - ce->emote_offset)
+			return NULL;
+	}
+
+	for (int32 i = 0; i < header->emote_total; ++i) {
+		if (emotes[i] < 0 || emotes[i] >= ET_EMOTION_LAST)
+			return NULL;
+	}
+
+	return header;
+}
+
+//===== Inter-server catalog distribution =====
+// The map-server asks for the catalog once the char-server link is ready, passing
+// the checksum of the catalog it holds; the char-server answers with the image in
+// chunks only when it differs. After a reload on the char-server the new image is
+// pushed to every connected map-server the same way.
+#define HEADER_EMOTE_CATALOG_REQ 0x2b70		// map -> char
+#define HEADER_EMOTE_CATALOG_DATA 0x2b71	// char -> map
+#define HEADER_EMOTE_CATALOG_RELOAD 0x2b72	// map -> char
+#define EMOTE_CATALOG_CHUNK 32768			// Image bytes per HEADER_EMOTE_CATALOG_DATA packet
+
+#pragma pack(push, 1)
+struct PACKET_EMOTE_CATALOG_REQ {
+	int16 packetType;
+	uint64 checksum;	// Checksum of the catalog the map-server holds, 0 if none
+} __attribute__((packed));
+
+struct PACKET_EMOTE_CATALOG_DATA {
+	int16 packetType;
+	uint16 packetLength;
+	uint32 serial;		// Changes with every catalog the char-server loads
+	uint32 total_size;	// Size of the whole image
+	uint32 offset;		// Position of data[] in the image
+	uint8 data[];
+} __attribute__((packed));
+
+struct PACKET_EMOTE_CATALOG_RELOAD {
+	int16 packetType;
+} __attribute__((packed));
+#pragma pack(pop)
+
+#endif /* EMOTE_CATALOG_H */
@@ -0,0 +1,41 @@
+//===== Hercules Plugin Helper ===============================
+//= Emotion Pack List Chunking
+//===== By: =================================================
+//= AcidMarco
+//===== Description: =========================================
+//= Splits the owned pack list into ZC_EMOTION_EXPANSION_LIST
+//= packets that the client accepts. Kept free of server
+//= headers so the chunking can be tested on its own (see
+//= \systems\client_emote_ui\tests\).
+//===== Note: ================================================
+//= Hercules rejects client-bound packets above
+//= socket_max_client_packet (0x6000 by default), so a chunk
+//= stays well below that instead of using the full int16
+//= packetLength range.
+//===== Setup: ===============================================
+//= Copy this file next to the plugin sources that include it
+//= (\src\plugins\).
+//===== Repository Link: =====================================
+//= https://github.com/AcidMarco/ro-releases
+//============================================================
+#ifndef EMOTE_LIST_H
+#define EMOTE_LIST_H
+
+#include <stddef.h>
+
+#define EMOTE_LIST_PACKET_MAX 0x4000		// Largest ZC_EMOTION_EXPANSION_LIST packet sent
+
+// Entries that fit in one packet after the fixed header
+static inline int emote_list_per_packet(size_t header_size, size_t entry_size)
+{
+	return (int)((EMOTE_LIST_PACKET_MAX - header_size) / entry_size);
+}
+
+// Entries in the packet that starts at entry sent of count
+static inline int emote_list_chunk(int count, int sent, int per_packet)
+{
+	int left = count - sent;
+	return left < per_packet ? left : per_packet;
+}
+
+#endif /* EMOTE_LIST_H */
@@ -0,0 +1,90 @@
+--
+-- Emotion pack ownership storage for ns_client_emote_ui_handler.
+-- Import into the main (map-server) database.
+--
+-- Rows are keyed by the pack's PackType from emotion_pack_db.conf:
+--   pack_type 1 = account-bound, owner_id is the account_id
+--   pack_type 2 = character-bound, owner_id is the char_id
+--
+
+--
+-- Permanently owned packs, one bitmap per owner (bit N of the blob = PackId N).
+-- The row also marks the owner as migrated from the old cashemote_* variables.
+--
+CREATE TABLE IF NOT EXISTS `emotion_pack_owner` (
+  `pack_type` TINYINT UNSIGNED NOT NULL,
+  `owner_id` INT UNSIGNED NOT NULL,
+  `owned` VARBINARY(8192) NOT NULL DEFAULT '',
+  PRIMARY KEY (`pack_type`, `owner_id`)
+) ENGINE=InnoDB;
+
+--
+-- Rented packs, one row per active rental.
+--
+CREATE TABLE IF NOT EXISTS `emotion_pack_rental` (
+  `pack_type` TINYINT UNSIGNED NOT NULL,
+  `owner_id` INT UNSIGNED NOT NULL,
+  `pack_id` SMALLINT UNSIGNED NOT NULL,
+  `expire_time` INT UNSIGNED NOT NULL,
+  PRIMARY KEY (`pack_type`, `owner_id`, `pack_id`),
+  KEY `expire_time` (`expire_time`)
+) ENGINE=InnoDB;
+
+--
+-- Bulk grants and revokes of permanent packs that are not yet merged into the
+-- owner's bitmap. Entries are merged and deleted the next time the owner logs in.
+--
+CREATE TABLE IF NOT EXISTS `emotion_pack_journal` (
+  `pack_type` TINYINT UNSIGNED NOT NULL,
+  `owner_id` INT UNSIGNED NOT NULL,
+  `pack_id` SMALLINT UNSIGNED NOT NULL,
+  `owned` TINYINT UNSIGNED NOT NULL,
+  PRIMARY KEY (`pack_type`, `owner_id`, `pack_id`)
+) ENGINE=InnoDB;
+
+--
+-- Usage analytics, aggregated per day. Written every EMOTE_USAGE_INTERVAL minutes
+-- from in-memory counters, so rows lag behind by up to one interval.
+--
+CREATE TABLE IF NOT EXISTS `emotion_pack_usage` (
+  `stat_date` DATE NOT NULL,
+  `pack_id` SMALLINT UNSIGNED NOT NULL,
+  `emote_id` SMALLINT UNSIGNED NOT NULL,
+  `uses` INT UNSIGNED NOT NULL DEFAULT '0',
+  PRIMARY KEY (`stat_date`, `pack_id`, `emote_id`)
+) ENGINE=InnoDB;
+
+CREATE TABLE IF NOT EXISTS `emotion_pack_sales` (
+  `stat_date` DATE NOT NULL,
+  `pack_id` SMALLINT UNSIGNED NOT NULL,
+  `purchases` INT UNSIGNED NOT NULL DEFAULT '0',
+  PRIMARY KEY (`stat_date`, `pack_id`)
+) ENGINE=InnoDB;
+
+--
+-- Purchase ledger, one row per completed purchase. txn_id is assigned by the
+-- map-server (epoch | server id | sequence) and makes retried writes idempotent.
+--
+CREATE TABLE IF NOT EXISTS `emotion_pack_ledger` (
+  `txn_id` BIGINT UNSIGNED NOT NULL,
+  `time` INT UNSIGNED NOT NULL,
+  `account_id` INT UNSIGNED NOT NULL,
+  `char_id` INT UNSIGNED NOT NULL,
+  `pack_id` SMALLINT UNSIGNED NOT NULL,
+  `item_id` INT NOT NULL,
+  `amount` SMALLINT NOT NULL,
+  `expire_time` INT UNSIGNED NOT NULL DEFAULT '0',
+  PRIMARY KEY (`txn_id`),
+  KEY `account_id` (`account_id`, `time`),
+  KEY `char_id` (`char_id`, `time`)
+) ENGINE=InnoDB;
+
+--
+-- Highest transaction ID epoch each map-server (EMOTE_LEDGER_SERVER_ID) has reserved.
+-- A new epoch is always above the stored one, so IDs stay unique across restarts.
+--
+CREATE TABLE IF NOT EXISTS `emotion_pack_ledger_epoch` (
+  `server_id` TINYINT UNSIGNED NOT NULL,
+  `epoch` INT UNSIGNED NOT NULL,
+  PRIMARY KEY (`server_id`)
+) ENGINE=InnoDB;
@@ -0,0 +1,178 @@
+//===== Hercules Plugin ======================================
+//= Client New Emotion System - Char-Server Catalog
+//===== By: =================================================
+//= AcidMarco
+//===== Description: =========================================
+//= Companion of ns_client_emote_ui_handler for clusters with
+//= several map-servers. Parses emotion_pack_db.conf once on
+//= the char-server and streams the catalog image to every
+//= map-server, so all of them run the same pack catalog.
+//===== Note: ================================================
+//= Map-servers ask for the catalog when their char link is
+//= ready and only receive it when theirs differs. A reload
+//= (console 'emote:reloadcatalog' or @reloademotedb on any
+//= map-server) pushes the new catalog to all map-servers.
+//===== Setup: ===============================================
+//= 1. Copy this file and emote_catalog.h into \src\plugins\
+//=    and load the plugin on the char-server.
+//= 2. Move emotion_pack_db.conf into the char-server's \db\.
+//= 3. Set EMOTE_CATALOG_FROM_CHAR = true in
+//=    plugin_client_emote_ui_handler.c on every map-server.
+//= 4. MAX_EMOTION_PACKS and MAX_EMOTES_PER_PACK below replace
+//=    the map-server values for the distributed catalog.
+//===== Repository Link: =====================================
+//= https://github.com/AcidMarco/ro-releases
+//============================================================
+
+#include "common/hercules.h"
+#include "common/memmgr.h"
+#include "common/socket.h"
+#include "common/showmsg.h"
+#include "common/conf.h"
+#include "common/console.h"
+
+#include "char/char.h"
+#include "char/mapif.h"
+
+#include "common/HPMDataCheck.h"
+
+#include "emote_catalog.h"
+
+#include <sys/stat.h>
+
+HPExport struct hplugin_info pinfo = {
+	"ns_client_emote_ui_catalog",
+	SERVER_TYPE_CHAR,
+	"1.0",
+	HPM_VERSION,
+};
+
+//===== Global Config =====
+int MAX_EMOTION_PACKS = 10000;			// Maximum number of packs read from emotion_pack_db.conf
+int MAX_EMOTES_PER_PACK = 100;			// Maximum number of emotes allowed in a single emote pack
+
+//===== Catalog =====
+// The current catalog image. serial changes with every load so map-servers can
+// tell an unfinished transfer of an older catalog from the current one.
+struct emote_catalog_image {
+	uint8* image;
+	size_t size;
+	uint64 checksum;
+	uint32 serial;
+};
+
+struct emote_catalog_image emote_catalog_current = { 0 };
+
+// Parses emotion_pack_db.conf and makes it the current catalog.
+// The previous catalog is kept when the file does not load.
+bool emote_catalog_load(void)
+{
+	char filepath[256];
+	struct stat source;
+	struct emote_catalog cat = { 0 };
+
+	libconfig->format_db_path("emotion_pack_db.conf", filepath, sizeof(filepath));
+	if (stat(filepath, &source) != 0) {
+		ShowError("emote_catalog_load: Cannot access '%s'.\n", filepath);
+		return false;
+	}
+
+	if (!emote_catalog_parse(&cat, filepath, MAX_EMOTION_PACKS, MAX_EMOTES_PER_PACK)) {
+		emote_catalog_clear(&cat);
+		ShowError("emote_catalog_load: Failed to load '%s', keeping the current catalog.\n", filepath);
+		return false;
+	}
+
+	size_t size;
+	uint8* image = emote_catalog_serialize(&cat, (int64)source.st_mtime, (int64)source.st_size,
+		MAX_EMOTION_PACKS, MAX_EMOTES_PER_PACK, &size);
+	emote_catalog_clear(&cat);
+
+	aFree(emote_catalog_current.image);
+	emote_catalog_current.image = image;
+	emote_catalog_current.size = size;
+	emote_catalog_current.checksum = ((const struct emote_image_header*)image)->checksum;
+	emote_catalog_current.serial++;
+	return true;
+}
+
+// Sends the current catalog in chunks, to one map-server (fd) or to all of them (fd < 0).
+void emote_catalog_send(int fd)
+{
+	const struct emote_catalog_image* cur = &emote_catalog_current;
+	uint8 buf[sizeof(struct PACKET_EMOTE_CATALOG_DATA) + EMOTE_CATALOG_CHUNK];
+	struct PACKET_EMOTE_CATALOG_DATA* p = (struct PACKET_EMOTE_CATALOG_DATA*)buf;
+	size_t offset = 0;
+
+	if (!cur->image)
+		return;
+
+	do {
+		size_t len = min(cur->size - offset, (size_t)EMOTE_CATALOG_CHUNK);
+
+		p->packetType = HEADER_EMOTE_CATALOG_DATA;
+		p->packetLength = (uint16)(sizeof(*p) + len);
+		p->serial = cur->serial;
+		p->total_size = (uint32)cur->size;
+		p->offset = (uint32)offset;
+		memcpy(p->data, cur->image + offset, len);
+
+		if (fd < 0) {
+			mapif->sendall(buf, p->packetLength);
+		}
+		else {
+			WFIFOHEAD(fd, p->packetLength);
+			memcpy(WFIFOP(fd, 0), buf, p->packetLength);
+			WFIFOSET(fd, p->packetLength);
+		}
+		offset += len;
+	} while (offset < cur->size);
+}
+
+// Reloads the catalog and pushes it to every map-server when it changed
+bool emote_catalog_reload(void)
+{
+	uint64 previous = emote_catalog_current.checksum;
+
+	if (!emote_catalog_load())
+		return false;
+
+	if (emote_catalog_current.checksum != previous)
+		emote_catalog_send(-1);
+	return true;
+}
+
+//===== Packets from the map-servers =====
+void mapif_parse_emote_catalog_request(int fd)
+{
+	const struct PACKET_EMOTE_CATALOG_REQ* p = (const struct PACKET_EMOTE_CATALOG_REQ*)RFIFOP(fd, 0);
+
+	if (p->checksum != emote_catalog_current.checksum)
+		emote_catalog_send(fd);
+}
+
+void mapif_parse_emote_catalog_reload(int fd)
+{
+	if (emote_catalog_reload())
+		ShowInfo("Emotion pack catalog reloaded on request of a map-server (%d bytes).\n", (int)emote_catalog_current.size);
+}
+
+CPCMD(emotereloadcatalog)
+{
+	if (emote_catalog_reload())
+		ShowInfo("Emotion pack catalog reloaded (%d bytes).\n", (int)emote_catalog_current.size);
+}
+
+HPExport void plugin_init(void)
+{
+	addPacket(HEADER_EMOTE_CATALOG_REQ, sizeof(struct PACKET_EMOTE_CATALOG_REQ), mapif_parse_emote_catalog_request, hpParse_FromMap);
+	addPacket(HEADER_EMOTE_CATALOG_RELOAD, sizeof(struct PACKET_EMOTE_CATALOG_RELOAD), mapif_parse_emote_catalog_reload, hpParse_FromMap);
+	addCPCommand("emote:reloadcatalog", emotereloadcatalog);
+
+	emote_catalog_load();
+}
+
+HPExport void plugin_final(void)
+{
+	aFree(emote_catalog_current.image);
+}
@@ -15,8 +15,34 @@
 //= 1. To use this plugin, set PACKETVER >= 20230802 in \src\common\mmo.h.
 //=    You must also use a compatible client that supports this feature.
 //= 2. Move the emotion_pack_db.conf file into your database folder: \db\
-//= 3. You can customize UI_CURRENCY_ID and disable debug output via SHOW_DEBUG_MES.
+//= 3. You can customize UI_CURRENCY_ID and the default trace categories via EMOTE_TRACE_CATEGORIES.
 //=    To change the UI_CURRENCY_ID on client side, you must patch the client using a HEX patch.
+//= 4. emotion_pack_db.conf can be reloaded without a restart through @reloademotedb
+//=    or the console command 'emote:reloaddb'.
+//= 5. The plugin keeps a precompiled copy of the DB in \db\emotion_pack_db.bin.
+//=    It is rebuilt automatically whenever emotion_pack_db.conf changes.
+//= 6. Copy \plugins\ns_common\ns_trace.h and ns_db.h next to this file. Packet handlers trace into
+//=    \log\ns_emote.trace; use @emotetrace on|off <category>, @emotetrace dump [records].
+//= 7. Import emotion_pack.sql into your main database. Pack ownership is stored there;
+//=    old cashemote_* variables are converted the first time each player logs in.
+//= 8. Packs can be granted or revoked in bulk, also for offline players, through
+//=    @emotegrant / @emoterevoke or the script commands emotegrant / emoterevoke.
+//= 9. Expired rentals of players who do not return are deleted by a background sweep
+//=    every EMOTE_SWEEP_INTERVAL minutes; 'emote:sweep' on the console runs one now.
+//=    It also removes expired legacy (#)cashemote_* rentals that were never converted.
+//= 10. Viewers on older clients receive the legacy ZC_EMOTION instead, see EMOTE_LEGACY_DEFAULT,
+//=    EMOTE_LEGACY_LAST and emote_legacy_fallbacks.
+//= 11. Move emotion_crowd_db.conf into your database folder as well. It turns on crowd
+//=    delivery per map, which caps the emotes a viewer receives on busy maps.
+//= 12. Emote uses and pack purchases are counted in memory and written as daily totals
+//=    to emotion_pack_usage / emotion_pack_sales every EMOTE_USAGE_INTERVAL minutes.
+//= 13. emote_catalog.h and emote_list.h must sit next to this file. On clusters with several map-servers,
+//=    load plugin_client_emote_ui_catalog.c on the char-server and set EMOTE_CATALOG_FROM_CHAR;
+//=    emotion_pack_db.conf is then only needed on the char-server.
+//= 14. Purchases are logged with a transaction ID to emotion_pack_ledger. On clusters give
+//=    every map-server its own EMOTE_LEDGER_SERVER_ID.
+//= 15. NPCs should check ownership with hasemotepack, emotepackexpire and getemotepacks
+//=    instead of reading (#)cashemote_* variables, which are no longer kept up to date.
 //===== Repository Link: =====================================
 //= https://github.com/AcidMarco/ro-releases
 //============================================================
@@ -27,15 +53,31 @@
 #include "common/socket.h"
 #include "common/nullpo.h"
 #include "common/packets.h"
+#include "common/timer.h"
+#include "common/sql.h"
 
+#include "map/chrif.h"
 #include "map/clif.h"
 #include "map/script.h"
 #include "map/pc.h"
+#include "map/map.h"
 #include "map/packets.h"
 
 #include "plugins/HPMHooking.h"
 #include "common/HPMDataCheck.h"
 
+#include "ns_trace.h"
+#include "ns_db.h"
+#include "emote_catalog.h"
+#include "emote_list.h"
+
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 HPExport struct hplugin_info pinfo = {
 	"ns_client_emote_ui_handler",
 	SERVER_TYPE_MAP,
@@ -45,12 +87,72 @@ HPExport struct hplugin_info pinfo = {
 
 //===== Global Config =====
 int16 UI_CURRENCY_ID = 6909;	// Default value (6909) hard-coded in the client. Use the NewstyleChangeEmoteCurrencyItemID hex patch to change it.
-bool SHOW_DEBUG_MES = true;		// Console debug messages for emotion system (useful for development and testing)
-#define MAX_EMOTE_PACKS 100		// Maximum number of emotes allowed in a single emote pack
+uint32 EMOTE_TRACE_CATEGORIES = 0x7;	// Trace categories enabled at startup (0x1 use, 0x2 shop, 0x4 list), see @emotetrace
+bool EMOTE_BROADCAST_COALESCE = true;	// Gather ZC_EMOTION_SUCCESS packets of one server tick into one area walk per cell block
+int EMOTE_RATE_BURST = 3;				// Emotes a player can play back to back
+int EMOTE_RATE_REFILL_MS = 1000;		// Time in ms to regain one emote from the burst
+int EMOTE_RATE_STRIKES = 10;			// Rejected emotes in a row before requests are silently dropped
+int EMOTE_RATE_DROP_MS = 10000;			// How long requests of a repeat violator are dropped
+char EMOTE_OWNER_TABLE[32] = "emotion_pack_owner";		// Table of permanently owned packs (see emotion_pack.sql)
+char EMOTE_RENTAL_TABLE[32] = "emotion_pack_rental";	// Table of rented packs (see emotion_pack.sql)
+char EMOTE_JOURNAL_TABLE[32] = "emotion_pack_journal";	// Pending bulk grants/revokes of permanent packs (see emotion_pack.sql)
+char EMOTE_CHAR_TABLE[32] = "char";						// Character table, used to resolve bulk grant filters
+int EMOTE_BULK_BATCH = 1000;							// Rows per statement written by bulk grants and revokes
+int EMOTE_SWEEP_INTERVAL = 60;			// Minutes between sweeps of expired rentals of offline players (0 = off)
+int EMOTE_SWEEP_CHUNK = 500;			// Rows deleted per statement by the sweeper
+int EMOTE_SWEEP_BUDGET = 20000;			// Maximum rows deleted per sweep, the rest waits for the next run
+char EMOTE_ACC_REG_TABLE[32] = "acc_reg_num_db";		// Account registry, swept for expired #cashemote_* rentals
+char EMOTE_CHAR_REG_TABLE[32] = "char_reg_num_db";		// Character registry, swept for expired cashemote_* rentals
+int EMOTE_SWEEP_OWNER_SPAN = 1000;		// Owner IDs per range query of the legacy registry sweep
+int EMOTE_SWEEP_RANGES = 200;			// Legacy registry ranges per sweep and table, the walk resumes next run
+int EMOTE_USAGE_INTERVAL = 10;			// Minutes between writes of the emote usage statistics (0 = only on reload and shutdown)
+char EMOTE_USAGE_TABLE[32] = "emotion_pack_usage";		// Daily emote use counts (see emotion_pack.sql)
+char EMOTE_SALES_TABLE[32] = "emotion_pack_sales";		// Daily pack purchase counts (see emotion_pack.sql)
+char EMOTE_LEDGER_TABLE[32] = "emotion_pack_ledger";	// Purchase transactions (see emotion_pack.sql)
+char EMOTE_LEDGER_EPOCH_TABLE[32] = "emotion_pack_ledger_epoch";	// Transaction ID epochs reserved per map-server
+int EMOTE_LEDGER_FLUSH_MS = 1000;		// How often queued purchase transactions are handed to the SQL worker
+int EMOTE_LEDGER_DEDUP_MS = 3000;		// Repeated requests for a just bought pack within this time are answered from memory
+int EMOTE_LEDGER_SERVER_ID = 0;			// 0-255, unique per map-server so transaction IDs never collide in a cluster
+bool EMOTE_LEGACY_DEFAULT = false;		// Treat sessions as legacy clients (ZC_EMOTION only) until they send an emotion packet
+int EMOTE_LEGACY_LAST = 93;		// First emote legacy clients do not know (93 = ET_CUSTOM_1), higher emotes use emote_legacy_fallbacks
+bool EMOTE_CATALOG_FROM_CHAR = false;	// Receive the pack catalog from the char-server (ns_client_emote_ui_catalog) instead of reading emotion_pack_db.conf
+int MAX_EMOTION_PACKS = 10000;			// Maximum number of packs read from emotion_pack_db.conf
+int MAX_EMOTES_PER_PACK = 100;			// Maximum number of emotes allowed in a single emote pack
+
+//===== Tracing =====
+// Packet handlers record binary trace events instead of printing debug lines.
+enum emote_trace_category {
+	EMOTE_TRACE_USE = 0x1,
+	EMOTE_TRACE_SHOP = 0x2,
+	EMOTE_TRACE_LIST = 0x4,
+};
+
+enum emote_trace_event {
+	EMOTE_EV_REQ_EMOTION2 = 1,
+	EMOTE_EV_EMOTION_SUCCESS,
+	EMOTE_EV_EMOTION_FAIL,
+	EMOTE_EV_EXPANSION_REQ,
+	EMOTE_EV_EXPANSION_LIST,
+	EMOTE_EV_EXPANSION_REPLAY,
+};
+
+static const char* const emote_trace_categories[] = { "use", "shop", "list", NULL };
+
+static const struct ns_trace_event emote_trace_events[] = {
+	{ EMOTE_EV_REQ_EMOTION2, "clif_parse_emotion2", "fd=%d, AID=%d, packId=%d, emoteId=%d" },
+	{ EMOTE_EV_EMOTION_SUCCESS, "clif_send_emote_success", "GID=%d, packId=%d, emoteId=%d" },
+	{ EMOTE_EV_EMOTION_FAIL, "clif_send_emote_fail", "AID=%d, packId=%d, emoteId=%d, status=%d" },
+	{ EMOTE_EV_EXPANSION_REQ, "clif_parse_emote_expansion_request", "AID=%d, packId=%d, itemId=%d, amount=%d" },
+	{ EMOTE_EV_EXPANSION_LIST, "clif_send_emote_expansion_list", "AID=%d, count=%d, timestamp=%u, offset=%d" },
+	{ EMOTE_EV_EXPANSION_REPLAY, "emote_expansion_purchase", "AID=%d, packId=%d, txn=%08x%08x (replay)" },
+};
+
+static struct ns_trace emote_trace;
 
 //===== Packet header definitions for custom emotion system =====
 // Used for parsing client requests and sending responses for emotion pack interactions.
 enum emotion_packet_headers {
+	HEADER_ZC_EMOTION = 0x00c0,
 	HEADER_CZ_REQ_EMOTION2 = 0x0be9,
 	HEADER_ZC_EMOTION_SUCCESS = 0x0bea,
 	HEADER_ZC_EMOTION_FAIL = 0x0beb,
@@ -65,6 +167,12 @@ enum emotion_packet_headers {
 };
 
 #pragma pack(push, 1)
+struct PACKET_ZC_EMOTION {
+	int16 packetType;
+	uint32 GID;
+	uint8 type;
+} __attribute__((packed));
+
 struct PACKET_CZ_REQ_EMOTION2 {
 	uint16 packetType;
 	uint16 packId;
@@ -129,9 +237,9 @@ struct PACKET_ZC_EMOTION_EXPANSION_LIST {
 #endif
 #pragma pack(pop)
 
-//===== Client emotion types (client_emotion_type) =====
-// Enumeration of all supported client emotion constants.
-// Used for sending emotion playback results to the client.
+//===== Client result codes =====
+// Sent with purchase and playback failures. The client emotion constants
+// (client_emotion_type) are defined in emote_catalog.h.
 enum emotion_expansion_msg {
 	EMSG_EMOTION_EXPANSION_NOT_ENOUGH_NYANGVINE = 0,
 	EMSG_EMOTION_EXPANSION_FAIL_DATE = 1,
@@ -149,510 +257,3558 @@ enum emote_msg {
 	EMSG_EMOTION_EXPANSION_USE_FAIL_UNKNOWN = 3,
 };
 
-typedef enum client_emotion_type {
-	ET_BLANK = -1,
-	ET_SURPRISE = 0,
-	ET_QUESTION,
-	ET_DELIGHT,
-	ET_THROB,
-	ET_SWEAT,
-	ET_AHA,
-	ET_FRET,
-	ET_ANGER,
-	ET_MONEY,
-	ET_THINK,
-	ET_SCISSOR,
-	ET_ROCK,
-	ET_WRAP,
-	ET_FLAG,
-	ET_BIGTHROB,
-	ET_THANKS,
-	ET_KEK,
-	ET_SORRY,
-	ET_SMILE,
-	ET_PROFUSELY_SWEAT,
-	ET_SCRATCH,
-	ET_BEST,
-	ET_STARE_ABOUT,
-	ET_HUK,
-	ET_O,
-	ET_X,
-	ET_HELP,
-	ET_GO,
-	ET_CRY,
-	ET_KIK,
-	ET_CHUP,
-	ET_CHUPCHUP,
-	ET_HNG,
-	ET_OK,
-	ET_CHAT_PROHIBIT,
-	ET_INDONESIA_FLAG,
-	ET_STARE,
-	ET_HUNGRY,
-	ET_COOL,
-	ET_MERONG,
-	ET_SHY,
-	ET_GOODBOY,
-	ET_SPTIME,
-	ET_SEXY,
-	ET_COMEON,
-	ET_SLEEPY,
-	ET_CONGRATULATION,
-	ET_HPTIME,
-	ET_PH_FLAG,
-	ET_MY_FLAG,
-	ET_SI_FLAG,
-	ET_BR_FLAG,
-	ET_SPARK,
-	ET_CONFUSE,
-	ET_OHNO,
-	ET_HUM,
-	ET_BLABLA,
-	ET_OTL,
-	ET_DICE1,
-	ET_DICE2,
-	ET_DICE3,
-	ET_DICE4,
-	ET_DICE5,
-	ET_DICE6,
-	ET_INDIA_FLAG,
-	ET_LUV,
-	ET_FLAG8,
-	ET_FLAG9,
-	ET_MOBILE,
-	ET_MAIL,
-	ET_ANTENNA0,
-	ET_ANTENNA1,
-	ET_ANTENNA2,
-	ET_ANTENNA3,
-	ET_HUM2,
-	ET_ABS,
-	ET_OOPS,
-	ET_SPIT,
-	ET_ENE,
-	ET_PANIC,
-	ET_WHISP,
-	ET_YUT1,
-	ET_YUT2,
-	ET_YUT3,
-	ET_YUT4,
-	ET_YUT5,
-	ET_YUT6,
-	ET_YUT7,
-	ET_CLICK_ME,
-	ET_DAILY_QUEST,
-	ET_EVENT,
-	ET_JOB_QUEST,
-	ET_TRAFFIC_LINE_QUEST,
-	ET_CUSTOM_1,
-	ET_CUSTOM_2,
-	ET_CUSTOM_3,
-	ET_CUSTOM_4,
-	ET_CUSTOM_5,
-	ET_CUSTOM_6,
-	ET_CUSTOM_7,
-	ET_CUSTOM_8,
-	ET_CUSTOM_9,
-	ET_CUSTOM_10,
-	ET_CUSTOM_11,
-	ET_CUSTOM_12,
-	ET_CUSTOM_13,
-	ET_CUSTOM_14,
-	ET_CUSTOM_15,
-	ET_EMOTION_LAST
-} client_emotion_type;
-
 //===== Emotion Pack Database =====
 // Stores all emotion pack metadata such as ID, price, availability,
 // rental duration, and emote list. Loaded from emotion_pack_db.conf.
-struct s_emotion_db {
-	uint16 packId;
-	uint16 packType;
-	uint16 packPrice;
-	time_t sale_start;
-	time_t sale_end;
-	uint64 rental_period;
-	uint16 emote_count;
-	client_emotion_type emoteIds[MAX_EMOTE_PACKS];
+// Packs live in one dense array (their slot is the array index), looked up
+// through a packId -> slot table; all emote lists share a single arena.
+// The pack layout (s_emotion_db) and the parser are shared with the char-server
+// catalog plugin through emote_catalog.h.
+
+struct s_emotion_pack_table {
+	struct s_emotion_db* packs;		// Dense pack array, in load order
+	int count;
+	int32* index;					// packId -> slot in packs[], -1 if the pack does not exist
+	int index_size;					// Highest packId + 1
+	int32* emotes;					// Arena holding the emote lists of all packs (client_emotion_type)
+	int emote_total;
+	uint32 generation;				// Bumped on every (re)load, invalidates session caches
+	void* image;					// Catalog image packs/index/emotes point into
+	size_t image_size;
+	bool image_mapped;				// The image is a file mapping rather than an allocation
+	uint64 checksum;				// Catalog version, see emote_catalog.h
 };
 
-struct DBMap* emotion_db = NULL;
+struct s_emotion_pack_table emotion_db = { 0 };
+uint32 emotion_db_generation = 0;
+uint64 emote_forbidden_mask[EMOTE_MASK_WORDS];	// Emotes that can never be played through CZ_REQ_EMOTION2
 
-time_t plugin_convert_to_unix_timestamp(uint64_t date_val)
+static inline struct s_emotion_db* emote_db_get(int packId)
 {
-	struct tm tmStruct = { 0 };
-	tmStruct.tm_year = (int)(date_val / 10000) - 1900;
-	tmStruct.tm_mon = (int)((date_val / 100) % 100) - 1;
-	tmStruct.tm_mday = (int)(date_val % 100);
-	return mktime(&tmStruct);
+	if (packId < 0 || packId >= emotion_db.index_size || emotion_db.index[packId] < 0)
+		return NULL;
+	return &emotion_db.packs[emotion_db.index[packId]];
 }
 
-void emote_db_final(void)
+static inline int emote_db_slot(const struct s_emotion_db* ce)
+{
+	return (int)(ce - emotion_db.packs);
+}
+
+//===== Per-session ownership cache =====
+// Compact copy of the player's pack ownership, attached to map_session_data.
+// Filled from the ownership data at login and kept in sync by purchases, so the
+// emote path is a bit test plus one expiry compare instead of registry lookups.
+// Layout of data[]: ownership bitset (one bit per pack slot) followed by
+// one rental expiry timestamp per pack slot.
+struct emote_session_data {
+	uint32 generation;	// emotion_db.generation the slots refer to
+	int pack_count;
+	uint32 data[];
+};
+
+bool emote_registry_sync = false;	// Set while the plugin itself writes cashemote_* variables
+
+void emote_rental_schedule_session(struct map_session_data* sd, struct emote_session_data* esd);
+void emote_rental_schedule(struct map_session_data* sd, uint16 packId, uint32 expire_time);
+
+#define EMOTE_BITSET_WORDS(n) (((n) + 31) / 32)
+#define EMOTE_SESSION_SIZE(n) (sizeof(struct emote_session_data) + (EMOTE_BITSET_WORDS(n) + (n)) * sizeof(uint32))
+
+//===== Precompiled emotion pack DB image =====
+// Every table is backed by a catalog image (see emote_catalog.h). After a text
+// parse the image is written to emotion_pack_db.bin; on the next start that file
+// is mapped and used directly when it still matches emotion_pack_db.conf (same
+// mtime and size), otherwise the plugin falls back to the text parser and
+// rewrites it. With EMOTE_CATALOG_FROM_CHAR the image is received from the
+// char-server instead, see the catalog distribution section.
+
+void emote_db_clear(struct s_emotion_pack_table* table)
 {
-	if (emotion_db) {
-		db_destroy(emotion_db);
-		emotion_db = NULL;
+	if (table->image_mapped) {
+#ifndef WIN32
+		munmap(table->image, table->image_size);
+#endif
+	}
+	else {
+		aFree(table->image);
 	}
+	memset(table, 0, sizeof(*table));
 }
 
-bool emote_db_init(void)
+// Hands an image to an empty table, which releases it in emote_db_clear() from
+// then on, and points packs/index/emotes into it. Returns the image header, or
+// NULL when the image is from another layout or corrupt.
+const struct emote_image_header* emote_db_use_image(struct s_emotion_pack_table* table, void* image, size_t size, bool mapped)
 {
-	const char* filename = "emotion_pack_db.conf";
-	char filepath[256];
-	libconfig->format_db_path(filename, filepath, sizeof(filepath));
+	table->image = image;
+	table->image_size = size;
+	table->image_mapped = mapped;
 
-	struct config_t conf;
-	if (libconfig->load_file(&conf, filepath) == 0)
-		return false;
+	const struct emote_image_header* header = emote_catalog_validate(image, size);
+	if (!header)
+		return NULL;
 
-	struct config_setting_t* root = libconfig->setting_get_member(conf.root, "emotion_pack_db");
-	if (!root || !config_setting_is_list(root)) {
-		ShowError("emote_db_init: Setting 'emotion_pack_db' not found or not a list.\n");
-		libconfig->destroy(&conf);
+	const uint8* base = (const uint8*)image;
+	table->packs = (struct s_emotion_db*)(base + header->packs_offset);
+	table->count = header->pack_count;
+	table->index = (int32*)(base + header->index_offset);
+	table->index_size = header->index_size;
+	table->emotes = (int32*)(base + header->emotes_offset);
+	table->emote_total = header->emote_total;
+	table->checksum = header->checksum;
+	return header;
+}
+
+// Writes an image next to the text DB. The file is written under a temporary
+// name and renamed, so concurrently starting servers never see a partial image.
+bool emote_db_write_image(const uint8* image, size_t size, const char* filepath)
+{
+	char tmppath[300];
+	safesnprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", filepath, (int)getpid());
+
+	FILE* fp = fopen(tmppath, "wb");
+	if (!fp) {
+		ShowWarning("emote_db_write_image: Cannot write '%s'.\n", tmppath);
 		return false;
 	}
 
-	if (!emotion_db)
-		emotion_db = idb_alloc(DB_OPT_RELEASE_DATA);
+	bool ok = fwrite(image, 1, size, fp) == size;
+	ok = (fclose(fp) == 0) && ok;
 
-	int total_packs = 0;
-	int total_emotes = 0;
+	if (!ok || rename(tmppath, filepath) != 0) {
+		ShowWarning("emote_db_write_image: Failed to write '%s'.\n", filepath);
+		remove(tmppath);
+		return false;
+	}
 
-	for (int i = 0; i < libconfig->setting_length(root); ++i) {
-		struct config_setting_t* entry = libconfig->setting_get_elem(root, i);
-		if (!entry)
-			continue;
+	return true;
+}
 
-		int temp_packId, temp_packType, temp_packPrice;
-		int64_t temp_saleStart, temp_saleEnd, temp_rentalPeriod;
-
-		if (!libconfig->setting_lookup_int(entry, "PackId", &temp_packId)) continue;
-		if (!libconfig->setting_lookup_int(entry, "PackType", &temp_packType)) continue;
-		if (!libconfig->setting_lookup_int(entry, "PackPrice", &temp_packPrice)) continue;
-		if (!libconfig->setting_lookup_int64(entry, "SaleStart", &temp_saleStart)) continue;
-		if (!libconfig->setting_lookup_int64(entry, "SaleEnd", &temp_saleEnd)) continue;
-		if (!libconfig->setting_lookup_int64(entry, "RentalPeriod", &temp_rentalPeriod)) continue;
-
-		struct s_emotion_db* ce = (struct s_emotion_db*)aMalloc(sizeof(struct s_emotion_db));
-		memset(ce, 0, sizeof(struct s_emotion_db));
-
-		ce->packId = (uint16)temp_packId;
-		ce->packType = (uint16)temp_packType;
-		ce->packPrice = (uint16)temp_packPrice;
-		ce->sale_start = temp_saleStart ? plugin_convert_to_unix_timestamp((uint64_t)temp_saleStart) : 0;
-		ce->sale_end = temp_saleEnd ? plugin_convert_to_unix_timestamp((uint64_t)temp_saleEnd) : 0;
-		ce->rental_period = (uint64_t)temp_rentalPeriod * 60 * 60 * 24;
-
-		struct config_setting_t* emotes = libconfig->setting_get_member(entry, "EmotesList");
-		if (emotes && config_setting_is_array(emotes)) {
-			int count = libconfig->setting_length(emotes);
-			for (int j = 0; j < count && ce->emote_count < MAX_EMOTE_PACKS; ++j) {
-				const char* ename = libconfig->setting_get_string_elem(emotes, j);
-				if (!ename) continue;
-
-				int val;
-				if (script->get_constant(ename, &val)) {
-					if (val >= 0 && val < ET_EMOTION_LAST) {
-						ce->emoteIds[ce->emote_count++] = (client_emotion_type)val;
-					}
-					else {
-						ShowWarning("emote_db_init: Invalid emotion constant (out of range): %s\n", ename);
-					}
-				}
-				else {
-					ShowWarning("emote_db_init: Unknown emotion constant: %s\n", ename);
-				}
-			}
-		}
+// Maps a binary image into an empty table. Returns false when the image is
+// missing, stale, from another layout version or corrupt.
+bool emote_db_load_image(struct s_emotion_pack_table* table, const char* filepath, const struct stat* source)
+{
+	struct stat st;
+	if (stat(filepath, &st) != 0 || (size_t)st.st_size < sizeof(struct emote_image_header))
+		return false;
+
+	size_t size = (size_t)st.st_size;
+	void* image = NULL;
+	bool mapped = false;
 
-		idb_put(emotion_db, temp_packId, ce);
-		total_packs++;
-		total_emotes += ce->emote_count;
+#ifndef WIN32
+	int fd = open(filepath, O_RDONLY);
+	if (fd < 0)
+		return false;
+	image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return false;
+	mapped = true;
+#else
+	FILE* fp = fopen(filepath, "rb");
+	if (!fp)
+		return false;
+	image = aMalloc(size);
+	size_t read_len = fread(image, 1, size, fp);
+	fclose(fp);
+	if (read_len != size) {
+		aFree(image);
+		return false;
 	}
+#endif
 
-	libconfig->destroy(&conf);
-	ShowStatus("Done reading '"CL_WHITE"%d"CL_RESET"' packs and '"CL_WHITE"%d"CL_RESET"' total emotes in '"CL_WHITE"%s"CL_RESET"'.\n",
-		total_packs, total_emotes, filepath);
+	const struct emote_image_header* header = emote_db_use_image(table, image, size, mapped);
+	if (!header)
+		return false;
 
-	return true;
+	return header->max_packs == MAX_EMOTION_PACKS && header->max_emotes == MAX_EMOTES_PER_PACK
+		&& header->source_mtime == (int64)source->st_mtime && header->source_size == (int64)source->st_size;
 }
 
-//===== Handling emotion pack purchases =====
-// Validates purchase requests: checks item existence, ownership type,
-// rental validity, and writes result status to the client.
-void clif_send_emote_expansion_success(struct map_session_data* sd, int16 packId, int8 isRented, uint32 RentEndTime)
+void emote_db_final(void)
 {
-	if (!sd) return;
-
-	struct PACKET_ZC_EMOTION_EXPANSION_SUCCESS p;
-	memset(&p, 0, sizeof(p));
-	p.packetType = HEADER_ZC_EMOTION_EXPANSION_SUCCESS;
-	p.packId = packId;
-	p.isRented = isRented;
-	p.timestamp = RentEndTime;
-	clif->send(&p, sizeof(p), &sd->bl, SELF);
+	emote_db_clear(&emotion_db);
 }
 
-void clif_send_emote_expansion_fail(struct map_session_data* sd, int16 packId, enum emotion_expansion_msg emote_status)
+// Parses emotion_pack_db.conf into an empty table and refreshes the image at imagepath.
+bool emote_db_parse_conf(struct s_emotion_pack_table* table, const char* filepath, const struct stat* source, const char* imagepath)
 {
-	if (!sd) return;
+	struct emote_catalog cat = { 0 };
 
-	struct PACKET_ZC_EMOTION_EXPANSION_FAIL p;
-	memset(&p, 0, sizeof(p));
-	p.packetType = HEADER_ZC_EMOTION_EXPANSION_FAIL;
-	p.packId = packId;
-	p.status = emote_status;
-	clif->send(&p, sizeof(p), &sd->bl, SELF);
+	if (!emote_catalog_parse(&cat, filepath, MAX_EMOTION_PACKS, MAX_EMOTES_PER_PACK)) {
+		emote_catalog_clear(&cat);
+		return false;
+	}
+
+	size_t size;
+	uint8* image = emote_catalog_serialize(&cat, (int64)source->st_mtime, (int64)source->st_size,
+		MAX_EMOTION_PACKS, MAX_EMOTES_PER_PACK, &size);
+	emote_catalog_clear(&cat);
+
+	emote_db_write_image(image, size, imagepath);
+	return emote_db_use_image(table, image, size, false) != NULL;
 }
 
-void emote_expansion_purchase(struct map_session_data* sd, int16 packId, int16 itemId, int8 amount)
+// Loads the emotion pack DB into an empty table, from the binary image when it
+// is up to date and from emotion_pack_db.conf otherwise (refreshing the image).
+// On failure the table must be released with emote_db_clear().
+bool emote_db_load(struct s_emotion_pack_table* table)
 {
-	if (!sd) return;
+	char filepath[256], imagepath[256];
+	libconfig->format_db_path("emotion_pack_db.conf", filepath, sizeof(filepath));
+	libconfig->format_db_path("emotion_pack_db.bin", imagepath, sizeof(imagepath));
 
-	if (itemId != UI_CURRENCY_ID) {
-		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_UNKNOWN);
-		return;
+	struct stat source;
+	if (stat(filepath, &source) != 0) {
+		ShowError("emote_db_load: Cannot access '%s'.\n", filepath);
+		return false;
 	}
 
-	if (battle->bc->basic_skill_check != 0 && pc->checkskill(sd, NV_BASIC) < 2 && pc->checkskill(sd, SU_BASIC_SKILL) < 1)
-	{
-		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_NOT_ENOUGH_BASICSKILL_LEVEL);
-		return;
+	if (emote_db_load_image(table, imagepath, &source)) {
+		ShowStatus("Done reading '"CL_WHITE"%d"CL_RESET"' packs and '"CL_WHITE"%d"CL_RESET"' total emotes in '"CL_WHITE"%s"CL_RESET"'.\n",
+			table->count, table->emote_total, imagepath);
+	}
+	else {
+		emote_db_clear(table);
+		if (!emote_db_parse_conf(table, filepath, &source, imagepath))
+			return false;
 	}
 
-	struct s_emotion_db* ce = (struct s_emotion_db*)idb_get(emotion_db, packId);
-	if (!ce) {
-		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_UNKNOWN);
-		return;
+	table->generation = ++emotion_db_generation;
+	return true;
+}
+
+bool emote_db_init(void)
+{
+	memset(emote_forbidden_mask, 0, sizeof(emote_forbidden_mask));
+	emote_mask_set(emote_forbidden_mask, ET_CHAT_PROHIBIT);
+
+	emote_db_clear(&emotion_db);
+	if (EMOTE_CATALOG_FROM_CHAR) {
+		// Stays empty until the char-server sends the catalog, which happens before players can connect
+		emotion_db.generation = ++emotion_db_generation;
+		return true;
 	}
 
-	if (amount != ce->packPrice) {
-		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_UNKNOWN);
-		return;
+	if (!emote_db_load(&emotion_db)) {
+		emote_db_clear(&emotion_db);
+		return false;
 	}
+	return true;
+}
 
-	time_t now = time(NULL);
-	if (ce->sale_start != 0 && ce->sale_start > now) {
-		clif_send_emote_expansion_fail(sd, packId, EMSG_NOT_YET_SALE_START_TIME);
-		return;
+//===== Emotion pack ownership storage =====
+// Ownership lives in two SQL tables (see emotion_pack.sql) instead of two registry
+// variables per pack: one bitmap of permanently owned packs per account and per
+// character, and one row per active rental. Both are read in a single query at
+// login and kept on the session (MSD index 3) until logout.
+enum emote_owner_scope {
+	EMOTE_SCOPE_ACCOUNT = 0,	// PackType 1, keyed by account_id
+	EMOTE_SCOPE_CHAR,			// PackType 2, keyed by char_id
+	EMOTE_SCOPE_MAX,
+};
+
+struct emote_owner_rental {
+	uint16 packId;
+	uint8 scope;
+	uint32 expire_time;
+};
+
+struct emote_owner_data {
+	uint8* owned[EMOTE_SCOPE_MAX];	// Permanent ownership bitmaps, bit N = packId N
+	int owned_len[EMOTE_SCOPE_MAX];	// Bitmap sizes in bytes
+	struct emote_owner_rental* rentals;
+	int rental_count;
+	int rental_max;
+	bool legacy_dirty;				// A script wrote a cashemote_* variable since the last migration
+};
+
+static inline int emote_pack_scope(const struct s_emotion_db* ce)
+{
+	return ce->packType == 1 ? EMOTE_SCOPE_ACCOUNT : EMOTE_SCOPE_CHAR;
+}
+
+static inline int emote_scope_owner(const struct map_session_data* sd, int scope)
+{
+	return scope == EMOTE_SCOPE_ACCOUNT ? sd->status.account_id : sd->status.char_id;
+}
+
+static inline bool emote_owner_test(const struct emote_owner_data* od, int scope, int packId)
+{
+	return packId / 8 < od->owned_len[scope] && (od->owned[scope][packId / 8] & (1 << (packId % 8))) != 0;
+}
+
+void emote_owner_set(struct emote_owner_data* od, int scope, int packId, bool owned)
+{
+	if (packId / 8 >= od->owned_len[scope]) {
+		if (!owned)
+			return;
+
+		int len = packId / 8 + 1;
+		RECREATE(od->owned[scope], uint8, len);
+		memset(od->owned[scope] + od->owned_len[scope], 0, len - od->owned_len[scope]);
+		od->owned_len[scope] = len;
 	}
 
-	if (ce->sale_end != 0 && ce->sale_end < now) {
-		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_DATE);
-		return;
+	if (owned)
+		od->owned[scope][packId / 8] |= 1 << (packId % 8);
+	else
+		od->owned[scope][packId / 8] &= ~(1 << (packId % 8));
+}
+
+struct emote_owner_rental* emote_owner_rental_find(struct emote_owner_data* od, int scope, int packId)
+{
+	for (int i = 0; i < od->rental_count; ++i) {
+		if (od->rentals[i].scope == scope && od->rentals[i].packId == packId)
+			return &od->rentals[i];
 	}
+	return NULL;
+}
 
-	char var_name[64];
-	sprintf(var_name, "%scashemote_%d", ce->packType == 1 ? "#" : "", ce->packId);
-	if (pc_readglobalreg(sd, script->add_variable(var_name)) != 0) {
-		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_ALREADY_BUY);
+// Sets the expiry of a rental, an expire_time of 0 removes it.
+void emote_owner_rental_set(struct emote_owner_data* od, int scope, int packId, uint32 expire_time)
+{
+	struct emote_owner_rental* r = emote_owner_rental_find(od, scope, packId);
+
+	if (expire_time == 0) {
+		if (r)
+			*r = od->rentals[--od->rental_count];
 		return;
 	}
 
-	if (amount > 0) {
-		int idx = pc->search_inventory(sd, itemId);
-		if (idx == INDEX_NOT_FOUND || sd->status.inventory[idx].amount < amount) {
-			clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_NOT_ENOUGH_NYANGVINE);
-			return;
+	if (!r) {
+		if (od->rental_count == od->rental_max) {
+			od->rental_max = max(od->rental_max * 2, 8);
+			RECREATE(od->rentals, struct emote_owner_rental, od->rental_max);
 		}
-		pc->delitem(sd, idx, amount, 0, 0, LOG_TYPE_CONSUME);
+		r = &od->rentals[od->rental_count++];
+		r->packId = (uint16)packId;
+		r->scope = (uint8)scope;
 	}
+	r->expire_time = expire_time;
+}
 
-	sprintf(var_name, "%scashemote_%d", ce->packType == 1 ? "#" : "", ce->packId);
-	pc_setglobalreg(sd, script->add_variable(var_name), 1);
+bool emote_owner_save_bitmap(struct map_session_data* sd, const struct emote_owner_data* od, int scope)
+{
+	char* esc = NULL;
+	CREATE(esc, char, od->owned_len[scope] * 2 + 1);
+	if (od->owned_len[scope] > 0)
+		SQL->EscapeStringLen(map->mysql_handle, esc, (const char*)od->owned[scope], od->owned_len[scope]);
 
-	if (ce->rental_period != 0) {
-		char var_expire[64];
-		uint64 expire_time = (uint64)(now + ce->rental_period);
-		sprintf(var_expire, "%scashemoteexpire_%d", ce->packType == 1 ? "#" : "", ce->packId);
-		pc_setglobalreg(sd, script->add_variable(var_expire), (int32)expire_time);
-		clif_send_emote_expansion_success(sd, packId, 1, (uint32)expire_time);
-		return;
-	}
+	bool ok = SQL_ERROR != SQL->Query(map->mysql_handle,
+		"INSERT INTO `%s` (`pack_type`, `owner_id`, `owned`) VALUES ('%d', '%d', '%s') ON DUPLICATE KEY UPDATE `owned` = VALUES(`owned`)",
+		EMOTE_OWNER_TABLE, scope + 1, emote_scope_owner(sd, scope), esc);
+	if (!ok)
+		Sql_ShowDebug(map->mysql_handle);
 
-	clif_send_emote_expansion_success(sd, packId, 0, 0);
+	aFree(esc);
+	return ok;
 }
 
-void clif_parse_emote_expansion_request(int fd)
+bool emote_owner_save_rental(struct map_session_data* sd, int scope, int packId, uint32 expire_time)
 {
-	struct map_session_data* sd = sockt->session[fd]->session_data;
-	if (!sd) return;
-
-	struct PACKET_CZ_EMOTION_EXPANSION_REQ* p = (struct PACKET_CZ_EMOTION_EXPANSION_REQ*)RFIFOP(fd, 0);
+	int result;
 
-	if (SHOW_DEBUG_MES)
-		ShowDebug("clif_parse_emote_expansion_request: AID=%d, packId=%d, itemId=%d, amount=%d\n",
-			sd->status.account_id, p->packId, p->itemId, p->amount);
+	if (expire_time == 0)
+		result = SQL->Query(map->mysql_handle, "DELETE FROM `%s` WHERE `pack_type` = '%d' AND `owner_id` = '%d' AND `pack_id` = '%d'",
+			EMOTE_RENTAL_TABLE, scope + 1, emote_scope_owner(sd, scope), packId);
+	else
+		result = SQL->Query(map->mysql_handle,
+			"INSERT INTO `%s` (`pack_type`, `owner_id`, `pack_id`, `expire_time`) VALUES ('%d', '%d', '%d', '%u') ON DUPLICATE KEY UPDATE `expire_time` = VALUES(`expire_time`)",
+			EMOTE_RENTAL_TABLE, scope + 1, emote_scope_owner(sd, scope), packId, expire_time);
 
-	emote_expansion_purchase(sd, p->packId, p->itemId, p->amount);
+	if (result == SQL_ERROR) {
+		Sql_ShowDebug(map->mysql_handle);
+		return false;
+	}
+	return true;
 }
 
-//===== Sending active emotes to the client =====
-// Constructs and sends a list of all active (owned and valid) emotion packs
-// upon login or request from the player.
-void clif_send_emote_expansion_list(struct map_session_data* sd, struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub* list, uint16 count)
+// One-shot conversion of the legacy (#)cashemote_<packId> and (#)cashemoteexpire_<packId>
+// variables of one scope. The player's registry is walked rather than the catalog, so
+// variables of packs the catalog does not hold are carried over too: one with an expire
+// time becomes a rental, one without a permanent pack. Variables of catalog packs of
+// the other scope are left alone. Converted variables are cleared. With force the bitmap
+// row is written even if nothing was found, which marks the owner as migrated.
+void emote_owner_migrate(struct map_session_data* sd, struct emote_owner_data* od, int scope, bool force)
 {
-	nullpo_retv(sd);
+	const char* prefix = scope == EMOTE_SCOPE_ACCOUNT ? "#cashemote_" : "cashemote_";
+	const char* expire_prefix = scope == EMOTE_SCOPE_ACCOUNT ? "#cashemoteexpire_" : "cashemoteexpire_";
+	size_t prefix_len = strlen(prefix);
+	int* packs = NULL;
+	int pack_count = 0, pack_max = 0;
+	bool changed = false;
+	time_t now = time(NULL);
 
-	uint16 packet_len = sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST) + count * sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub);
+	// Collect first, the registry must not change while it is iterated
+	if (sd->regs.vars) {
+		struct DBIterator* iter = db_iterator(sd->regs.vars);
+		union DBKey key;
 
-	struct PACKET_ZC_EMOTION_EXPANSION_LIST* p = (struct PACKET_ZC_EMOTION_EXPANSION_LIST*)aMalloc(packet_len);
-	if (!p)
-		return;
+		for (iter->first(iter, &key); dbi_exists(iter); iter->next(iter, &key)) {
+			const char* name = script->get_str(script_getvarid(key.i64));
+			char* end;
 
-	p->packetType = HEADER_ZC_EMOTION_EXPANSION_LIST;
-	p->packetLength = packet_len;
-	p->timestamp = (uint32)time(NULL);
+			if (script_getvaridx(key.i64) != 0 || !name || strncmp(name, prefix, prefix_len) != 0 || !ISDIGIT(name[prefix_len]))
+				continue;
 
-#if PACKETVER >= 20230920
-	p->timezone = 540; // UTC+9
-#endif
+			long packId = strtol(name + prefix_len, &end, 10);
+			if (*end != '\0' || packId > UINT16_MAX)
+				continue;
 
-	if (count > 0 && list != NULL) {
-		memcpy(p->list, list, count * sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub));
+			if (pack_count == pack_max) {
+				pack_max = max(pack_max * 2, 8);
+				RECREATE(packs, int, pack_max);
+			}
+			packs[pack_count++] = (int)packId;
+		}
+		dbi_destroy(iter);
 	}
 
-	if (SHOW_DEBUG_MES)
-		ShowDebug("clif_send_emote_expansion_list: AID=%d, count=%d, timestamp=%u\n",
-			sd->status.account_id, count, p->timestamp);
+	for (int i = 0; i < pack_count; ++i) {
+		const struct s_emotion_db* ce = emote_db_get(packs[i]);
+		if (ce && emote_pack_scope(ce) != scope)
+			continue;
+
+		char var_name[64];
+		snprintf(var_name, sizeof(var_name), "%s%d", prefix, packs[i]);
+		int64 own_var = script->add_variable(var_name);
+		snprintf(var_name, sizeof(var_name), "%s%d", expire_prefix, packs[i]);
+		int64 expire_var = script->add_variable(var_name);
 
-	clif->send(p, packet_len, &sd->bl, SELF);
-	aFree(p);
+		if (pc_readglobalreg(sd, own_var) == 0)
+			continue;
+
+		uint32 expire_time = (uint32)pc_readglobalreg(sd, expire_var);
+		bool rental = ce ? ce->rental_period != 0 : expire_time != 0;
+		if (!rental) {
+			emote_owner_set(od, scope, packs[i], true);
+			changed = true;
+		}
+		else if (now <= (time_t)expire_time) {
+			emote_owner_rental_set(od, scope, packs[i], expire_time);
+			emote_owner_save_rental(sd, scope, packs[i], expire_time);
+		}
+
+		emote_registry_sync = true;
+		pc_setglobalreg(sd, own_var, 0);
+		pc_setglobalreg(sd, expire_var, 0);
+		emote_registry_sync = false;
+	}
+	aFree(packs);
+
+	if (changed || force)
+		emote_owner_save_bitmap(sd, od, scope);
 }
 
-void emote_get_player_packs(struct map_session_data* sd)
+void emote_owner_free(struct map_session_data* sd)
 {
-	if (!sd || sd->fd == 0 || !emotion_db)
+	struct emote_owner_data* od = getFromMSD(sd, 3);
+	if (!od)
 		return;
 
-	struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub packs[MAX_EMOTE_PACKS];
-	uint16 count = 0;
-	time_t now = time(NULL);
+	for (int scope = 0; scope < EMOTE_SCOPE_MAX; ++scope)
+		aFree(od->owned[scope]);
+	aFree(od->rentals);
+	removeFromMSD(sd, 3);
+}
 
-	struct DBIterator* iter = db_iterator(emotion_db);
-	struct s_emotion_db* entry;
+enum emote_owner_row {
+	EMOTE_ROW_BITMAP = 0,
+	EMOTE_ROW_RENTAL,
+	EMOTE_ROW_JOURNAL,
+};
+
+struct emote_journal_entry {
+	uint8 scope;
+	uint8 owned;
+	uint16 packId;
+};
+
+// Reads the account's and the character's ownership in one query.
+// Owners without a bitmap row have not been migrated yet and are converted here.
+// Pending journal entries from bulk grants are then merged into the bitmaps and deleted.
+struct emote_owner_data* emote_owner_load(struct map_session_data* sd)
+{
+	int account_id = sd->status.account_id;
+	int char_id = sd->status.char_id;
+
+	if (SQL_ERROR == SQL->Query(map->mysql_handle,
+		"SELECT %d, `pack_type`, 0, 0, `owned` FROM `%s` WHERE (`pack_type` = '1' AND `owner_id` = '%d') OR (`pack_type` = '2' AND `owner_id` = '%d')"
+		" UNION ALL "
+		"SELECT %d, `pack_type`, `pack_id`, `expire_time`, NULL FROM `%s` WHERE (`pack_type` = '1' AND `owner_id` = '%d') OR (`pack_type` = '2' AND `owner_id` = '%d')"
+		" UNION ALL "
+		"SELECT %d, `pack_type`, `pack_id`, `owned`, NULL FROM `%s` WHERE (`pack_type` = '1' AND `owner_id` = '%d') OR (`pack_type` = '2' AND `owner_id` = '%d')",
+		EMOTE_ROW_BITMAP, EMOTE_OWNER_TABLE, account_id, char_id,
+		EMOTE_ROW_RENTAL, EMOTE_RENTAL_TABLE, account_id, char_id,
+		EMOTE_ROW_JOURNAL, EMOTE_JOURNAL_TABLE, account_id, char_id)) {
+		Sql_ShowDebug(map->mysql_handle);
+		return NULL;
+	}
 
-	for (entry = dbi_first(iter); dbi_exists(iter); entry = dbi_next(iter)) {
-		char var_name[64], var_name2[64];
-		uint64 has_pack = 0, expire_time = 0;
+	struct emote_owner_data* od = NULL;
+	struct emote_journal_entry* journal = NULL;
+	int journal_count = 0, journal_max = 0;
+	bool has_row[EMOTE_SCOPE_MAX] = { false };
+	CREATE(od, struct emote_owner_data, 1);
 
-		snprintf(var_name, sizeof(var_name), "%scashemote_%d", entry->packType == 1 ? "#" : "", entry->packId);
-		has_pack = pc_readglobalreg(sd, script->add_variable(var_name));
+	while (SQL_SUCCESS == SQL->NextRow(map->mysql_handle)) {
+		char* data;
+		size_t len;
 
-		snprintf(var_name2, sizeof(var_name2), "%scashemoteexpire_%d", entry->packType == 1 ? "#" : "", entry->packId);
-		expire_time = pc_readglobalreg(sd, script->add_variable(var_name2));
+		SQL->GetData(map->mysql_handle, 0, &data, NULL);
+		int row = atoi(data);
+		SQL->GetData(map->mysql_handle, 1, &data, NULL);
+		int scope = atoi(data) - 1;
+		if (scope < 0 || scope >= EMOTE_SCOPE_MAX)
+			continue;
 
-		if (has_pack != 0 && entry->rental_period != 0 && now > (time_t)expire_time) {
-			pc_setglobalreg(sd, script->add_variable(var_name), 0);
-			pc_setglobalreg(sd, script->add_variable(var_name2), 0);
+		if (row == EMOTE_ROW_BITMAP) {
+			has_row[scope] = true;
+			SQL->GetData(map->mysql_handle, 4, &data, &len);
+			if (len > 0) {
+				CREATE(od->owned[scope], uint8, len);
+				memcpy(od->owned[scope], data, len);
+				od->owned_len[scope] = (int)len;
+			}
 			continue;
 		}
 
-		if (has_pack != 0 && count < MAX_EMOTE_PACKS) {
-			packs[count].packId = entry->packId;
-			packs[count].isRented = (uint8)(entry->rental_period != 0);
-			packs[count].timestamp = (uint32)expire_time;
-			count++;
+		SQL->GetData(map->mysql_handle, 2, &data, NULL);
+		int packId = atoi(data);
+		SQL->GetData(map->mysql_handle, 3, &data, NULL);
+
+		if (row == EMOTE_ROW_RENTAL) {
+			emote_owner_rental_set(od, scope, packId, (uint32)strtoul(data, NULL, 10));
+		}
+		else {
+			if (journal_count == journal_max) {
+				journal_max = max(journal_max * 2, 8);
+				RECREATE(journal, struct emote_journal_entry, journal_max);
+			}
+			journal[journal_count].scope = (uint8)scope;
+			journal[journal_count].owned = (uint8)(atoi(data) != 0);
+			journal[journal_count].packId = (uint16)packId;
+			journal_count++;
 		}
 	}
-	dbi_destroy(iter);
+	SQL->FreeResult(map->mysql_handle);
+
+	addToMSD(sd, od, 3, true);
+
+	for (int scope = 0; scope < EMOTE_SCOPE_MAX; ++scope) {
+		if (!has_row[scope])
+			emote_owner_migrate(sd, od, scope, true);
+	}
 
-	clif_send_emote_expansion_list(sd, packs, count);
+	if (journal_count > 0) {
+		bool merged[EMOTE_SCOPE_MAX] = { false };
+
+		for (int i = 0; i < journal_count; ++i) {
+			emote_owner_set(od, journal[i].scope, journal[i].packId, journal[i].owned != 0);
+			merged[journal[i].scope] = true;
+		}
+
+		for (int scope = 0; scope < EMOTE_SCOPE_MAX; ++scope) {
+			if (merged[scope] && emote_owner_save_bitmap(sd, od, scope))
+				continue;
+			merged[scope] = false; // Keep the journal if the bitmap was not stored
+		}
+
+		// One statement per scope. Entries a bulk job queues from here on are also
+		// applied to the loaded data and stored by emote_bulk_apply, so none are lost.
+		for (int scope = 0; scope < EMOTE_SCOPE_MAX; ++scope) {
+			if (merged[scope] && SQL_ERROR == SQL->Query(map->mysql_handle,
+				"DELETE FROM `%s` WHERE `pack_type` = '%d' AND `owner_id` = '%d'",
+				EMOTE_JOURNAL_TABLE, scope + 1, emote_scope_owner(sd, scope)))
+				Sql_ShowDebug(map->mysql_handle);
+		}
+		aFree(journal);
+	}
+	return od;
 }
 
-//===== Handling emotion playback requests =====
-// Validates whether the requested emotion exists in the pack, whether the player owns it,
-// and whether the pack is active. Sends success or failure packet accordingly.
-void clif_send_emote_success(struct block_list* bl, int16 packId, int16 emoteId)
+// Returns the player's ownership data, loading it on first use. Legacy variables
+// written by scripts since the last call are folded in first.
+// Returns NULL until the registry and the catalog have arrived: migrating before would
+// read the legacy variables as 0, or miss which packs are rentals, and still mark the
+// owner as migrated.
+struct emote_owner_data* emote_owner_get(struct map_session_data* sd)
 {
-	nullpo_retv(bl);
+	struct emote_owner_data* od = getFromMSD(sd, 3);
+	if (!od) {
+		if (!sd->vars_ok || !emotion_db.image)
+			return NULL;
+		return emote_owner_load(sd);
+	}
 
-	struct PACKET_ZC_EMOTION_SUCCESS p;
-	p.packetType = HEADER_ZC_EMOTION_SUCCESS;
-	p.GID = bl->id;
-	p.packId = packId;
-	p.emoteId = emoteId;
+	if (od->legacy_dirty) {
+		od->legacy_dirty = false;
+		for (int scope = 0; scope < EMOTE_SCOPE_MAX; ++scope)
+			emote_owner_migrate(sd, od, scope, false);
+	}
+	return od;
+}
 
-	if (SHOW_DEBUG_MES)
-		ShowDebug("clif_send_emote_success: GID=%u, packId=%u, emoteId=%u\n",
-			(unsigned int)p.GID, (unsigned int)p.packId, (unsigned int)p.emoteId);
+static inline bool emote_session_owns(const struct emote_session_data* esd, int index)
+{
+	return index < esd->pack_count && (esd->data[index / 32] & (1U << (index % 32))) != 0;
+}
 
-	clif->send(&p, sizeof(p), bl, AREA);
+static inline uint32* emote_session_expire(struct emote_session_data* esd)
+{
+	return esd->data + EMOTE_BITSET_WORDS(esd->pack_count);
 }
 
-void clif_send_emote_fail(struct map_session_data* sd, int16 packId, int16 emoteId, enum emote_msg emote_status)
+void emote_session_set(struct emote_session_data* esd, int index, bool owned, uint32 expire_time)
 {
-	nullpo_retv(sd);
+	if (index >= esd->pack_count)
+		return;
 
-	struct PACKET_ZC_EMOTION_FAIL p;
-	p.packetType = HEADER_ZC_EMOTION_FAIL;
-	p.packId = packId;
-	p.emoteId = emoteId;
-	p.status = (uint8)emote_status;
+	if (owned)
+		esd->data[index / 32] |= 1U << (index % 32);
+	else
+		esd->data[index / 32] &= ~(1U << (index % 32));
+	emote_session_expire(esd)[index] = owned ? expire_time : 0;
+}
 
-	ShowDebug("clif_send_emote_fail: AID=%d, packId=%d, emoteId=%d, status=%d\n",
-		sd->status.account_id, p.packId, p.emoteId, p.status);
+// Allocates a fresh cache sized for the current pack DB and attaches it to sd,
+// replacing any previous one.
+struct emote_session_data* emote_session_create(struct map_session_data* sd)
+{
+	struct emote_session_data* esd = (struct emote_session_data*)aCalloc(1, EMOTE_SESSION_SIZE(emotion_db.count));
+	esd->pack_count = emotion_db.count;
+	esd->generation = emotion_db.generation;
 
-	clif->send(&p, sizeof(p), &sd->bl, SELF);
+	if (getFromMSD(sd, 0))
+		removeFromMSD(sd, 0);
+	addToMSD(sd, esd, 0, true);
+	return esd;
 }
 
-void emote_check_before_use(struct map_session_data* sd, int16 packId, int16 emoteId)
+// Copies ownership of one pack from the ownership data into the cache.
+// A rental that lapsed while the player was away is deleted.
+void emote_session_load_pack(struct map_session_data* sd, struct emote_owner_data* od, struct emote_session_data* esd, int slot, time_t now)
 {
-	nullpo_retv(sd);
+	const struct s_emotion_db* entry = &emotion_db.packs[slot];
+	int scope = emote_pack_scope(entry);
 
-	if (battle->bc->basic_skill_check != 0 && pc->checkskill(sd, NV_BASIC) < 2 && pc->checkskill(sd, SU_BASIC_SKILL) < 1) {
-		clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_USE_FAIL_SKILL_LEVEL);
+	if (entry->rental_period == 0) {
+		emote_session_set(esd, slot, emote_owner_test(od, scope, entry->packId), 0);
 		return;
 	}
 
-	if (emoteId == ET_CHAT_PROHIBIT) {
-		clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_EXPANSION_USE_FAIL_UNKNOWN);
-		return;
+	struct emote_owner_rental* r = emote_owner_rental_find(od, scope, entry->packId);
+	if (r && now > (time_t)r->expire_time) {
+		emote_owner_rental_set(od, scope, entry->packId, 0);
+		emote_owner_save_rental(sd, scope, entry->packId, 0);
+		r = NULL;
 	}
 
-	if (sd->emotionlasttime + 1 >= time(NULL)) {
-		sd->emotionlasttime = time(NULL);
-		clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_EXPANSION_USE_FAIL_UNKNOWN);
-		return;
-	}
-	sd->emotionlasttime = time(NULL);
-	pc->update_idle_time(sd, BCIDLE_EMOTION);
+	emote_session_set(esd, slot, r != NULL, r ? r->expire_time : 0);
+}
 
-	struct s_emotion_db* ce = (struct s_emotion_db*)idb_get(emotion_db, packId);
-	if (!ce) {
-		clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_EXPANSION_USE_FAIL_UNKNOWN);
-		return;
+// Builds a new cache for every pack from the player's ownership data.
+struct emote_session_data* emote_session_load(struct map_session_data* sd)
+{
+	if (!sd || emotion_db.count == 0)
+		return NULL;
+
+	struct emote_owner_data* od = emote_owner_get(sd);
+	if (!od)
+		return NULL;
+
+	struct emote_session_data* esd = emote_session_create(sd);
+	time_t now = time(NULL);
+
+	for (int slot = 0; slot < emotion_db.count; ++slot)
+		emote_session_load_pack(sd, od, esd, slot, now);
+
+	emote_rental_schedule_session(sd, esd);
+	return esd;
+}
+
+// Scratch buffer for ZC_EMOTION_EXPANSION_LIST entries, grown to the largest catalog seen
+struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub* emote_list_buf = NULL;
+int emote_list_max = 0;
+
+// Writes every owned pack into emote_list_buf and returns the number of entries.
+int emote_session_list(struct emote_session_data* esd)
+{
+	struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub* list;
+	int count = 0;
+
+	if (esd->pack_count > emote_list_max) {
+		emote_list_max = esd->pack_count;
+		RECREATE(emote_list_buf, struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub, emote_list_max);
+	}
+	list = emote_list_buf;
+
+	for (int slot = 0; slot < esd->pack_count; ++slot) {
+		if (!emote_session_owns(esd, slot))
+			continue;
+
+		list[count].packId = emotion_db.packs[slot].packId;
+		list[count].isRented = (uint8)(emotion_db.packs[slot].rental_period != 0);
+		list[count].timestamp = emote_session_expire(esd)[slot];
+		count++;
+	}
+
+	return count;
+}
+
+// Returns the player's ownership cache, building it if it is missing
+// (e.g. dropped after a script changed a cashemote_* variable).
+struct emote_session_data* emote_session_get(struct map_session_data* sd)
+{
+	struct emote_session_data* esd = getFromMSD(sd, 0);
+	if (esd && esd->generation == emotion_db.generation)
+		return esd;
+	return emote_session_load(sd);
+}
+
+//===== Legacy client support =====
+// Clients older than the emotion expansion UI only understand ZC_EMOTION. Hercules
+// builds for one PACKETVER, so the client generation of a session is learned from
+// the emotion packets it sends: CZ_REQ_EMOTION2 / CZ_EMOTION_EXPANSION_REQ mark a
+// new client for good, the old CZ_REQ_EMOTION marks a legacy one. Until then the
+// session is unknown and EMOTE_LEGACY_DEFAULT picks the encoding. Kept on the session
+// as MSD index 4.
+enum emote_client_version {
+	EMOTE_CLIENT_UNKNOWN = 0,
+	EMOTE_CLIENT_NEW,
+	EMOTE_CLIENT_LEGACY,
+};
+
+struct emote_client_data {
+	uint8 version;
+	int64 window_tick;		// Start of the viewer's crowd delivery window
+	int window_count;		// Emotes delivered to the viewer in that window
+	int pending_head;		// Emotes of this tick awaiting crowd selection, see emote_crowd_defer
+	int pending_count;
+};
+
+// Closest emote a legacy client knows, for emotes at or above EMOTE_LEGACY_LAST.
+// Entries may chain; an emote without a fallback is not shown to legacy clients.
+static const struct {
+	int emote;
+	int fallback;
+} emote_legacy_fallbacks[] = {
+	{ ET_HUM2, ET_HUM },
+	{ ET_FLAG8, ET_FLAG },
+	{ ET_FLAG9, ET_FLAG },
+	{ ET_ANTENNA0, ET_AHA },
+	{ ET_ANTENNA1, ET_AHA },
+	{ ET_ANTENNA2, ET_AHA },
+	{ ET_ANTENNA3, ET_AHA },
+	{ ET_OOPS, ET_OHNO },
+	{ ET_SPIT, ET_MERONG },
+	{ ET_ENE, ET_DELIGHT },
+	{ ET_PANIC, ET_PROFUSELY_SWEAT },
+	{ ET_WHISP, ET_BLABLA },
+	{ ET_CLICK_ME, ET_QUESTION },
+	{ ET_DAILY_QUEST, ET_QUESTION },
+	{ ET_EVENT, ET_QUESTION },
+	{ ET_JOB_QUEST, ET_QUESTION },
+	{ ET_TRAFFIC_LINE_QUEST, ET_QUESTION },
+};
+
+int16 emote_legacy_map[ET_EMOTION_LAST];	// client_emotion_type -> emote sent to legacy clients, ET_BLANK if none
+
+void emote_legacy_init(void)
+{
+	for (int emote = 0; emote < ET_EMOTION_LAST; ++emote) {
+		int mapped = emote;
+
+		for (int depth = 0; mapped >= EMOTE_LEGACY_LAST && depth < ET_EMOTION_LAST; ++depth) {
+			int next = ET_BLANK;
+			for (size_t i = 0; i < ARRAYLENGTH(emote_legacy_fallbacks); ++i) {
+				if (emote_legacy_fallbacks[i].emote == mapped) {
+					next = emote_legacy_fallbacks[i].fallback;
+					break;
+				}
+			}
+			mapped = next;
+			if (mapped == ET_BLANK)
+				break;
+		}
+
+		emote_legacy_map[emote] = (int16)(mapped >= EMOTE_LEGACY_LAST ? ET_BLANK : mapped);
+	}
+}
+
+static inline enum emote_client_version emote_client_get(struct map_session_data* sd)
+{
+	struct emote_client_data* cd = getFromMSD(sd, 4);
+	return cd ? (enum emote_client_version)cd->version : EMOTE_CLIENT_UNKNOWN;
+}
+
+// Whether the session gets the legacy ZC_EMOTION encoding
+static inline bool emote_client_legacy(struct map_session_data* sd)
+{
+	enum emote_client_version version = emote_client_get(sd);
+	return version == EMOTE_CLIENT_LEGACY || (version == EMOTE_CLIENT_UNKNOWN && EMOTE_LEGACY_DEFAULT);
+}
+
+struct emote_client_data* emote_client_data_get(struct map_session_data* sd)
+{
+	struct emote_client_data* cd = getFromMSD(sd, 4);
+	if (!cd) {
+		CREATE(cd, struct emote_client_data, 1);
+		cd->version = EMOTE_CLIENT_UNKNOWN;
+		addToMSD(sd, cd, 4, true);
+	}
+	return cd;
+}
+
+// Records the client generation of a session. A new client stays marked as new.
+void emote_client_mark(struct map_session_data* sd, enum emote_client_version version)
+{
+	struct emote_client_data* cd = emote_client_data_get(sd);
+	if (cd->version != EMOTE_CLIENT_NEW)
+		cd->version = (uint8)version;
+}
+
+//===== Usage analytics counters =====
+// Plain per-(pack, emote) use counters and per-pack purchase counters, bumped on the
+// success paths of emote_check_before_use and emote_expansion_purchase. They are
+// only touched from the main thread; emote_usage_flush copies them into a worker
+// job every EMOTE_USAGE_INTERVAL minutes, so the emote path never waits on SQL.
+// uses[] follows the emote arena: a pack's counters start at its emote_offset and
+// are indexed by the emote's rank in the pack's emote_mask.
+struct emote_usage_counters {
+	uint32* uses;
+	int uses_size;
+	uint32* purchases;		// Per pack slot
+	int purchases_size;
+};
+
+struct emote_usage_counters emote_usage = { 0 };
+
+// Sizes the counters for the current emotion_db and clears them.
+void emote_usage_reset(void)
+{
+	aFree(emote_usage.uses);
+	aFree(emote_usage.purchases);
+	emote_usage.uses_size = max(emotion_db.emote_total, 1);
+	emote_usage.purchases_size = max(emotion_db.count, 1);
+	CREATE(emote_usage.uses, uint32, emote_usage.uses_size);
+	CREATE(emote_usage.purchases, uint32, emote_usage.purchases_size);
+}
+
+static inline void emote_usage_add_use(const struct s_emotion_db* ce, int emoteId, uint32 count)
+{
+	int pos = (int)ce->emote_offset + emote_mask_rank(ce->emote_mask, emoteId);
+	if (pos < emote_usage.uses_size)
+		emote_usage.uses[pos] += count;
+}
+
+static inline void emote_usage_add_purchase(const struct s_emotion_db* ce, uint32 count)
+{
+	int slot = emote_db_slot(ce);
+	if (slot < emote_usage.purchases_size)
+		emote_usage.purchases[slot] += count;
+}
+
+void emote_usage_flush(void);
+
+//===== Purchase ledger =====
+// Every completed purchase gets a transaction ID and is appended to an in-memory
+// ledger. A timer hands the pending entries to the SQL worker every
+// EMOTE_LEDGER_FLUSH_MS, which writes them in batches keyed on the transaction ID.
+// A duplicate key is only accepted when the stored row is the same purchase (a
+// retried batch); any other one is reported as a collision. Each session also
+// remembers its last purchases: the same pack requested again within
+// EMOTE_LEDGER_DEDUP_MS is answered with the original result before any inventory
+// or ownership work is done.
+// Transaction ID: epoch (32 bits) | EMOTE_LEDGER_SERVER_ID (8 bits) | sequence (24 bits).
+// Epochs are reserved in EMOTE_LEDGER_EPOCH_TABLE before use, each above the clock
+// and every epoch the server ID had before, so a restart or a sequence wrap never
+// hands out an ID twice.
+#define EMOTE_LEDGER_RECENT 4
+
+struct emote_ledger_entry {
+	uint64 txn;
+	uint32 time;
+	int account_id;
+	int char_id;
+	uint16 packId;
+	int16 itemId;
+	int16 amount;
+	uint32 expire_time;		// Rental end, 0 for a permanent pack
+};
+
+struct emote_ledger_queue {
+	struct emote_ledger_entry* list;
+	int count;
+	int max;
+	uint32 epoch;			// High half of the transaction IDs
+	uint32 seq;
+	uint64 written;			// Entries confirmed by the worker
+	uint64 replays;			// Duplicate requests answered from memory
+};
+
+struct emote_ledger_queue emote_ledger = { 0 };
+
+// Recent purchases of a session, for de-duplication (MSD 5)
+struct emote_purchase_recent {
+	uint64 txn;
+	int64 tick;
+	uint16 packId;
+	uint32 expire_time;
+};
+
+struct emote_purchase_data {
+	struct emote_purchase_recent recent[EMOTE_LEDGER_RECENT];
+	int next;
+};
+
+// Makes sure a transaction ID is available, reserving a new epoch when needed.
+// Returns false if none could be reserved; the purchase must then be refused.
+bool emote_ledger_reserve(void)
+{
+	if (emote_ledger.epoch != 0 && emote_ledger.seq < 0xFFFFFF)
+		return true;
+
+	int server_id = EMOTE_LEDGER_SERVER_ID & 0xFF;
+	uint32 stored = 0;
+
+	if (SQL_ERROR == SQL->Query(map->mysql_handle, "SELECT `epoch` FROM `%s` WHERE `server_id` = '%d'", EMOTE_LEDGER_EPOCH_TABLE, server_id)) {
+		Sql_ShowDebug(map->mysql_handle);
+		return false;
+	}
+	if (SQL_SUCCESS == SQL->NextRow(map->mysql_handle)) {
+		char* data;
+		SQL->GetData(map->mysql_handle, 0, &data, NULL);
+		stored = (uint32)strtoul(data, NULL, 10);
+	}
+	SQL->FreeResult(map->mysql_handle);
+
+	uint32 epoch = max(max((uint32)time(NULL), stored + 1), emote_ledger.epoch + 1);
+	if (SQL_ERROR == SQL->Query(map->mysql_handle, "REPLACE INTO `%s` (`server_id`, `epoch`) VALUES ('%d', '%u')", EMOTE_LEDGER_EPOCH_TABLE, server_id, epoch)) {
+		Sql_ShowDebug(map->mysql_handle);
+		return false;
+	}
+
+	emote_ledger.epoch = epoch;
+	emote_ledger.seq = 0;
+	return true;
+}
+
+// Hands out the next transaction ID. emote_ledger_reserve must have succeeded.
+uint64 emote_ledger_next_txn(void)
+{
+	emote_ledger.seq++;
+	return ((uint64)emote_ledger.epoch << 32) | ((uint64)(EMOTE_LEDGER_SERVER_ID & 0xFF) << 24) | emote_ledger.seq;
+}
+
+void emote_ledger_append(const struct emote_ledger_entry* entry)
+{
+	if (emote_ledger.count >= emote_ledger.max) {
+		emote_ledger.max = max(emote_ledger.max * 2, 64);
+		RECREATE(emote_ledger.list, struct emote_ledger_entry, emote_ledger.max);
+	}
+	emote_ledger.list[emote_ledger.count++] = *entry;
+}
+
+// Returns the purchase of packId the session completed within EMOTE_LEDGER_DEDUP_MS, if any
+const struct emote_purchase_recent* emote_purchase_recent_find(struct map_session_data* sd, uint16 packId)
+{
+	struct emote_purchase_data* pd = getFromMSD(sd, 5);
+	if (!pd)
+		return NULL;
+
+	int64 tick = timer->gettick();
+	for (int i = 0; i < EMOTE_LEDGER_RECENT; ++i) {
+		const struct emote_purchase_recent* r = &pd->recent[i];
+		if (r->txn != 0 && r->packId == packId && DIFF_TICK(tick, r->tick) < EMOTE_LEDGER_DEDUP_MS)
+			return r;
+	}
+	return NULL;
+}
+
+// Assigns a transaction ID to a completed purchase and queues it for the ledger
+uint64 emote_ledger_record(struct map_session_data* sd, const struct s_emotion_db* ce, int16 itemId, int16 amount, uint32 expire_time)
+{
+	struct emote_ledger_entry entry;
+
+	entry.txn = emote_ledger_next_txn();
+	entry.time = (uint32)time(NULL);
+	entry.account_id = sd->status.account_id;
+	entry.char_id = sd->status.char_id;
+	entry.packId = ce->packId;
+	entry.itemId = itemId;
+	entry.amount = amount;
+	entry.expire_time = expire_time;
+	emote_ledger_append(&entry);
+
+	struct emote_purchase_data* pd = getFromMSD(sd, 5);
+	if (!pd) {
+		CREATE(pd, struct emote_purchase_data, 1);
+		addToMSD(sd, pd, 5, true);
+	}
+	struct emote_purchase_recent* r = &pd->recent[pd->next];
+	pd->next = (pd->next + 1) % EMOTE_LEDGER_RECENT;
+	r->txn = entry.txn;
+	r->tick = timer->gettick();
+	r->packId = ce->packId;
+	r->expire_time = expire_time;
+	return entry.txn;
+}
+
+//===== Handling emotion pack purchases =====
+// Validates purchase requests: checks item existence, ownership type,
+// rental validity, and writes result status to the client.
+void clif_send_emote_expansion_success(struct map_session_data* sd, int16 packId, int8 isRented, uint32 RentEndTime)
+{
+	if (!sd) return;
+
+	struct PACKET_ZC_EMOTION_EXPANSION_SUCCESS p;
+	memset(&p, 0, sizeof(p));
+	p.packetType = HEADER_ZC_EMOTION_EXPANSION_SUCCESS;
+	p.packId = packId;
+	p.isRented = isRented;
+	p.timestamp = RentEndTime;
+	clif->send(&p, sizeof(p), &sd->bl, SELF);
+}
+
+void clif_send_emote_expansion_fail(struct map_session_data* sd, int16 packId, enum emotion_expansion_msg emote_status)
+{
+	if (!sd) return;
+
+	struct PACKET_ZC_EMOTION_EXPANSION_FAIL p;
+	memset(&p, 0, sizeof(p));
+	p.packetType = HEADER_ZC_EMOTION_EXPANSION_FAIL;
+	p.packId = packId;
+	p.status = emote_status;
+	clif->send(&p, sizeof(p), &sd->bl, SELF);
+}
+
+void emote_expansion_purchase(struct map_session_data* sd, int16 packId, int16 itemId, int8 amount)
+{
+	if (!sd) return;
+
+	// A replayed request gets the original answer, nothing is charged twice
+	const struct emote_purchase_recent* replay = emote_purchase_recent_find(sd, (uint16)packId);
+	if (replay) {
+		emote_ledger.replays++;
+		ns_trace(&emote_trace, EMOTE_TRACE_SHOP, EMOTE_EV_EXPANSION_REPLAY, sd->status.account_id, packId, (int32)(replay->txn >> 32), (int32)(replay->txn & 0xFFFFFFFF));
+		clif_send_emote_expansion_success(sd, packId, replay->expire_time != 0 ? 1 : 0, replay->expire_time);
+		return;
+	}
+
+	if (itemId != UI_CURRENCY_ID) {
+		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_UNKNOWN);
+		return;
+	}
+
+	if (battle->bc->basic_skill_check != 0 && pc->checkskill(sd, NV_BASIC) < 2 && pc->checkskill(sd, SU_BASIC_SKILL) < 1)
+	{
+		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_NOT_ENOUGH_BASICSKILL_LEVEL);
+		return;
+	}
+
+	struct s_emotion_db* ce = emote_db_get(packId);
+	if (!ce) {
+		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_UNKNOWN);
+		return;
+	}
+
+	if (amount != ce->packPrice) {
+		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_UNKNOWN);
+		return;
+	}
+
+	time_t now = time(NULL);
+	if (ce->sale_start != 0 && ce->sale_start > now) {
+		clif_send_emote_expansion_fail(sd, packId, EMSG_NOT_YET_SALE_START_TIME);
+		return;
+	}
+
+	if (ce->sale_end != 0 && ce->sale_end < now) {
+		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_DATE);
+		return;
+	}
+
+	struct emote_session_data* esd = emote_session_get(sd);
+	if (!esd) {
+		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_UNKNOWN);
+		return;
+	}
+
+	if (emote_session_owns(esd, emote_db_slot(ce))) {
+		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_ALREADY_BUY);
+		return;
+	}
+
+	int idx = INDEX_NOT_FOUND;
+	if (amount > 0) {
+		idx = pc->search_inventory(sd, itemId);
+		if (idx == INDEX_NOT_FOUND || sd->status.inventory[idx].amount < amount) {
+			clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_NOT_ENOUGH_NYANGVINE);
+			return;
+		}
+	}
+
+	// Without a transaction ID the purchase could not be recorded
+	if (!emote_ledger_reserve()) {
+		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_UNKNOWN);
+		return;
+	}
+
+	// Ownership is stored before the currency is taken, so a failed write costs nothing
+	struct emote_owner_data* od = emote_owner_get(sd);
+	int scope = emote_pack_scope(ce);
+	uint32 expire_time = ce->rental_period != 0 ? (uint32)(now + ce->rental_period) : 0;
+	bool saved;
+
+	if (!od) {
+		saved = false;
+	}
+	else if (expire_time != 0) {
+		saved = emote_owner_save_rental(sd, scope, ce->packId, expire_time);
+		if (saved)
+			emote_owner_rental_set(od, scope, ce->packId, expire_time);
+	}
+	else {
+		emote_owner_set(od, scope, ce->packId, true);
+		saved = emote_owner_save_bitmap(sd, od, scope);
+		if (!saved)
+			emote_owner_set(od, scope, ce->packId, false);
+	}
+
+	if (!saved) {
+		clif_send_emote_expansion_fail(sd, packId, EMSG_EMOTION_EXPANSION_FAIL_UNKNOWN);
+		return;
+	}
+
+	if (idx != INDEX_NOT_FOUND)
+		pc->delitem(sd, idx, amount, 0, 0, LOG_TYPE_CONSUME);
+
+	emote_session_set(esd, emote_db_slot(ce), true, expire_time);
+	emote_usage_add_purchase(ce, 1);
+	emote_ledger_record(sd, ce, itemId, amount, expire_time);
+	if (expire_time != 0) {
+		emote_rental_schedule(sd, ce->packId, expire_time);
+		clif_send_emote_expansion_success(sd, packId, 1, expire_time);
+		return;
+	}
+
+	clif_send_emote_expansion_success(sd, packId, 0, 0);
+}
+
+void clif_parse_emote_expansion_request(int fd)
+{
+	struct map_session_data* sd = sockt->session[fd]->session_data;
+	if (!sd) return;
+
+	struct PACKET_CZ_EMOTION_EXPANSION_REQ* p = (struct PACKET_CZ_EMOTION_EXPANSION_REQ*)RFIFOP(fd, 0);
+
+	ns_trace(&emote_trace, EMOTE_TRACE_SHOP, EMOTE_EV_EXPANSION_REQ, sd->status.account_id, p->packId, p->itemId, p->amount);
+
+	emote_client_mark(sd, EMOTE_CLIENT_NEW);
+	emote_expansion_purchase(sd, p->packId, p->itemId, p->amount);
+}
+
+//===== Sending active emotes to the client =====
+// Constructs and sends a list of all active (owned and valid) emotion packs
+// upon login or request from the player.
+// A list that does not fit in one EMOTE_LIST_PACKET_MAX packet (see emote_list.h)
+// is sent as several consecutive ZC_EMOTION_EXPANSION_LIST packets.
+#define EMOTE_LIST_PER_PACKET emote_list_per_packet(sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST), sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub))
+
+void clif_send_emote_expansion_list(struct map_session_data* sd, const struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub* list, int count)
+{
+	nullpo_retv(sd);
+
+	int chunk_max = min(count, EMOTE_LIST_PER_PACKET);
+	struct PACKET_ZC_EMOTION_EXPANSION_LIST* p = (struct PACKET_ZC_EMOTION_EXPANSION_LIST*)aMalloc(
+		sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST) + chunk_max * sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub));
+	if (!p)
+		return;
+
+	p->packetType = HEADER_ZC_EMOTION_EXPANSION_LIST;
+	p->timestamp = (uint32)time(NULL);
+
+#if PACKETVER >= 20230920
+	p->timezone = 540; // UTC+9
+#endif
+
+	int sent = 0;
+	do {
+		int chunk = emote_list_chunk(count, sent, chunk_max);
+		size_t packet_len = sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST) + chunk * sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub);
+
+		p->packetLength = (int16)packet_len;
+		if (chunk > 0 && list != NULL)
+			memcpy(p->list, list + sent, chunk * sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub));
+
+		ns_trace(&emote_trace, EMOTE_TRACE_LIST, EMOTE_EV_EXPANSION_LIST, sd->status.account_id, chunk, p->timestamp, sent);
+
+		clif->send(p, (int)packet_len, &sd->bl, SELF);
+		sent += chunk;
+	} while (sent < count);
+
+	aFree(p);
+}
+
+void emote_session_send_list(struct map_session_data* sd, struct emote_session_data* esd)
+{
+	int count = emote_session_list(esd);
+	clif_send_emote_expansion_list(sd, emote_list_buf, count);
+}
+
+// Builds the player's cache and sends the list. Returns true if it was sent.
+bool emote_get_player_packs(struct map_session_data* sd)
+{
+	if (!sd || sd->fd == 0 || emotion_db.count == 0)
+		return false;
+
+	struct emote_session_data* esd = emote_session_load(sd);
+	if (!esd)
+		return false;
+
+	emote_session_send_list(sd, esd);
+	return true;
+}
+
+//===== Rental expiry timer wheel =====
+// Rented packs of online players are scheduled on a hierarchical timer wheel keyed
+// on the expiry second, advanced by a one-second interval timer. Scheduling,
+// cancelling and firing a rental are O(1), with no periodic scan of all sessions.
+// When a rental lapses, its ownership is cleared and the player gets a new list.
+// Level 0 has 256 one-second slots; each higher level has 64 slots spanning a
+// full turn of the level below, so the wheel covers 2^26 seconds (~776 days).
+// Anything further out parks in the last level and is re-inserted on cascade.
+#define EMOTE_WHEEL_LEVELS 4
+#define EMOTE_WHEEL_SLOTS0 256
+#define EMOTE_WHEEL_SLOTS 64
+#define EMOTE_WHEEL_SHIFT(level) ((level) == 0 ? 0 : 8 + 6 * ((level) - 1))
+#define EMOTE_WHEEL_SPAN (UINT32_C(1) << EMOTE_WHEEL_SHIFT(EMOTE_WHEEL_LEVELS))
+
+struct emote_rental_timer {
+	struct emote_rental_timer* prev;		// Wheel slot list
+	struct emote_rental_timer* next;
+	struct emote_rental_timer** slot;		// Wheel slot currently holding this timer
+	struct emote_rental_timer* owner_prev;	// Per-player list
+	struct emote_rental_timer* owner_next;
+	int char_id;
+	uint16 packId;
+	uint32 expire;
+};
+
+// Per-player list of scheduled rentals, attached to map_session_data (HPM data index 1).
+struct emote_rental_owner {
+	struct emote_rental_timer* timers;
+};
+
+// A rental that came due, copied off the wheel before it is expired
+struct emote_rental_due {
+	int char_id;
+	uint16 packId;
+	uint32 expire;
+};
+
+struct emote_rental_timer* emote_wheel[EMOTE_WHEEL_LEVELS][EMOTE_WHEEL_SLOTS0];
+uint32 emote_wheel_next = 0;	// Next second to be processed
+struct emote_rental_timer* emote_rental_free_list = NULL;
+struct emote_rental_due* emote_rental_due_list = NULL;	// Scratch: rentals due this second
+int emote_rental_due_max = 0;
+
+static void emote_wheel_link(struct emote_rental_timer* t)
+{
+	uint32 expire = t->expire > emote_wheel_next ? t->expire : emote_wheel_next;
+	uint32 delta = expire - emote_wheel_next;
+	int level = 0;
+
+	if (delta >= EMOTE_WHEEL_SPAN) {
+		expire = emote_wheel_next + EMOTE_WHEEL_SPAN - 1;
+		delta = EMOTE_WHEEL_SPAN - 1;
+	}
+
+	while (level < EMOTE_WHEEL_LEVELS - 1 && delta >= (UINT32_C(1) << EMOTE_WHEEL_SHIFT(level + 1)))
+		level++;
+
+	uint32 mask = level == 0 ? EMOTE_WHEEL_SLOTS0 - 1 : EMOTE_WHEEL_SLOTS - 1;
+	struct emote_rental_timer** slot = &emote_wheel[level][(expire >> EMOTE_WHEEL_SHIFT(level)) & mask];
+
+	t->slot = slot;
+	t->prev = NULL;
+	t->next = *slot;
+	if (*slot)
+		(*slot)->prev = t;
+	*slot = t;
+}
+
+static void emote_wheel_unlink(struct emote_rental_timer* t)
+{
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		*t->slot = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	t->prev = t->next = NULL;
+	t->slot = NULL;
+}
+
+static void emote_rental_release(struct map_session_data* sd, struct emote_rental_timer* t)
+{
+	struct emote_rental_owner* owner = sd ? getFromMSD(sd, 1) : NULL;
+
+	if (t->owner_prev)
+		t->owner_prev->owner_next = t->owner_next;
+	else if (owner && owner->timers == t)
+		owner->timers = t->owner_next;
+	if (t->owner_next)
+		t->owner_next->owner_prev = t->owner_prev;
+
+	t->next = emote_rental_free_list;
+	emote_rental_free_list = t;
+}
+
+// Cancels the player's scheduled rental of one pack, if any
+static void emote_rental_cancel(struct map_session_data* sd, uint16 packId)
+{
+	struct emote_rental_owner* owner = getFromMSD(sd, 1);
+	struct emote_rental_timer* t = owner ? owner->timers : NULL;
+
+	while (t) {
+		struct emote_rental_timer* next = t->owner_next;
+		if (t->packId == packId) {
+			emote_wheel_unlink(t);
+			emote_rental_release(sd, t);
+		}
+		t = next;
+	}
+}
+
+// Schedules a rental, replacing the one already scheduled for the pack
+void emote_rental_schedule(struct map_session_data* sd, uint16 packId, uint32 expire_time)
+{
+	emote_rental_cancel(sd, packId);
+
+	struct emote_rental_owner* owner = getFromMSD(sd, 1);
+	if (!owner) {
+		CREATE(owner, struct emote_rental_owner, 1);
+		addToMSD(sd, owner, 1, true);
+	}
+
+	struct emote_rental_timer* t = emote_rental_free_list;
+	if (t)
+		emote_rental_free_list = t->next;
+	else
+		CREATE(t, struct emote_rental_timer, 1);
+
+	memset(t, 0, sizeof(*t));
+	t->char_id = sd->status.char_id;
+	t->packId = packId;
+	t->expire = expire_time;
+	emote_wheel_link(t);
+
+	t->owner_next = owner->timers;
+	if (owner->timers)
+		owner->timers->owner_prev = t;
+	owner->timers = t;
+}
+
+void emote_rental_cancel_session(struct map_session_data* sd)
+{
+	struct emote_rental_owner* owner = getFromMSD(sd, 1);
+	if (!owner)
+		return;
+
+	while (owner->timers) {
+		struct emote_rental_timer* t = owner->timers;
+		emote_wheel_unlink(t);
+		emote_rental_release(sd, t);
+	}
+}
+
+// Replaces the player's scheduled rentals with the ones in the cache.
+void emote_rental_schedule_session(struct map_session_data* sd, struct emote_session_data* esd)
+{
+	emote_rental_cancel_session(sd);
+
+	for (int slot = 0; slot < esd->pack_count; ++slot) {
+		if (emotion_db.packs[slot].rental_period == 0 || !emote_session_owns(esd, slot))
+			continue;
+		if (emote_session_expire(esd)[slot] != 0)
+			emote_rental_schedule(sd, emotion_db.packs[slot].packId, emote_session_expire(esd)[slot]);
+	}
+}
+
+// Called when a scheduled rental's second has come. The cache is checked again,
+// as the pack may have been re-bought, reloaded or already cleared in between.
+static void emote_rental_expire(struct map_session_data* sd, uint16 packId, uint32 expire_time)
+{
+	struct emote_session_data* esd = getFromMSD(sd, 0);
+	if (!esd || esd->generation != emotion_db.generation) {
+		// Rebuilding the cache deletes lapsed rentals
+		esd = emote_session_get(sd);
+	}
+	else {
+		const struct s_emotion_db* ce = emote_db_get(packId);
+		if (!ce || ce->rental_period == 0)
+			return;
+
+		int slot = emote_db_slot(ce);
+		if (!emote_session_owns(esd, slot) || emote_session_expire(esd)[slot] != expire_time)
+			return;
+
+		struct emote_owner_data* od = getFromMSD(sd, 3);
+		if (od)
+			emote_owner_rental_set(od, emote_pack_scope(ce), packId, 0);
+		emote_owner_save_rental(sd, emote_pack_scope(ce), packId, 0);
+		emote_session_set(esd, slot, false, 0);
+	}
+
+	if (!esd)
+		return;
+
+	emote_session_send_list(sd, esd);
+}
+
+static void emote_wheel_cascade(int level)
+{
+	struct emote_rental_timer** slot = &emote_wheel[level][(emote_wheel_next >> EMOTE_WHEEL_SHIFT(level)) & (EMOTE_WHEEL_SLOTS - 1)];
+	struct emote_rental_timer* t = *slot;
+	*slot = NULL;
+
+	while (t) {
+		struct emote_rental_timer* next = t->next;
+		emote_wheel_link(t);
+		t = next;
+	}
+}
+
+// Advances the wheel one second at a time up to now, so a stalled server catches up.
+// Due timers are all taken off the wheel before any rental is expired: expiring can
+// rebuild the player's cache, which cancels and reschedules their timers.
+static int emote_rental_wheel_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	uint32 now = (uint32)time(NULL);
+
+	while (emote_wheel_next <= now) {
+		int index = emote_wheel_next & (EMOTE_WHEEL_SLOTS0 - 1);
+
+		for (int level = 1; level < EMOTE_WHEEL_LEVELS; ++level) {
+			if (((emote_wheel_next >> EMOTE_WHEEL_SHIFT(level - 1)) & (level == 1 ? EMOTE_WHEEL_SLOTS0 - 1 : EMOTE_WHEEL_SLOTS - 1)) != 0)
+				break;
+			emote_wheel_cascade(level);
+		}
+
+		struct emote_rental_timer* t = emote_wheel[0][index];
+		int due = 0;
+		emote_wheel[0][index] = NULL;
+
+		while (t) {
+			struct emote_rental_timer* next = t->next;
+
+			t->prev = t->next = NULL;
+			t->slot = NULL;
+			if (t->expire > emote_wheel_next) {
+				emote_wheel_link(t); // Parked beyond the wheel span, not due yet
+			}
+			else {
+				if (due == emote_rental_due_max) {
+					emote_rental_due_max = max(emote_rental_due_max * 2, 32);
+					RECREATE(emote_rental_due_list, struct emote_rental_due, emote_rental_due_max);
+				}
+				emote_rental_due_list[due].char_id = t->char_id;
+				emote_rental_due_list[due].packId = t->packId;
+				emote_rental_due_list[due].expire = t->expire;
+				due++;
+				emote_rental_release(map->charid2sd(t->char_id), t);
+			}
+			t = next;
+		}
+
+		emote_wheel_next++;
+
+		for (int i = 0; i < due; ++i) {
+			struct map_session_data* sd = map->charid2sd(emote_rental_due_list[i].char_id);
+			if (sd)
+				emote_rental_expire(sd, emote_rental_due_list[i].packId, emote_rental_due_list[i].expire);
+		}
+	}
+
+	return 0;
+}
+
+void emote_rental_final(void)
+{
+	for (int level = 0; level < EMOTE_WHEEL_LEVELS; ++level) {
+		for (int i = 0; i < EMOTE_WHEEL_SLOTS0; ++i) {
+			while (emote_wheel[level][i]) {
+				struct emote_rental_timer* t = emote_wheel[level][i];
+				emote_wheel[level][i] = t->next;
+				aFree(t);
+			}
+		}
+	}
+
+	while (emote_rental_free_list) {
+		struct emote_rental_timer* t = emote_rental_free_list;
+		emote_rental_free_list = t->next;
+		aFree(t);
+	}
+	aFree(emote_rental_due_list);
+	emote_rental_due_list = NULL;
+	emote_rental_due_max = 0;
+}
+
+//===== Crowd delivery settings =====
+// On maps with crowd delivery enabled (emotion_crowd_db.conf), a viewer who receives
+// too many emotes per second or sees too many senders in one tick only gets emotes
+// from themselves, their party and guild, and the nearest senders. Everything else is
+// dropped before it is written. The nearest senders are picked with a histogram over
+// the (bounded) cell distance, so selection stays linear in the number of emotes.
+#define EMOTE_CROWD_WINDOW_MS 1000
+
+struct emote_crowd_map {
+	bool enabled;
+	int viewer_rate;	// Emotes per EMOTE_CROWD_WINDOW_MS before a viewer is crowded
+	int senders;		// Distinct senders visible in one tick before a viewer is crowded
+	int nearest;		// Closest other senders still delivered to a crowded viewer
+	uint64 culled;		// Packets not sent
+	uint64 culled_bytes;
+};
+
+struct emote_crowd_map emote_crowd_default = { false, 20, 30, 10, 0, 0 };
+struct emote_crowd_map* emote_crowd = NULL;	// Per map, indexed by map id
+int emote_crowd_size = 0;
+int* emote_crowd_idx = NULL;				// Scratch: queue entries one viewer gets
+int emote_crowd_idx_max = 0;
+
+static void emote_crowd_read_entry(struct config_setting_t* entry, struct emote_crowd_map* cm)
+{
+	int val;
+
+	if (libconfig->setting_lookup_bool(entry, "Enabled", &val))
+		cm->enabled = val != 0;
+	if (libconfig->setting_lookup_int(entry, "ViewerRate", &val))
+		cm->viewer_rate = max(val, 1);
+	if (libconfig->setting_lookup_int(entry, "Senders", &val))
+		cm->senders = max(val, 1);
+	if (libconfig->setting_lookup_int(entry, "Nearest", &val))
+		cm->nearest = max(val, 0);
+}
+
+// Reads emotion_crowd_db.conf. Counters of the maps are kept across reloads.
+bool emote_crowd_load(void)
+{
+	char filepath[256];
+	struct config_t conf;
+
+	libconfig->format_db_path("emotion_crowd_db.conf", filepath, sizeof(filepath));
+
+	if (emote_crowd_size < map->count) {
+		RECREATE(emote_crowd, struct emote_crowd_map, map->count);
+		memset(emote_crowd + emote_crowd_size, 0, (map->count - emote_crowd_size) * sizeof(struct emote_crowd_map));
+		emote_crowd_size = map->count;
+	}
+
+	struct emote_crowd_map fallback = { false, 20, 30, 10, 0, 0 };
+	struct config_setting_t* root = NULL;
+	bool loaded = libconfig->load_file(&conf, filepath);
+
+	if (loaded) {
+		root = libconfig->setting_get_member(conf.root, "emotion_crowd_db");
+		if (!root || !config_setting_is_list(root)) {
+			ShowError("emote_crowd_load: Setting 'emotion_crowd_db' not found or not a list.\n");
+			root = NULL;
+		}
+	}
+
+	// The default entry first, so listed maps start from it
+	for (int i = 0; root && i < libconfig->setting_length(root); ++i) {
+		struct config_setting_t* entry = libconfig->setting_get_elem(root, i);
+		const char* name;
+		if (entry && libconfig->setting_lookup_string(entry, "Map", &name) && strcmpi(name, "default") == 0)
+			emote_crowd_read_entry(entry, &fallback);
+	}
+
+	emote_crowd_default = fallback;
+	for (int m = 0; m < emote_crowd_size; ++m) {
+		uint64 culled = emote_crowd[m].culled, culled_bytes = emote_crowd[m].culled_bytes;
+		emote_crowd[m] = fallback;
+		emote_crowd[m].culled = culled;
+		emote_crowd[m].culled_bytes = culled_bytes;
+	}
+
+	int maps = 0;
+	for (int i = 0; root && i < libconfig->setting_length(root); ++i) {
+		struct config_setting_t* entry = libconfig->setting_get_elem(root, i);
+		const char* name;
+		if (!entry || !libconfig->setting_lookup_string(entry, "Map", &name) || strcmpi(name, "default") == 0)
+			continue;
+
+		int m = map->mapname2mapid(name);
+		if (m < 0 || m >= emote_crowd_size)
+			continue; // Not on this map-server
+
+		emote_crowd_read_entry(entry, &emote_crowd[m]);
+		maps++;
+	}
+
+	if (loaded)
+		libconfig->destroy(&conf);
+	if (root)
+		ShowStatus("Done reading crowd delivery settings for '"CL_WHITE"%d"CL_RESET"' maps in '"CL_WHITE"%s"CL_RESET"'.\n", maps, filepath);
+	return root != NULL;
+}
+
+static inline struct emote_crowd_map* emote_crowd_get(int16 m)
+{
+	return (m >= 0 && m < emote_crowd_size) ? &emote_crowd[m] : &emote_crowd_default;
+}
+
+//===== Emotion pack DB hot reload =====
+// Parses emotion_pack_db.conf into a fresh table off to the side and swaps it in
+// only when the whole file loaded. Online players' caches are remapped to the new
+// slots, and only players owning an added, removed or changed pack get a new list.
+enum emote_db_diff {
+	EMOTE_DIFF_NONE = 0,
+	EMOTE_DIFF_ADDED,
+	EMOTE_DIFF_CHANGED,
+};
+
+static bool emote_db_pack_changed(const struct s_emotion_db* a, const struct s_emotion_db* b)
+{
+	return a->packType != b->packType || a->rental_period != b->rental_period
+		|| a->sale_start != b->sale_start || a->sale_end != b->sale_end || a->packPrice != b->packPrice;
+}
+
+// Moves a player's cache from the old table's slots to the current table.
+// Returns true when the player owns a pack that was added, removed or changed.
+bool emote_session_remap(struct map_session_data* sd, const struct s_emotion_pack_table* old, const uint8* diff, time_t now)
+{
+	struct emote_session_data* old_esd = getFromMSD(sd, 0);
+	if (!old_esd || old_esd->generation != old->generation)
+		return false;
+
+	// Keep the old cache alive until its bits are copied
+	size_t old_size = EMOTE_SESSION_SIZE(old_esd->pack_count);
+	struct emote_session_data* prev = (struct emote_session_data*)aMalloc(old_size);
+	memcpy(prev, old_esd, old_size);
+
+	struct emote_session_data* esd = emote_session_create(sd);
+	bool affected = false;
+
+	for (int slot = 0; slot < prev->pack_count; ++slot) {
+		if (!emote_session_owns(prev, slot))
+			continue;
+
+		const struct s_emotion_db* ce = emote_db_get(old->packs[slot].packId);
+		if (!ce) {
+			affected = true; // Pack removed from the catalog
+			continue;
+		}
+
+		int new_slot = emote_db_slot(ce);
+		if (diff[new_slot] == EMOTE_DIFF_NONE)
+			emote_session_set(esd, new_slot, true, emote_session_expire(prev)[slot]);
+	}
+
+	// Added and changed packs are re-read, as their ownership scope or rental rules differ
+	struct emote_owner_data* od = getFromMSD(sd, 3);
+	for (int slot = 0; od && slot < emotion_db.count; ++slot) {
+		if (diff[slot] == EMOTE_DIFF_NONE)
+			continue;
+
+		emote_session_load_pack(sd, od, esd, slot, now);
+		if (emote_session_owns(esd, slot))
+			affected = true;
+	}
+
+	aFree(prev);
+	emote_rental_schedule_session(sd, esd);
+	return affected;
+}
+
+// Makes a fully loaded table the current one and releases the old one.
+void emote_db_swap(struct s_emotion_pack_table* fresh, int* out_notified)
+{
+	emote_usage_flush();
+
+	struct s_emotion_pack_table old = emotion_db;
+	emotion_db = *fresh;
+	emote_usage_reset();
+
+	uint8* diff = NULL;
+	CREATE(diff, uint8, max(emotion_db.count, 1));
+	for (int slot = 0; slot < emotion_db.count; ++slot) {
+		const struct s_emotion_db* ce = &emotion_db.packs[slot];
+		int old_slot = ce->packId < old.index_size ? old.index[ce->packId] : -1;
+
+		if (old_slot < 0)
+			diff[slot] = EMOTE_DIFF_ADDED;
+		else if (emote_db_pack_changed(ce, &old.packs[old_slot]))
+			diff[slot] = EMOTE_DIFF_CHANGED;
+	}
+
+	int notified = 0;
+	time_t now = time(NULL);
+	struct s_mapiterator* iter = mapit_getallusers();
+	struct map_session_data* sd;
+
+	for (sd = BL_UCAST(BL_PC, mapit->first(iter)); mapit->exists(iter); sd = BL_UCAST(BL_PC, mapit->next(iter))) {
+		// No cache means nothing to remap: the player logged in before the first
+		// catalog arrived and never got a list, or a script write dropped the cache.
+		// Players still loading get their list on LoadEndAck.
+		if (!getFromMSD(sd, 0)) {
+			if (sd->state.active && emote_get_player_packs(sd))
+				notified++;
+			continue;
+		}
+
+		if (!emote_session_remap(sd, &old, diff, now))
+			continue;
+
+		emote_session_send_list(sd, getFromMSD(sd, 0));
+		notified++;
+	}
+	mapit->free(iter);
+
+	aFree(diff);
+	emote_db_clear(&old);
+
+	if (out_notified)
+		*out_notified = notified;
+}
+
+bool emote_db_reload(int* out_notified)
+{
+	struct s_emotion_pack_table fresh = { 0 };
+	if (!emote_db_load(&fresh)) {
+		emote_db_clear(&fresh);
+		ShowError("emote_db_reload: Failed to reload the emotion pack DB, keeping the current one.\n");
+		return false;
+	}
+
+	emote_db_swap(&fresh, out_notified);
+	return true;
+}
+
+bool emote_catalog_request_reload(void);
+
+ACMD(reloademotedb)
+{
+	int notified = 0;
+	char output[128];
+
+	if (EMOTE_CATALOG_FROM_CHAR) {
+		emote_crowd_load();
+		if (!emote_catalog_request_reload()) {
+			clif->message(fd, "The char-server is not connected, the emotion pack database was not reloaded.");
+			return false;
+		}
+		clif->message(fd, "Emotion pack database reload requested from the char-server.");
+		return true;
+	}
+
+	if (!emote_db_reload(&notified)) {
+		clif->message(fd, "Failed to reload the emotion pack database, the previous one is still active.");
+		return false;
+	}
+
+	emote_crowd_load();
+	safesnprintf(output, sizeof(output), "Emotion pack database reloaded (%d packs). %d online player(s) updated.", emotion_db.count, notified);
+	clif->message(fd, output);
+	return true;
+}
+
+CPCMD(reloademotedb)
+{
+	int notified = 0;
+
+	emote_crowd_load();
+	if (EMOTE_CATALOG_FROM_CHAR) {
+		if (emote_catalog_request_reload())
+			ShowInfo("Emotion pack database reload requested from the char-server.\n");
+		else
+			ShowWarning("The char-server is not connected, the emotion pack database was not reloaded.\n");
+		return;
+	}
+	if (emote_db_reload(&notified))
+		ShowInfo("Emotion pack database reloaded (%d packs), %d online player(s) updated.\n", emotion_db.count, notified);
+}
+
+//===== Catalog from the char-server =====
+// With EMOTE_CATALOG_FROM_CHAR the map-server does not read emotion_pack_db.conf.
+// The ns_client_emote_ui_catalog char-server plugin parses it once and streams the
+// catalog image over the char link (see emote_catalog.h), so every map-server of a
+// cluster runs the same catalog. Chunks are gathered until the image is complete,
+// then it is swapped in like a local reload. @reloademotedb asks the char-server
+// to reload, which pushes the new catalog to all map-servers.
+struct emote_catalog_receive {
+	uint32 serial;		// Serial of the image being received
+	uint32 total_size;
+	uint32 received;
+	uint8* buf;
+};
+
+struct emote_catalog_receive emote_catalog_in = { 0 };
+
+// Asks the char-server for its catalog unless it matches ours
+void emote_catalog_request(void)
+{
+	if (!chrif->isconnected())
+		return;
+
+	struct PACKET_EMOTE_CATALOG_REQ p;
+	p.packetType = HEADER_EMOTE_CATALOG_REQ;
+	p.checksum = emotion_db.image ? emotion_db.checksum : 0;
+
+	WFIFOHEAD(chrif->fd, sizeof(p));
+	memcpy(WFIFOP(chrif->fd, 0), &p, sizeof(p));
+	WFIFOSET(chrif->fd, sizeof(p));
+}
+
+bool emote_catalog_request_reload(void)
+{
+	if (!chrif->isconnected())
+		return false;
+
+	struct PACKET_EMOTE_CATALOG_RELOAD p;
+	p.packetType = HEADER_EMOTE_CATALOG_RELOAD;
+
+	WFIFOHEAD(chrif->fd, sizeof(p));
+	memcpy(WFIFOP(chrif->fd, 0), &p, sizeof(p));
+	WFIFOSET(chrif->fd, sizeof(p));
+	return true;
+}
+
+// Swaps in a complete image received from the char-server. Takes ownership of image.
+static void emote_catalog_install(uint8* image, size_t size)
+{
+	struct s_emotion_pack_table fresh = { 0 };
+	int notified = 0;
+
+	const struct emote_image_header* header = emote_db_use_image(&fresh, image, size, false);
+	if (!header) {
+		emote_db_clear(&fresh);
+		ShowError("emote_catalog_install: Received a corrupt or incompatible emotion pack catalog, keeping the current one.\n");
+		return;
+	}
+
+	fresh.generation = ++emotion_db_generation;
+	emote_db_swap(&fresh, &notified);
+
+	ShowStatus("Received '"CL_WHITE"%d"CL_RESET"' packs and '"CL_WHITE"%d"CL_RESET"' total emotes from the char-server, %d online player(s) updated.\n",
+		emotion_db.count, emotion_db.emote_total, notified);
+}
+
+void chrif_parse_emote_catalog_data(int fd)
+{
+	const struct PACKET_EMOTE_CATALOG_DATA* p = (const struct PACKET_EMOTE_CATALOG_DATA*)RFIFOP(fd, 0);
+	struct emote_catalog_receive* in = &emote_catalog_in;
+	uint32 len = p->packetLength - sizeof(*p);
+
+	if (!EMOTE_CATALOG_FROM_CHAR)
+		return;
+
+	// A new transfer (or a newer catalog) starts at offset 0 and replaces any unfinished one
+	if (p->offset == 0) {
+		aFree(in->buf);
+		in->serial = p->serial;
+		in->total_size = p->total_size;
+		in->received = 0;
+		in->buf = (uint8*)aMalloc(max(p->total_size, 1));
+	}
+
+	if (!in->buf || p->serial != in->serial || p->offset != in->received || len > in->total_size - in->received) {
+		ShowWarning("chrif_parse_emote_catalog_data: Unexpected catalog chunk (serial %u, offset %u), dropping the transfer.\n", p->serial, p->offset);
+		aFree(in->buf);
+		memset(in, 0, sizeof(*in));
+		return;
+	}
+
+	memcpy(in->buf + in->received, p->data, len);
+	in->received += len;
+	if (in->received < in->total_size)
+		return;
+
+	uint8* image = in->buf;
+	size_t size = in->total_size;
+	memset(in, 0, sizeof(*in));
+	emote_catalog_install(image, size);
+}
+
+static void chrif_on_ready_post(void)
+{
+	if (EMOTE_CATALOG_FROM_CHAR)
+		emote_catalog_request();
+}
+
+//===== Background SQL worker =====
+// Bulk and maintenance jobs run on one worker thread with its own SQL connection,
+// so they never stall the map-server tick. run() is called on the worker and may
+// only use the job's own data and the connection it is given; it must not touch
+// memmgr, StrBuf, timers or Hercules' SQL interface, which are main-thread only
+// (see ns_db.h). done() is called on the map-server thread by a polling timer once
+// the job has finished, then free(). The reason of a failure is kept in error.
+struct emote_job {
+	struct emote_job* next;
+	bool (*run)(struct emote_job* job, struct ns_db* db);
+	void (*done)(struct emote_job* job);
+	void (*free)(struct emote_job* job);
+	bool success;
+	char error[256];
+};
+
+struct emote_worker_data {
+	struct thread_handle* thread;
+	struct mutex_data* lock;
+	struct cond_data* wake;
+	struct emote_job* pending;			// Guarded by lock
+	struct emote_job** pending_tail;
+	struct emote_job* finished;			// Guarded by lock
+	struct emote_job** finished_tail;
+	volatile int32 running;
+	int poll_timer;
+	struct ns_db db;					// Owned by the worker thread once it runs
+};
+
+struct emote_worker_data emote_worker = { 0 };
+
+static void* emote_worker_main(void* param)
+{
+	struct ns_db* db = &emote_worker.db;
+
+	mutex->lock(emote_worker.lock);
+	for (;;) {
+		struct emote_job* job = emote_worker.pending;
+		if (!job) {
+			if (InterlockedExchangeAdd(&emote_worker.running, 0) == 0)
+				break;
+			mutex->cond_wait(emote_worker.wake, emote_worker.lock, 1000);
+			continue;
+		}
+
+		emote_worker.pending = job->next;
+		if (!emote_worker.pending)
+			emote_worker.pending_tail = &emote_worker.pending;
+		mutex->unlock(emote_worker.lock);
+
+		db->error[0] = '\0';
+		job->success = ns_db_ready(db) && job->run(job, db);
+		if (!job->success)
+			snprintf(job->error, sizeof(job->error), "%s", db->error);
+		job->next = NULL;
+
+		mutex->lock(emote_worker.lock);
+		*emote_worker.finished_tail = job;
+		emote_worker.finished_tail = &job->next;
+	}
+	mutex->unlock(emote_worker.lock);
+
+	ns_db_final(db);
+	return NULL;
+}
+
+static int emote_worker_poll_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	mutex->lock(emote_worker.lock);
+	struct emote_job* job = emote_worker.finished;
+	emote_worker.finished = NULL;
+	emote_worker.finished_tail = &emote_worker.finished;
+	mutex->unlock(emote_worker.lock);
+
+	while (job) {
+		struct emote_job* next = job->next;
+		if (!job->success && job->error[0] != '\0')
+			ShowError("emote_worker: %s\n", job->error);
+		job->done(job);
+		job->free(job);
+		job = next;
+	}
+	return 0;
+}
+
+bool emote_worker_init(void)
+{
+	emote_worker.poll_timer = INVALID_TIMER;
+	emote_worker.lock = mutex->create();
+	emote_worker.wake = mutex->cond_create();
+	emote_worker.pending_tail = &emote_worker.pending;
+	emote_worker.finished_tail = &emote_worker.finished;
+	emote_worker.running = 1;
+	ns_db_setup(&emote_worker.db, map->map_server_ip, map->map_server_port, map->map_server_id,
+		map->map_server_pw, map->map_server_db, map->default_codepage);
+	emote_worker.thread = thread->create(emote_worker_main, NULL);
+
+	if (!emote_worker.thread) {
+		ShowError("emote_worker_init: Could not start the SQL worker thread, background jobs are disabled.\n");
+		emote_worker.running = 0;
+		return false;
+	}
+
+	timer->add_func_list(emote_worker_poll_timer, "emote_worker_poll_timer");
+	emote_worker.poll_timer = timer->add_interval(timer->gettick() + 100, emote_worker_poll_timer, 0, 0, 100);
+	return true;
+}
+
+// Queues a job for the worker thread. Returns false (and frees the job) if the worker is not running.
+bool emote_worker_push(struct emote_job* job)
+{
+	if (!emote_worker.thread) {
+		job->free(job);
+		return false;
+	}
+
+	job->next = NULL;
+	mutex->lock(emote_worker.lock);
+	*emote_worker.pending_tail = job;
+	emote_worker.pending_tail = &job->next;
+	mutex->cond_signal(emote_worker.wake);
+	mutex->unlock(emote_worker.lock);
+	return true;
+}
+
+// Lets the worker finish the queued jobs, then discards their results.
+void emote_worker_final(void)
+{
+	if (emote_worker.thread) {
+		InterlockedExchange(&emote_worker.running, 0);
+		mutex->lock(emote_worker.lock);
+		mutex->cond_signal(emote_worker.wake);
+		mutex->unlock(emote_worker.lock);
+		thread->wait(emote_worker.thread, NULL);
+		emote_worker.thread = NULL;
+	}
+
+	if (emote_worker.poll_timer != INVALID_TIMER)
+		timer->delete(emote_worker.poll_timer, emote_worker_poll_timer);
+
+	while (emote_worker.finished) {
+		struct emote_job* job = emote_worker.finished;
+		emote_worker.finished = job->next;
+		job->free(job);
+	}
+
+	if (emote_worker.wake)
+		mutex->cond_destroy(emote_worker.wake);
+	if (emote_worker.lock)
+		mutex->destroy(emote_worker.lock);
+	memset(&emote_worker, 0, sizeof(emote_worker));
+}
+
+//===== Bulk grant and revoke =====
+// Grants or revokes one pack for a list of owners, e.g. everyone who joined an event,
+// whether they are online or not. Rentals are written straight to the rental table;
+// permanent packs go to the journal, which is merged into the owner's bitmap at the
+// next login. Statements are batched EMOTE_BULK_BATCH rows at a time on the worker.
+// Online owners are updated in memory when the job finishes, without another query.
+struct emote_bulk_job {
+	struct emote_job job;
+	bool grant;
+	bool rental;
+	int scope;
+	uint16 packId;
+	uint32 expire_time;		// Rental end of a grant
+	char* filter;			// WHERE clause on EMOTE_CHAR_TABLE built by emote_bulk_filter, NULL when ids were given
+	int* ids;				// Owner IDs on the libc heap (the worker appends to it), sorted by the worker
+	int id_count;
+	int id_max;
+	uint64 rows;			// Rows changed
+	int requester;			// account_id of the GM to report to, 0 when started by a script
+};
+
+static bool emote_bulk_add_id(struct emote_bulk_job* bj, int id)
+{
+	if (bj->id_count == bj->id_max) {
+		int id_max = max(bj->id_max * 2, 64);
+		int* ids = (int*)realloc(bj->ids, id_max * sizeof(int));
+		if (!ids)
+			return false;
+		bj->ids = ids;
+		bj->id_max = id_max;
+	}
+	bj->ids[bj->id_count++] = id;
+	return true;
+}
+
+static int emote_bulk_cmp(const void* a, const void* b)
+{
+	int x = *(const int*)a, y = *(const int*)b;
+	return x < y ? -1 : x > y;
+}
+
+static bool emote_bulk_run(struct emote_job* job, struct ns_db* db)
+{
+	struct emote_bulk_job* bj = (struct emote_bulk_job*)job;
+	struct ns_db_buf buf = { 0 };
+
+	if (bj->filter) {
+		ns_db_buf_printf(&buf, "SELECT DISTINCT `%s` FROM `%s` WHERE %s",
+			bj->scope == EMOTE_SCOPE_ACCOUNT ? "account_id" : "char_id", EMOTE_CHAR_TABLE, bj->filter);
+		if (buf.failed || !ns_db_query(db, buf.data, buf.len)) {
+			ns_db_buf_free(&buf);
+			return false;
+		}
+
+		MYSQL_RES* res = mysql_store_result(db->mysql);
+		MYSQL_ROW row;
+		bool ok = res != NULL;
+		while (ok && (row = mysql_fetch_row(res)) != NULL) {
+			if (row[0])
+				ok = emote_bulk_add_id(bj, atoi(row[0]));
+		}
+		if (res)
+			mysql_free_result(res);
+		if (!ok) {
+			snprintf(db->error, sizeof(db->error), "Could not read the owner list of the bulk change.");
+			ns_db_buf_free(&buf);
+			return false;
+		}
+	}
+
+	if (bj->id_count == 0) {
+		ns_db_buf_free(&buf);
+		return true;
+	}
+
+	// Sorted and unique, for the IN lists and for the lookups in emote_bulk_done
+	qsort(bj->ids, bj->id_count, sizeof(int), emote_bulk_cmp);
+	int unique = 1;
+	for (int i = 1; i < bj->id_count; ++i) {
+		if (bj->ids[i] != bj->ids[unique - 1])
+			bj->ids[unique++] = bj->ids[i];
+	}
+	bj->id_count = unique;
+
+	int pack_type = bj->scope + 1;
+
+	for (int first = 0; first < bj->id_count; first += EMOTE_BULK_BATCH) {
+		int last = min(first + EMOTE_BULK_BATCH, bj->id_count);
+
+		ns_db_buf_clear(&buf);
+		if (bj->rental && !bj->grant) {
+			ns_db_buf_printf(&buf, "DELETE FROM `%s` WHERE `pack_type` = '%d' AND `pack_id` = '%d' AND `owner_id` IN (", EMOTE_RENTAL_TABLE, pack_type, bj->packId);
+			for (int i = first; i < last; ++i)
+				ns_db_buf_printf(&buf, "%s'%d'", i > first ? "," : "", bj->ids[i]);
+			ns_db_buf_printf(&buf, ")");
+		}
+		else if (bj->rental) {
+			ns_db_buf_printf(&buf, "INSERT INTO `%s` (`pack_type`, `owner_id`, `pack_id`, `expire_time`) VALUES ", EMOTE_RENTAL_TABLE);
+			for (int i = first; i < last; ++i)
+				ns_db_buf_printf(&buf, "%s('%d', '%d', '%d', '%u')", i > first ? "," : "", pack_type, bj->ids[i], bj->packId, bj->expire_time);
+			ns_db_buf_printf(&buf, " ON DUPLICATE KEY UPDATE `expire_time` = GREATEST(`expire_time`, VALUES(`expire_time`))");
+		}
+		else {
+			ns_db_buf_printf(&buf, "INSERT INTO `%s` (`pack_type`, `owner_id`, `pack_id`, `owned`) VALUES ", EMOTE_JOURNAL_TABLE);
+			for (int i = first; i < last; ++i)
+				ns_db_buf_printf(&buf, "%s('%d', '%d', '%d', '%d')", i > first ? "," : "", pack_type, bj->ids[i], bj->packId, bj->grant ? 1 : 0);
+			ns_db_buf_printf(&buf, " ON DUPLICATE KEY UPDATE `owned` = VALUES(`owned`)");
+		}
+
+		if (buf.failed || !ns_db_query(db, buf.data, buf.len)) {
+			ns_db_buf_free(&buf);
+			return false;
+		}
+		bj->rows += mysql_affected_rows(db->mysql);
+	}
+
+	ns_db_buf_free(&buf);
+	return true;
+}
+
+// Applies a finished bulk change to an online owner's ownership data and cache.
+static void emote_bulk_apply(struct map_session_data* sd, const struct emote_bulk_job* bj)
+{
+	struct emote_owner_data* od = getFromMSD(sd, 3);
+	if (!od)
+		return; // Not loaded yet, the login path reads the new rows
+
+	if (bj->rental) {
+		struct emote_owner_rental* r = emote_owner_rental_find(od, bj->scope, bj->packId);
+		uint32 expire_time = bj->grant ? max(r ? r->expire_time : 0, bj->expire_time) : 0;
+		emote_owner_rental_set(od, bj->scope, bj->packId, expire_time);
+	}
+	else {
+		// Stored here as well: the login merge may already have cleared the journal entry
+		emote_owner_set(od, bj->scope, bj->packId, bj->grant);
+		emote_owner_save_bitmap(sd, od, bj->scope);
+	}
+
+	struct emote_session_data* esd = getFromMSD(sd, 0);
+	const struct s_emotion_db* ce = emote_db_get(bj->packId);
+	if (!esd || esd->generation != emotion_db.generation || !ce)
+		return; // The cache is rebuilt from the ownership data on next use
+
+	int slot = emote_db_slot(ce);
+	emote_session_load_pack(sd, od, esd, slot, time(NULL));
+	if (ce->rental_period != 0) {
+		emote_rental_cancel(sd, ce->packId);
+		if (emote_session_owns(esd, slot))
+			emote_rental_schedule(sd, ce->packId, emote_session_expire(esd)[slot]);
+	}
+	emote_session_send_list(sd, esd);
+}
+
+static void emote_bulk_done(struct emote_job* job)
+{
+	struct emote_bulk_job* bj = (struct emote_bulk_job*)job;
+	int updated = 0;
+	char output[CHAT_SIZE_MAX];
+
+	if (job->success && bj->id_count > 0) {
+		struct s_mapiterator* iter = mapit_getallusers();
+		struct map_session_data* sd;
+
+		for (sd = BL_UCAST(BL_PC, mapit->first(iter)); mapit->exists(iter); sd = BL_UCAST(BL_PC, mapit->next(iter))) {
+			int owner = emote_scope_owner(sd, bj->scope);
+			if (bsearch(&owner, bj->ids, bj->id_count, sizeof(int), emote_bulk_cmp)) {
+				emote_bulk_apply(sd, bj);
+				updated++;
+			}
+		}
+		mapit->free(iter);
+	}
+
+	if (job->success)
+		safesnprintf(output, sizeof(output), "Emotion pack %d %s for %d owner(s) (%"PRIu64" rows), %d online player(s) updated.",
+			bj->packId, bj->grant ? "granted" : "revoked", bj->id_count, bj->rows, updated);
+	else
+		safesnprintf(output, sizeof(output), "Bulk %s of emotion pack %d failed: %s", bj->grant ? "grant" : "revoke", bj->packId, job->error);
+
+	struct map_session_data* gm = bj->requester ? map->id2sd(bj->requester) : NULL;
+	if (gm)
+		clif->message(gm->fd, output);
+	else if (job->success)
+		ShowInfo("%s\n", output);
+	else
+		ShowError("%s\n", output);
+}
+
+static void emote_bulk_free(struct emote_job* job)
+{
+	struct emote_bulk_job* bj = (struct emote_bulk_job*)job;
+	aFree(bj->filter);
+	free(bj->ids);
+	aFree(bj);
+}
+
+// Builds the WHERE clause of a filter target from space separated terms, all of which
+// must match: guild:<id>, party:<id>, level:<min>[-<max>], login:<YYYY-MM-DD> (logged
+// in on or after that day). Only parsed numbers reach the clause, so scripts may pass
+// player input through. Returns false with a reason in error on an unknown term.
+static bool emote_bulk_filter(const char* targets, char* out, size_t out_len, char* error, size_t error_len)
+{
+	const char* p = targets;
+	size_t len = 0;
+
+	out[0] = '\0';
+	while (*p) {
+		int a = 0, b = 0, c = 0, n = 0;
+		char term[256];
+
+		if (sscanf(p, "guild:%d%n", &a, &n) == 1 && a > 0)
+			safesnprintf(term, sizeof(term), "`guild_id` = '%d'", a);
+		else if (sscanf(p, "party:%d%n", &a, &n) == 1 && a > 0)
+			safesnprintf(term, sizeof(term), "`party_id` = '%d'", a);
+		else if (sscanf(p, "level:%d-%d%n", &a, &b, &n) == 2 && a > 0 && b >= a)
+			safesnprintf(term, sizeof(term), "`base_level` BETWEEN '%d' AND '%d'", a, b);
+		else if ((n = 0, sscanf(p, "level:%d%n", &a, &n) == 1) && a > 0 && p[n] != '-')
+			safesnprintf(term, sizeof(term), "`base_level` >= '%d'", a);
+		else if (sscanf(p, "login:%4d-%2d-%2d%n", &a, &b, &c, &n) == 3 && a >= 1970 && b >= 1 && b <= 12 && c >= 1 && c <= 31)
+			safesnprintf(term, sizeof(term), "`last_login` >= '%04d-%02d-%02d'", a, b, c);
+		else
+			n = 0;
+
+		if (n == 0 || (p[n] != '\0' && p[n] != ' ')) {
+			safesnprintf(error, error_len, "Invalid filter near '%.16s', use guild:, party:, level: or login:.", p);
+			return false;
+		}
+		if (len + strlen(term) + 5 >= out_len) {
+			safesnprintf(error, error_len, "Too many filter terms.");
+			return false;
+		}
+		safesnprintf(out + len, out_len - len, "%s%s", len > 0 ? " AND " : "", term);
+		len = strlen(out);
+
+		p += n;
+		while (*p == ' ')
+			p++;
+	}
+	return true;
+}
+
+// Queues a bulk grant or revoke of packId. targets is either a comma separated list of
+// owner IDs (account IDs for account-bound packs, char IDs otherwise) or filter terms
+// over EMOTE_CHAR_TABLE, see emote_bulk_filter. days overrides the pack's RentalPeriod
+// for rental grants, 0 keeps it. Returns false with a reason in error if the request is rejected.
+bool emote_bulk_submit(int packId, bool grant, int days, const char* targets, int requester, char* error, size_t error_len)
+{
+	const struct s_emotion_db* ce = emote_db_get(packId);
+	if (!ce) {
+		safesnprintf(error, error_len, "Unknown emotion pack %d.", packId);
+		return false;
+	}
+
+	if (!targets || !*targets) {
+		safesnprintf(error, error_len, "No owners given.");
+		return false;
+	}
+
+	struct emote_bulk_job* bj = NULL;
+	CREATE(bj, struct emote_bulk_job, 1);
+	bj->job.run = emote_bulk_run;
+	bj->job.done = emote_bulk_done;
+	bj->job.free = emote_bulk_free;
+	bj->grant = grant;
+	bj->rental = ce->rental_period != 0;
+	bj->scope = emote_pack_scope(ce);
+	bj->packId = ce->packId;
+	bj->requester = requester;
+	if (bj->rental && grant)
+		bj->expire_time = (uint32)(time(NULL) + (days > 0 ? (uint64)days * 60 * 60 * 24 : ce->rental_period));
+
+	if (!ISDIGIT(*targets)) {
+		char filter[1024];
+		if (!emote_bulk_filter(targets, filter, sizeof(filter), error, error_len)) {
+			emote_bulk_free(&bj->job);
+			return false;
+		}
+		bj->filter = aStrdup(filter);
+	}
+	else {
+		const char* p = targets;
+		while (*p) {
+			char* end;
+			long id = strtol(p, &end, 10);
+			if (end == p || id <= 0) {
+				safesnprintf(error, error_len, "Invalid owner ID near '%.16s'.", p);
+				emote_bulk_free(&bj->job);
+				return false;
+			}
+			if (!emote_bulk_add_id(bj, (int)id)) {
+				safesnprintf(error, error_len, "Out of memory.");
+				emote_bulk_free(&bj->job);
+				return false;
+			}
+			p = end;
+			while (*p == ',' || *p == ' ')
+				p++;
+		}
+	}
+
+	if (!emote_worker_push(&bj->job)) {
+		safesnprintf(error, error_len, "The SQL worker is not running.");
+		return false;
+	}
+	return true;
+}
+
+// @emotegrant <packId> <days> <id,id,...|filter terms>
+// @emoterevoke <packId> <id,id,...|filter terms>
+ACMD(emotegrant)
+{
+	int packId = 0, days = 0, offset = 0;
+	char error[CHAT_SIZE_MAX];
+
+	if (!message || sscanf(message, "%d %d %n", &packId, &days, &offset) < 2 || offset == 0) {
+		clif->message(fd, "Usage: @emotegrant <pack id> <rental days, 0 = pack default> <id,id,...|guild:<id> party:<id> level:<min>[-<max>] login:<yyyy-mm-dd>>");
+		return false;
+	}
+
+	if (!emote_bulk_submit(packId, true, days, message + offset, sd->status.account_id, error, sizeof(error))) {
+		clif->message(fd, error);
+		return false;
+	}
+
+	clif->message(fd, "Bulk grant queued, you will be notified when it finishes.");
+	return true;
+}
+
+ACMD(emoterevoke)
+{
+	int packId = 0, offset = 0;
+	char error[CHAT_SIZE_MAX];
+
+	if (!message || sscanf(message, "%d %n", &packId, &offset) < 1 || offset == 0) {
+		clif->message(fd, "Usage: @emoterevoke <pack id> <id,id,...|guild:<id> party:<id> level:<min>[-<max>] login:<yyyy-mm-dd>>");
+		return false;
+	}
+
+	if (!emote_bulk_submit(packId, false, 0, message + offset, sd->status.account_id, error, sizeof(error))) {
+		clif->message(fd, error);
+		return false;
+	}
+
+	clif->message(fd, "Bulk revoke queued, you will be notified when it finishes.");
+	return true;
+}
+
+// emotegrant(<pack id>, <rental days>, "<id,id,...|filter terms>")
+// emoterevoke(<pack id>, "<id,id,...|filter terms>")
+// Both return 1 if the job was queued, 0 otherwise.
+BUILDIN(emotegrant)
+{
+	char error[CHAT_SIZE_MAX];
+	bool queued = emote_bulk_submit(script_getnum(st, 2), true, script_getnum(st, 3), script_getstr(st, 4), 0, error, sizeof(error));
+
+	if (!queued)
+		ShowWarning("buildin_emotegrant: %s\n", error);
+	script_pushint(st, queued ? 1 : 0);
+	return true;
+}
+
+BUILDIN(emoterevoke)
+{
+	char error[CHAT_SIZE_MAX];
+	bool queued = emote_bulk_submit(script_getnum(st, 2), false, 0, script_getstr(st, 3), 0, error, sizeof(error));
+
+	if (!queued)
+		ShowWarning("buildin_emoterevoke: %s\n", error);
+	script_pushint(st, queued ? 1 : 0);
+	return true;
+}
+
+//===== Expired rental sweeper =====
+// Rentals of players who never log in again are not reached by the timer wheel.
+// A periodic worker job deletes expired rows from the rental table in chunks of
+// EMOTE_SWEEP_CHUNK, walking the expire_time index, and stops after EMOTE_SWEEP_BUDGET
+// rows so a large backlog is spread over several runs.
+// Owners who never logged in since the migration still hold their rentals in the
+// legacy (#)cashemote_<packId> / (#)cashemoteexpire_<packId> registry rows, which only
+// the login conversion reads. With the budget left, the sweep deletes those pairs when
+// the expire time has passed, for packs that are rentals in the current catalog (a pack
+// made permanent since is granted for good by the conversion, so its rows stay).
+// The registry tables are keyed by (owner, key, index), so they are walked in ranges of
+// EMOTE_SWEEP_OWNER_SPAN owner IDs: every statement is a primary key range. A run covers
+// at most EMOTE_SWEEP_RANGES ranges per table and the next one resumes from there.
+struct emote_sweep_pack {
+	uint16 packId;
+	uint8 scope;
+};
+
+struct emote_sweep_job {
+	struct emote_job job;
+	uint32 now;
+	int chunk;
+	int budget;
+	uint64 rows;		// Rows deleted in this run
+	uint64 legacy_rows;	// Of which legacy registry rows
+	int chunks;
+	bool more;			// The budget ran out before the backlog did
+	int cursor[EMOTE_SCOPE_MAX];	// Next owner ID of the legacy registry walk
+	int pack_count;
+	struct emote_sweep_pack packs[];	// Rental packs of the catalog when the sweep was queued
+};
+
+struct emote_sweep_stats {
+	bool running;
+	int cursor[EMOTE_SCOPE_MAX];	// Where the next legacy registry walk resumes
+	int runs;
+	uint64 rows;		// Rows deleted over all runs
+	uint64 last_rows;	// Rows deleted by the last run
+};
+
+struct emote_sweep_stats emote_sweep_stat = { 0 };
+
+// Deletes expired rows of the rental table in chunks
+static bool emote_sweep_rentals(struct emote_sweep_job* sj, struct ns_db* db)
+{
+	char query[256];
+
+	while (sj->rows < (uint64)sj->budget) {
+		int limit = (int)min((uint64)sj->chunk, (uint64)sj->budget - sj->rows);
+		int len = snprintf(query, sizeof(query), "DELETE FROM `%s` WHERE `expire_time` < '%u' ORDER BY `expire_time` LIMIT %d",
+			EMOTE_RENTAL_TABLE, sj->now, limit);
+
+		if (!ns_db_query(db, query, (size_t)len))
+			return false;
+
+		uint64 deleted = mysql_affected_rows(db->mysql);
+		sj->rows += deleted;
+		sj->chunks++;
+		if (deleted < (uint64)limit)
+			return true;
+	}
+
+	return true;
+}
+
+// Returns the highest owner ID of a registry table in max_owner, -1 if it is empty
+static bool emote_sweep_max_owner(struct ns_db* db, const char* table, const char* owner, int* max_owner)
+{
+	char query[128];
+	int len = snprintf(query, sizeof(query), "SELECT MAX(`%s`) FROM `%s`", owner, table);
+
+	if (!ns_db_query(db, query, (size_t)len))
+		return false;
+
+	MYSQL_RES* res = mysql_store_result(db->mysql);
+	if (!res) {
+		snprintf(db->error, sizeof(db->error), "Could not read the owner range of `%s`.", table);
+		return false;
+	}
+
+	MYSQL_ROW row = mysql_fetch_row(res);
+	*max_owner = (row && row[0]) ? atoi(row[0]) : -1;
+	mysql_free_result(res);
+	return true;
+}
+
+// Deletes expired legacy rental pairs of one registry table, a range of owners at a time
+static bool emote_sweep_legacy(struct emote_sweep_job* sj, struct ns_db* db, int scope)
+{
+	const char* table = scope == EMOTE_SCOPE_ACCOUNT ? EMOTE_ACC_REG_TABLE : EMOTE_CHAR_REG_TABLE;
+	const char* owner = scope == EMOTE_SCOPE_ACCOUNT ? "account_id" : "char_id";
+	const char* prefix = scope == EMOTE_SCOPE_ACCOUNT ? "#" : "";
+	const size_t skip = strlen(prefix) + strlen("cashemoteexpire_");
+	const int span = max(EMOTE_SWEEP_OWNER_SPAN, 1);
+	struct ns_db_buf keys = { 0 }, buf = { 0 };
+	int max_owner;
+	bool ok = true;
+
+	for (int i = 0; i < sj->pack_count; ++i) {
+		if (sj->packs[i].scope == scope)
+			ns_db_buf_printf(&keys, "%s'%scashemoteexpire_%d'", keys.len > 0 ? "," : "", prefix, sj->packs[i].packId);
+	}
+	if (keys.len == 0 || keys.failed) {
+		ok = !keys.failed;
+		goto finish;
+	}
+
+	if (!emote_sweep_max_owner(db, table, owner, &max_owner)) {
+		ok = false;
+		goto finish;
+	}
+
+	for (int ranges = 0; ranges < EMOTE_SWEEP_RANGES && sj->rows < (uint64)sj->budget; ) {
+		int first = sj->cursor[scope];
+		if (first > max_owner) {
+			sj->cursor[scope] = 0; // Walked the whole table, start over next run
+			break;
+		}
+		int last = (int)min((int64)first + span - 1, (int64)INT_MAX);
+		int limit = (int)min((uint64)sj->chunk, ((uint64)sj->budget - sj->rows + 1) / 2);
+
+		ns_db_buf_clear(&buf);
+		ns_db_buf_printf(&buf, "SELECT `%s`, `key` FROM `%s` WHERE `%s` BETWEEN '%d' AND '%d' AND `key` IN (%s) AND `index` = '0' AND `value` > '0' AND `value` < '%u' LIMIT %d",
+			owner, table, owner, first, last, keys.data, sj->now, limit);
+		if (buf.failed || !ns_db_query(db, buf.data, buf.len)) {
+			ok = false;
+			break;
+		}
+
+		MYSQL_RES* res = mysql_store_result(db->mysql);
+		if (!res) {
+			snprintf(db->error, sizeof(db->error), "Could not read the expired legacy rentals of `%s`.", table);
+			ok = false;
+			break;
+		}
+
+		// Rebuilds the keys from the pack ID rather than reusing what was read
+		int fetched = 0;
+		MYSQL_ROW row;
+		ns_db_buf_clear(&buf);
+		ns_db_buf_printf(&buf, "DELETE FROM `%s` WHERE (`%s`, `key`) IN (", table, owner);
+		while ((row = mysql_fetch_row(res)) != NULL) {
+			if (!row[0] || !row[1] || strlen(row[1]) <= skip)
+				continue;
+			int id = atoi(row[0]), packId = atoi(row[1] + skip);
+			ns_db_buf_printf(&buf, "%s('%d', '%scashemote_%d'), ('%d', '%scashemoteexpire_%d')", fetched > 0 ? "," : "",
+				id, prefix, packId, id, prefix, packId);
+			fetched++;
+		}
+		mysql_free_result(res);
+		ns_db_buf_printf(&buf, ")");
+
+		uint64 deleted = 0;
+		if (fetched > 0) {
+			if (buf.failed || !ns_db_query(db, buf.data, buf.len)) {
+				ok = false;
+				break;
+			}
+			deleted = mysql_affected_rows(db->mysql);
+			sj->rows += deleted;
+			sj->legacy_rows += deleted;
+			sj->chunks++;
+		}
+
+		// A full chunk may leave more in this range; otherwise move on to the next one
+		if (fetched < limit || deleted == 0) {
+			if (last == INT_MAX) {
+				sj->cursor[scope] = 0;
+				break;
+			}
+			sj->cursor[scope] = last + 1;
+			ranges++;
+		}
+	}
+
+finish:
+	ns_db_buf_free(&keys);
+	ns_db_buf_free(&buf);
+	return ok;
+}
+
+static bool emote_sweep_run(struct emote_job* job, struct ns_db* db)
+{
+	struct emote_sweep_job* sj = (struct emote_sweep_job*)job;
+
+	if (!emote_sweep_rentals(sj, db))
+		return false;
+
+	for (int scope = 0; scope < EMOTE_SCOPE_MAX && sj->rows < (uint64)sj->budget; ++scope) {
+		if (!emote_sweep_legacy(sj, db, scope))
+			return false;
+	}
+
+	sj->more = sj->rows >= (uint64)sj->budget;
+	return true;
+}
+
+static void emote_sweep_done(struct emote_job* job)
+{
+	struct emote_sweep_job* sj = (struct emote_sweep_job*)job;
+
+	emote_sweep_stat.running = false;
+	memcpy(emote_sweep_stat.cursor, sj->cursor, sizeof(emote_sweep_stat.cursor)); // Kept even after a failure
+	if (!job->success) {
+		ShowError("emote_sweep_done: Expired rental sweep failed after %"PRIu64" row(s).\n", sj->rows);
+		return;
+	}
+
+	emote_sweep_stat.runs++;
+	emote_sweep_stat.rows += sj->rows;
+	emote_sweep_stat.last_rows = sj->rows;
+	if (sj->rows > 0)
+		ShowStatus("Reclaimed '"CL_WHITE"%"PRIu64""CL_RESET"' expired emotion pack rental row(s) (%"PRIu64" legacy) in %d chunk(s)%s.\n",
+			sj->rows, sj->legacy_rows, sj->chunks, sj->more ? ", more remain for the next run" : "");
+}
+
+static void emote_sweep_free(struct emote_job* job)
+{
+	aFree(job);
+}
+
+// Queues a sweep unless one is still running. Returns true if a sweep was queued.
+bool emote_sweep_start(void)
+{
+	if (emote_sweep_stat.running || EMOTE_SWEEP_BUDGET <= 0)
+		return false;
+
+	int rentals = 0;
+	for (int slot = 0; slot < emotion_db.count; ++slot)
+		rentals += emotion_db.packs[slot].rental_period != 0;
+
+	struct emote_sweep_job* sj = aCalloc(1, sizeof(struct emote_sweep_job) + rentals * sizeof(struct emote_sweep_pack));
+	for (int slot = 0; slot < emotion_db.count; ++slot) {
+		const struct s_emotion_db* ce = &emotion_db.packs[slot];
+		if (ce->rental_period != 0) {
+			sj->packs[sj->pack_count].packId = ce->packId;
+			sj->packs[sj->pack_count].scope = (uint8)emote_pack_scope(ce);
+			sj->pack_count++;
+		}
+	}
+	sj->job.run = emote_sweep_run;
+	sj->job.done = emote_sweep_done;
+	sj->job.free = emote_sweep_free;
+	sj->now = (uint32)time(NULL);
+	sj->chunk = max(EMOTE_SWEEP_CHUNK, 1);
+	sj->budget = EMOTE_SWEEP_BUDGET;
+	memcpy(sj->cursor, emote_sweep_stat.cursor, sizeof(sj->cursor));
+
+	if (!emote_worker_push(&sj->job))
+		return false;
+
+	emote_sweep_stat.running = true;
+	return true;
+}
+
+static int emote_sweep_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	emote_sweep_start();
+	return 0;
+}
+
+CPCMD(emotesweep)
+{
+	if (emote_sweep_start())
+		ShowInfo("Expired emotion pack rental sweep queued.\n");
+	else
+		ShowInfo("An expired rental sweep is already running or the SQL worker is unavailable.\n");
+}
+
+//===== Usage analytics flush =====
+// emote_usage_flush snapshots the non-zero counters into a job and clears them.
+// The worker upserts them as daily aggregates into EMOTE_USAGE_TABLE and
+// EMOTE_SALES_TABLE, EMOTE_BULK_BATCH rows per statement. A failed write hands
+// the counts back to the live counters so they go out with the next flush.
+struct emote_usage_row {
+	uint16 packId;
+	int16 emoteId;		// -1 for a purchase row
+	uint32 count;
+};
+
+struct emote_usage_job {
+	struct emote_job job;
+	char stat_date[11];	// YYYY-MM-DD of the snapshot
+	int count;
+	struct emote_usage_row rows[];
+};
+
+static bool emote_usage_write(struct ns_db* db, struct ns_db_buf* buf, const struct emote_usage_job* uj, bool sales)
+{
+	int first = 0;
+
+	while (first < uj->count) {
+		int rows = 0, i;
+
+		ns_db_buf_clear(buf);
+		if (sales)
+			ns_db_buf_printf(buf, "INSERT INTO `%s` (`stat_date`, `pack_id`, `purchases`) VALUES ", EMOTE_SALES_TABLE);
+		else
+			ns_db_buf_printf(buf, "INSERT INTO `%s` (`stat_date`, `pack_id`, `emote_id`, `uses`) VALUES ", EMOTE_USAGE_TABLE);
+
+		for (i = first; i < uj->count && rows < EMOTE_BULK_BATCH; ++i) {
+			const struct emote_usage_row* row = &uj->rows[i];
+			if ((row->emoteId < 0) != sales)
+				continue;
+			if (sales)
+				ns_db_buf_printf(buf, "%s('%s', '%d', '%u')", rows > 0 ? "," : "", uj->stat_date, row->packId, row->count);
+			else
+				ns_db_buf_printf(buf, "%s('%s', '%d', '%d', '%u')", rows > 0 ? "," : "", uj->stat_date, row->packId, row->emoteId, row->count);
+			rows++;
+		}
+		first = i;
+		if (rows == 0)
+			break;
+
+		if (sales)
+			ns_db_buf_printf(buf, " ON DUPLICATE KEY UPDATE `purchases` = `purchases` + VALUES(`purchases`)");
+		else
+			ns_db_buf_printf(buf, " ON DUPLICATE KEY UPDATE `uses` = `uses` + VALUES(`uses`)");
+
+		if (buf->failed || !ns_db_query(db, buf->data, buf->len))
+			return false;
+	}
+	return true;
+}
+
+static bool emote_usage_run(struct emote_job* job, struct ns_db* db)
+{
+	struct emote_usage_job* uj = (struct emote_usage_job*)job;
+	struct ns_db_buf buf = { 0 };
+	bool ok;
+
+	ok = emote_usage_write(db, &buf, uj, false) && emote_usage_write(db, &buf, uj, true);
+	ns_db_buf_free(&buf);
+	return ok;
+}
+
+static void emote_usage_done(struct emote_job* job)
+{
+	struct emote_usage_job* uj = (struct emote_usage_job*)job;
+
+	if (job->success)
+		return;
+
+	// Packs removed by a reload in the meantime are lost
+	int restored = 0;
+	for (int i = 0; i < uj->count; ++i) {
+		const struct emote_usage_row* row = &uj->rows[i];
+		const struct s_emotion_db* ce = emote_db_get(row->packId);
+		if (!ce)
+			continue;
+		if (row->emoteId < 0)
+			emote_usage_add_purchase(ce, row->count);
+		else if (emote_mask_test(ce->emote_mask, row->emoteId))
+			emote_usage_add_use(ce, row->emoteId, row->count);
+		else
+			continue;
+		restored++;
+	}
+	ShowError("emote_usage_done: Failed to write emote usage statistics, %d of %d row(s) kept for the next flush.\n", restored, uj->count);
+}
+
+static void emote_usage_free(struct emote_job* job)
+{
+	aFree(job);
+}
+
+// Hands the counters of the current emotion_db to the SQL worker and clears them.
+// Also called right before a reload swaps the table the counters refer to.
+void emote_usage_flush(void)
+{
+	int count = 0;
+
+	if (!emote_usage.uses)
+		return;
+
+	for (int i = 0; i < emote_usage.uses_size; ++i)
+		count += emote_usage.uses[i] != 0;
+	for (int i = 0; i < emote_usage.purchases_size; ++i)
+		count += emote_usage.purchases[i] != 0;
+	if (count == 0)
+		return;
+
+	struct emote_usage_job* uj = aMalloc(sizeof(struct emote_usage_job) + count * sizeof(struct emote_usage_row));
+	memset(uj, 0, sizeof(struct emote_usage_job));
+	uj->job.run = emote_usage_run;
+	uj->job.done = emote_usage_done;
+	uj->job.free = emote_usage_free;
+
+	time_t now = time(NULL);
+	strftime(uj->stat_date, sizeof(uj->stat_date), "%Y-%m-%d", localtime(&now));
+
+	for (int slot = 0; slot < emotion_db.count; ++slot) {
+		const struct s_emotion_db* ce = &emotion_db.packs[slot];
+		int pos = (int)ce->emote_offset;
+
+		for (int emoteId = 0; emoteId < ET_EMOTION_LAST; ++emoteId) {
+			if (!emote_mask_test(ce->emote_mask, emoteId))
+				continue;
+			if (pos < emote_usage.uses_size && emote_usage.uses[pos] != 0) {
+				struct emote_usage_row* row = &uj->rows[uj->count++];
+				row->packId = ce->packId;
+				row->emoteId = (int16)emoteId;
+				row->count = emote_usage.uses[pos];
+			}
+			pos++;
+		}
+
+		if (slot < emote_usage.purchases_size && emote_usage.purchases[slot] != 0) {
+			struct emote_usage_row* row = &uj->rows[uj->count++];
+			row->packId = ce->packId;
+			row->emoteId = -1;
+			row->count = emote_usage.purchases[slot];
+		}
+	}
+
+	if (!emote_worker_push(&uj->job))
+		return;
+
+	memset(emote_usage.uses, 0, emote_usage.uses_size * sizeof(uint32));
+	memset(emote_usage.purchases, 0, emote_usage.purchases_size * sizeof(uint32));
+}
+
+static int emote_usage_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	emote_usage_flush();
+	return 0;
+}
+
+//===== Purchase ledger flush =====
+// Moves the pending ledger entries into a worker job. Entries of a failed write go
+// back to the front of the queue and are retried with the next flush.
+struct emote_ledger_job {
+	struct emote_job job;
+	struct emote_ledger_entry* list;
+	int count;
+	int collisions;			// Entries whose ID is taken by a different purchase
+	uint64 first_collision;
+};
+
+#define EMOTE_ER_DUP_ENTRY 1062		// MySQL ER_DUP_ENTRY
+
+// Inserts entries [first, last) of the job in one statement
+static bool emote_ledger_insert(struct emote_ledger_job* lj, struct ns_db* db, struct ns_db_buf* buf, int first, int last)
+{
+	ns_db_buf_clear(buf);
+	ns_db_buf_printf(buf, "INSERT INTO `%s` (`txn_id`, `time`, `account_id`, `char_id`, `pack_id`, `item_id`, `amount`, `expire_time`) VALUES ", EMOTE_LEDGER_TABLE);
+	for (int i = first; i < last; ++i) {
+		const struct emote_ledger_entry* e = &lj->list[i];
+		ns_db_buf_printf(buf, "%s('%"PRIu64"', '%u', '%d', '%d', '%d', '%d', '%d', '%u')", i > first ? "," : "",
+			e->txn, e->time, e->account_id, e->char_id, e->packId, e->itemId, e->amount, e->expire_time);
+	}
+
+	if (buf->failed) {
+		snprintf(db->error, sizeof(db->error), "Out of memory for the ledger INSERT.");
+		return false;
+	}
+	return ns_db_query(db, buf->data, buf->len);
+}
+
+// Checks an entry whose ID already exists. Returns false only on an SQL error;
+// *same is set when the stored row is this purchase, written by an earlier attempt.
+static bool emote_ledger_same(struct ns_db* db, const struct emote_ledger_entry* e, bool* same)
+{
+	char query[256];
+	int len = snprintf(query, sizeof(query), "SELECT `time`, `account_id`, `char_id`, `pack_id` FROM `%s` WHERE `txn_id` = '%"PRIu64"'",
+		EMOTE_LEDGER_TABLE, e->txn);
+
+	if (!ns_db_query(db, query, (size_t)len))
+		return false;
+
+	MYSQL_RES* res = mysql_store_result(db->mysql);
+	if (!res) {
+		snprintf(db->error, sizeof(db->error), "Could not read ledger entry %"PRIu64".", e->txn);
+		return false;
+	}
+
+	MYSQL_ROW row = mysql_fetch_row(res);
+	*same = row && row[0] && row[1] && row[2] && row[3]
+		&& (uint32)strtoul(row[0], NULL, 10) == e->time && atoi(row[1]) == e->account_id
+		&& atoi(row[2]) == e->char_id && atoi(row[3]) == e->packId;
+	mysql_free_result(res);
+	return true;
+}
+
+static bool emote_ledger_run(struct emote_job* job, struct ns_db* db)
+{
+	struct emote_ledger_job* lj = (struct emote_ledger_job*)job;
+	struct ns_db_buf buf = { 0 };
+	bool ok = true;
+
+	for (int first = 0; ok && first < lj->count; first += EMOTE_BULK_BATCH) {
+		int last = min(first + EMOTE_BULK_BATCH, lj->count);
+
+		if (emote_ledger_insert(lj, db, &buf, first, last))
+			continue;
+		if (!db->mysql || mysql_errno(db->mysql) != EMOTE_ER_DUP_ENTRY) {
+			ok = false;
+			break;
+		}
+
+		// Some ID of the batch exists: write the entries one by one to tell retries from collisions
+		for (int i = first; i < last; ++i) {
+			bool same;
+
+			if (emote_ledger_insert(lj, db, &buf, i, i + 1))
+				continue;
+			if (!db->mysql || mysql_errno(db->mysql) != EMOTE_ER_DUP_ENTRY || !emote_ledger_same(db, &lj->list[i], &same)) {
+				ok = false;
+				break;
+			}
+			if (!same && lj->collisions++ == 0)
+				lj->first_collision = lj->list[i].txn;
+		}
+	}
+
+	ns_db_buf_free(&buf);
+	return ok;
+}
+
+static void emote_ledger_done(struct emote_job* job)
+{
+	struct emote_ledger_job* lj = (struct emote_ledger_job*)job;
+
+	if (job->success) {
+		emote_ledger.written += lj->count - lj->collisions;
+		if (lj->collisions > 0)
+			ShowError("emote_ledger_done: %d purchase(s) not logged, their transaction ID (first %016"PRIx64") belongs to another purchase. Check that EMOTE_LEDGER_SERVER_ID is unique.\n",
+				lj->collisions, lj->first_collision);
+		return;
+	}
+
+	// Put the batch back in front of whatever was queued since
+	int queued = emote_ledger.count;
+	if (queued + lj->count > emote_ledger.max) {
+		emote_ledger.max = queued + lj->count;
+		RECREATE(emote_ledger.list, struct emote_ledger_entry, emote_ledger.max);
+	}
+	memmove(emote_ledger.list + lj->count, emote_ledger.list, queued * sizeof(struct emote_ledger_entry));
+	memcpy(emote_ledger.list, lj->list, lj->count * sizeof(struct emote_ledger_entry));
+	emote_ledger.count += lj->count;
+	ShowError("emote_ledger_done: Failed to write %d purchase ledger entries, retrying with the next flush.\n", lj->count);
+}
+
+static void emote_ledger_free(struct emote_job* job)
+{
+	struct emote_ledger_job* lj = (struct emote_ledger_job*)job;
+	aFree(lj->list);
+	aFree(lj);
+}
+
+void emote_ledger_flush(void)
+{
+	if (emote_ledger.count == 0)
+		return;
+
+	struct emote_ledger_job* lj = NULL;
+	CREATE(lj, struct emote_ledger_job, 1);
+	lj->job.run = emote_ledger_run;
+	lj->job.done = emote_ledger_done;
+	lj->job.free = emote_ledger_free;
+	lj->count = emote_ledger.count;
+	lj->list = (struct emote_ledger_entry*)aMalloc(lj->count * sizeof(struct emote_ledger_entry));
+	memcpy(lj->list, emote_ledger.list, lj->count * sizeof(struct emote_ledger_entry));
+
+	if (!emote_worker_push(&lj->job))
+		return; // Kept in the queue
+
+	emote_ledger.count = 0;
+}
+
+static int emote_ledger_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	emote_ledger_flush();
+	return 0;
+}
+
+//===== Per-tick emote broadcast coalescing =====
+// ZC_EMOTION_SUCCESS packets produced during one server tick are queued and sent
+// by a zero-delay timer. Queued emotes are grouped by the sender's map cell block;
+// each group needs one area walk, and every viewer gets all the group's packets
+// it can see in one contiguous WFIFO write.
+// Every emote is encoded once for new clients and once as ZC_EMOTION for legacy
+// clients; the walk picks the encoding per viewer.
+struct emote_broadcast {
+	int16 m, x, y;	// Sender position when the emote was played
+	int block;		// Sender cell block on the map
+	int seq;		// Queue order, keeps emotes of one sender in sequence
+	bool has_legacy;	// The emote has a legacy equivalent
+	int party_id;		// Sender's party and guild, for crowd delivery
+	int guild_id;
+	struct PACKET_ZC_EMOTION_SUCCESS packet;
+	struct PACKET_ZC_EMOTION legacy;
+};
+
+struct emote_broadcast_queue {
+	struct emote_broadcast* list;
+	int count;
+	int max;
+	int timer;
+};
+
+struct emote_stats {
+	uint64 emotes_queued;		// ZC_EMOTION_SUCCESS packets that went through the queue
+	uint64 area_scans;			// Area walks actually performed
+	uint64 packets_written;		// Packets written to viewers
+	uint64 wfifo_writes;		// WFIFO writes used for them
+	uint64 legacy_written;		// Of packets_written, ZC_EMOTION sent to legacy clients
+	uint64 culled;				// Packets not sent to crowded viewers
+	uint64 culled_bytes;
+};
+
+struct emote_broadcast_queue emote_bcast = { NULL, 0, 0, INVALID_TIMER };
+struct emote_stats emote_stat = { 0 };
+
+static int emote_broadcast_flush_timer(int tid, int64 tick, int id, intptr_t data);
+static int emote_broadcast_sub(struct block_list* bl, va_list ap);
+
+// Fills e with both encodings of the emote played by bl.
+void emote_broadcast_encode(struct emote_broadcast* e, struct block_list* bl, const struct PACKET_ZC_EMOTION_SUCCESS* p)
+{
+	e->m = bl->m;
+	e->x = bl->x;
+	e->y = bl->y;
+	e->block = (bl->x / BLOCK_SIZE) + (bl->y / BLOCK_SIZE) * map->list[bl->m].bxs;
+	e->packet = *p;
+	e->party_id = bl->type == BL_PC ? BL_UCCAST(BL_PC, bl)->status.party_id : 0;
+	e->guild_id = bl->type == BL_PC ? BL_UCCAST(BL_PC, bl)->status.guild_id : 0;
+
+	int legacy = p->emoteId < ET_EMOTION_LAST ? emote_legacy_map[p->emoteId] : ET_BLANK;
+	e->has_legacy = legacy != ET_BLANK;
+	e->legacy.packetType = HEADER_ZC_EMOTION;
+	e->legacy.GID = p->GID;
+	e->legacy.type = (uint8)(e->has_legacy ? legacy : 0);
+}
+
+void emote_broadcast_queue_add(struct block_list* bl, const struct PACKET_ZC_EMOTION_SUCCESS* p)
+{
+	if (emote_bcast.count == emote_bcast.max) {
+		emote_bcast.max = max(emote_bcast.max * 2, 32);
+		RECREATE(emote_bcast.list, struct emote_broadcast, emote_bcast.max);
+	}
+
+	struct emote_broadcast* e = &emote_bcast.list[emote_bcast.count];
+	emote_broadcast_encode(e, bl, p);
+	e->seq = emote_bcast.count++;
+	emote_stat.emotes_queued++;
+
+	if (emote_bcast.timer == INVALID_TIMER)
+		emote_bcast.timer = timer->add(timer->gettick(), emote_broadcast_flush_timer, 0, 0);
+}
+
+// Sends the group to every viewer in the area around the senders' bounding box.
+static void emote_broadcast_walk(const struct emote_broadcast* group, int count, int16 x0, int16 y0, int16 x1, int16 y1)
+{
+	if (count > emote_crowd_idx_max) {
+		emote_crowd_idx_max = max(count, 32);
+		RECREATE(emote_crowd_idx, int, emote_crowd_idx_max);
 	}
 
-	bool found = false;
-	for (int i = 0; i < ce->emote_count; i++) {
-		if (ce->emoteIds[i] == emoteId) {
-			found = true;
+	map->foreachinarea(emote_broadcast_sub, group->m, x0 - AREA_SIZE, y0 - AREA_SIZE, x1 + AREA_SIZE, y1 + AREA_SIZE,
+		BL_PC, group, count);
+	emote_stat.area_scans++;
+}
+
+// Sends one emote right away, when coalescing is off.
+void emote_broadcast_send(struct block_list* bl, const struct PACKET_ZC_EMOTION_SUCCESS* p)
+{
+	struct emote_broadcast e;
+	emote_broadcast_encode(&e, bl, p);
+	e.seq = 0;
+	emote_broadcast_walk(&e, 1, e.x, e.y, e.x, e.y);
+}
+
+static int emote_broadcast_cmp(const void* a, const void* b)
+{
+	const struct emote_broadcast* ea = (const struct emote_broadcast*)a;
+	const struct emote_broadcast* eb = (const struct emote_broadcast*)b;
+
+	if (ea->m != eb->m)
+		return ea->m - eb->m;
+	if (ea->block != eb->block)
+		return ea->block - eb->block;
+	return ea->seq - eb->seq;
+}
+
+static inline bool emote_broadcast_visible(const struct emote_broadcast* e, const struct block_list* bl)
+{
+	return abs(e->x - bl->x) <= AREA_SIZE && abs(e->y - bl->y) <= AREA_SIZE;
+}
+
+// Writes the listed entries of base to the viewer in one go, in the encoding of the viewer's client.
+static void emote_broadcast_write(struct map_session_data* sd, bool legacy, const struct emote_broadcast* base, const int* idx, int count)
+{
+	size_t size = legacy ? sizeof(struct PACKET_ZC_EMOTION) : sizeof(struct PACKET_ZC_EMOTION_SUCCESS);
+	int fd = sd->fd;
+	size_t len = count * size;
+	uint8* buf;
+
+	WFIFOHEAD(fd, len);
+	buf = WFIFOP(fd, 0);
+	for (int i = 0; i < count; ++i) {
+		if (legacy)
+			memcpy(buf, &base[idx[i]].legacy, size);
+		else
+			memcpy(buf, &base[idx[i]].packet, size);
+		buf += size;
+	}
+
+	if (count == 1)
+		WFIFOSET(fd, len);
+	else
+		WFIFOSET2(fd, len); // Several packets in one write
+	emote_stat.packets_written += count;
+	if (legacy)
+		emote_stat.legacy_written += count;
+	emote_stat.wfifo_writes++;
+}
+
+//===== Crowd delivery =====
+// On crowd maps the area walks of a tick only record which queued emotes each viewer
+// can see (emote_crowd_defer): a pool of linked entries, headed on the viewer's
+// emote_client_data. Once every group of the tick has been walked, emote_crowd_deliver
+// decides per viewer over all of them: a viewer is crowded by the emote rate of the
+// window or by the number of distinct senders this tick, and a crowded viewer keeps
+// all emotes of the Nearest closest senders besides self, party and guild.
+struct emote_crowd_pending {
+	int idx;			// Entry of emote_bcast.list
+	int next;			// Next entry of the same viewer, -1 at the end
+};
+
+struct emote_crowd_cand {
+	uint32 gid;			// Sender
+	int idx;
+	uint8 dist;			// Chebyshev distance to the viewer, capped at AREA_SIZE + 1
+	bool always;		// Self, party or guild
+	bool keep;
+};
+
+struct emote_crowd_tick {
+	struct emote_crowd_pending* pool;
+	int pool_count;
+	int pool_max;
+	int* viewers;		// Block IDs of viewers with pending entries
+	int viewer_count;
+	int viewer_max;
+	struct emote_crowd_cand* cands;
+	int* kept;			// Queue entries the viewer gets, sized with cands
+	int cand_max;
+};
+
+struct emote_crowd_tick emote_crowd_tick = { 0 };
+
+// Records that the viewer can see the queue entries idx[0..count)
+static void emote_crowd_defer(struct map_session_data* sd, const int* idx, int count)
+{
+	struct emote_crowd_tick* ct = &emote_crowd_tick;
+	struct emote_client_data* cd = emote_client_data_get(sd);
+
+	if (cd->pending_count == 0) {
+		if (ct->viewer_count == ct->viewer_max) {
+			ct->viewer_max = max(ct->viewer_max * 2, 64);
+			RECREATE(ct->viewers, int, ct->viewer_max);
+		}
+		ct->viewers[ct->viewer_count++] = sd->bl.id;
+		cd->pending_head = -1;
+	}
+
+	if (ct->pool_count + count > ct->pool_max) {
+		ct->pool_max = max(max(ct->pool_max * 2, ct->pool_count + count), 256);
+		RECREATE(ct->pool, struct emote_crowd_pending, ct->pool_max);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		ct->pool[ct->pool_count].idx = idx[i];
+		ct->pool[ct->pool_count].next = cd->pending_head;
+		cd->pending_head = ct->pool_count++;
+	}
+	cd->pending_count += count;
+}
+
+static int emote_crowd_cand_cmp(const void* a, const void* b)
+{
+	const struct emote_crowd_cand* ca = (const struct emote_crowd_cand*)a;
+	const struct emote_crowd_cand* cb = (const struct emote_crowd_cand*)b;
+
+	if (ca->gid != cb->gid)
+		return ca->gid < cb->gid ? -1 : 1;
+	return ca->idx - cb->idx;
+}
+
+static int emote_crowd_int_cmp(const void* a, const void* b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+// Marks the candidates a crowded viewer gets: all emotes of self, party and guild,
+// and of the cm->nearest closest other senders.
+static void emote_crowd_select(const struct emote_crowd_map* cm, struct emote_crowd_cand* c, int count)
+{
+	const int max_dist = AREA_SIZE + 1;
+	int histogram[AREA_SIZE + 2] = { 0 };
+
+	// Candidates are sorted by sender; every run gets its sender's flags and nearest distance
+	for (int start = 0, end; start < count; start = end) {
+		bool always = false;
+		int dist = max_dist;
+
+		for (end = start; end < count && c[end].gid == c[start].gid; ++end) {
+			always |= c[end].always;
+			dist = min(dist, (int)c[end].dist);
+		}
+		for (int i = start; i < end; ++i) {
+			c[i].always = always;
+			c[i].dist = (uint8)dist;
+		}
+		if (!always)
+			histogram[dist]++;
+	}
+
+	// Distance up to which all senders fit in nearest, and how many fit at the border
+	int budget = cm->nearest, border = max_dist + 1, border_left = 0;
+	for (int dist = 0; dist <= max_dist; ++dist) {
+		if (histogram[dist] > budget) {
+			border = dist;
+			border_left = budget;
 			break;
 		}
+		budget -= histogram[dist];
+	}
+
+	for (int start = 0, end; start < count; start = end) {
+		bool keep = c[start].always || c[start].dist < border || (c[start].dist == border && border_left-- > 0);
+
+		for (end = start; end < count && c[end].gid == c[start].gid; ++end)
+			c[end].keep = keep;
+	}
+}
+
+// Delivers the emotes of this tick to the viewers of crowd maps
+static void emote_crowd_deliver(void)
+{
+	struct emote_crowd_tick* ct = &emote_crowd_tick;
+	int64 tick = timer->gettick();
+
+	for (int v = 0; v < ct->viewer_count; ++v) {
+		struct map_session_data* sd = map->id2sd(ct->viewers[v]);
+		struct emote_client_data* cd = sd ? getFromMSD(sd, 4) : NULL;
+		if (!cd || cd->pending_count == 0)
+			continue;
+
+		int count = cd->pending_count;
+		cd->pending_count = 0;
+		if (!sd->fd || !sockt->session_is_active(sd->fd))
+			continue;
+
+		if (count > ct->cand_max) {
+			ct->cand_max = max(count, 64);
+			RECREATE(ct->cands, struct emote_crowd_cand, ct->cand_max);
+			RECREATE(ct->kept, int, ct->cand_max);
+		}
+
+		struct emote_crowd_cand* c = ct->cands;
+		int n = 0;
+		for (int p = cd->pending_head; p >= 0 && n < count; p = ct->pool[p].next) {
+			const struct emote_broadcast* e = &emote_bcast.list[ct->pool[p].idx];
+
+			c[n].gid = e->packet.GID;
+			c[n].idx = ct->pool[p].idx;
+			c[n].dist = (uint8)min(max(abs(e->x - sd->bl.x), abs(e->y - sd->bl.y)), AREA_SIZE + 1);
+			c[n].always = e->packet.GID == (uint32)sd->bl.id
+				|| (e->party_id != 0 && e->party_id == sd->status.party_id)
+				|| (e->guild_id != 0 && e->guild_id == sd->status.guild_id);
+			c[n].keep = true;
+			n++;
+		}
+		qsort(c, n, sizeof(struct emote_crowd_cand), emote_crowd_cand_cmp);
+
+		int senders = 0;
+		for (int i = 0; i < n; ++i)
+			senders += i == 0 || c[i].gid != c[i - 1].gid;
+
+		struct emote_crowd_map* cm = emote_crowd_get(sd->bl.m);
+		if (DIFF_TICK(tick, cd->window_tick) >= EMOTE_CROWD_WINDOW_MS) {
+			cd->window_tick = tick;
+			cd->window_count = 0;
+		}
+		if (cd->window_count >= cm->viewer_rate || senders > cm->senders)
+			emote_crowd_select(cm, c, n);
+
+		int kept = 0;
+		for (int i = 0; i < n; ++i) {
+			if (c[i].keep)
+				ct->kept[kept++] = c[i].idx;
+		}
+
+		bool legacy = emote_client_legacy(sd);
+		size_t size = legacy ? sizeof(struct PACKET_ZC_EMOTION) : sizeof(struct PACKET_ZC_EMOTION_SUCCESS);
+		cm->culled += n - kept;
+		cm->culled_bytes += (n - kept) * size;
+		emote_stat.culled += n - kept;
+		emote_stat.culled_bytes += (n - kept) * size;
+		cd->window_count += kept;
+		if (kept == 0)
+			continue;
+
+		qsort(ct->kept, kept, sizeof(int), emote_crowd_int_cmp); // Queue order
+		emote_broadcast_write(sd, legacy, emote_bcast.list, ct->kept, kept);
+	}
+
+	ct->viewer_count = 0;
+	ct->pool_count = 0;
+}
+
+// Writes every packet of the group that is within sight of the viewer in one go.
+// On crowd maps the packets are only recorded, emote_crowd_deliver sends them.
+static int emote_broadcast_sub(struct block_list* bl, va_list ap)
+{
+	const struct emote_broadcast* group = va_arg(ap, const struct emote_broadcast*);
+	int count = va_arg(ap, int);
+	struct map_session_data* sd = BL_UCAST(BL_PC, bl);
+
+	if (!sd->fd || !sockt->session_is_active(sd->fd))
+		return 0;
+
+	bool legacy = emote_client_legacy(sd);
+	int visible = 0;
+	for (int i = 0; i < count; ++i) {
+		if (emote_broadcast_visible(&group[i], bl) && (!legacy || group[i].has_legacy))
+			emote_crowd_idx[visible++] = i;
+	}
+	if (visible == 0)
+		return 0;
+
+	bool queued = group >= emote_bcast.list && group < emote_bcast.list + emote_bcast.count;
+	if (queued && emote_crowd_get(bl->m)->enabled) {
+		int base = (int)(group - emote_bcast.list);
+		for (int i = 0; i < visible; ++i)
+			emote_crowd_idx[i] += base;
+		emote_crowd_defer(sd, emote_crowd_idx, visible);
+		return 1;
+	}
+
+	emote_broadcast_write(sd, legacy, group, emote_crowd_idx, visible);
+	return 1;
+}
+
+static int emote_broadcast_flush_timer(int tid, int64 tick, int id, intptr_t data)
+{
+	emote_bcast.timer = INVALID_TIMER;
+	if (emote_bcast.count == 0)
+		return 0;
+
+	qsort(emote_bcast.list, emote_bcast.count, sizeof(struct emote_broadcast), emote_broadcast_cmp);
+
+	for (int start = 0; start < emote_bcast.count; ) {
+		const struct emote_broadcast* group = &emote_bcast.list[start];
+		int end = start + 1;
+		int16 x0 = group->x, x1 = group->x, y0 = group->y, y1 = group->y;
+
+		while (end < emote_bcast.count && emote_bcast.list[end].m == group->m && emote_bcast.list[end].block == group->block) {
+			x0 = min(x0, emote_bcast.list[end].x);
+			x1 = max(x1, emote_bcast.list[end].x);
+			y0 = min(y0, emote_bcast.list[end].y);
+			y1 = max(y1, emote_bcast.list[end].y);
+			end++;
+		}
+
+		emote_broadcast_walk(group, end - start, x0, y0, x1, y1);
+		start = end;
+	}
+
+	emote_crowd_deliver();
+	emote_bcast.count = 0;
+	return 0;
+}
+
+//===== Emote rate limiter =====
+// Token bucket per session on the millisecond tick clock, kept as a theoretical
+// arrival time (GCRA): an emote is allowed while the bucket is not ahead of now
+// by more than the burst allows. A rejection does not consume a token, so a
+// bursty player recovers at the refill rate. After EMOTE_RATE_STRIKES rejections
+// in a row, requests are dropped without reply for EMOTE_RATE_DROP_MS.
+enum emote_rate_result {
+	EMOTE_RATE_ALLOW = 0,
+	EMOTE_RATE_REJECT,
+	EMOTE_RATE_DROP,
+};
+
+// Attached to map_session_data (HPM data index 2)
+struct emote_rate_data {
+	int64 tat;			// Tick at which the bucket is full again
+	int64 drop_until;	// Requests are dropped silently until this tick
+	int strikes;		// Rejections since the last allowed emote
+};
+
+struct emote_map_stats {
+	uint32 rejected;
+	uint32 dropped;
+};
+
+struct emote_map_stats* emote_map_stat = NULL;
+int emote_map_stat_size = 0;
+
+static void emote_rate_count(int16 m, enum emote_rate_result result)
+{
+	if (m < 0)
+		return;
+
+	if (m >= emote_map_stat_size) {
+		int old_size = emote_map_stat_size;
+		emote_map_stat_size = max(map->count, m + 1);
+		RECREATE(emote_map_stat, struct emote_map_stats, emote_map_stat_size);
+		memset(emote_map_stat + old_size, 0, (emote_map_stat_size - old_size) * sizeof(struct emote_map_stats));
+	}
+
+	if (result == EMOTE_RATE_REJECT)
+		emote_map_stat[m].rejected++;
+	else
+		emote_map_stat[m].dropped++;
+}
+
+enum emote_rate_result emote_rate_check(struct map_session_data* sd)
+{
+	struct emote_rate_data* rd = getFromMSD(sd, 2);
+	int64 now = timer->gettick();
+
+	if (!rd) {
+		CREATE(rd, struct emote_rate_data, 1);
+		addToMSD(sd, rd, 2, true);
+		rd->tat = now;
+	}
+
+	if (DIFF_TICK(rd->drop_until, now) > 0) {
+		emote_rate_count(sd->bl.m, EMOTE_RATE_DROP);
+		return EMOTE_RATE_DROP;
+	}
+
+	int64 tat = max(rd->tat, now);
+	if (DIFF_TICK(tat, now) > (int64)(EMOTE_RATE_BURST - 1) * EMOTE_RATE_REFILL_MS) {
+		if (++rd->strikes >= EMOTE_RATE_STRIKES) {
+			rd->drop_until = now + EMOTE_RATE_DROP_MS;
+			rd->strikes = 0;
+		}
+		emote_rate_count(sd->bl.m, EMOTE_RATE_REJECT);
+		return EMOTE_RATE_REJECT;
+	}
+
+	rd->tat = tat + EMOTE_RATE_REFILL_MS;
+	rd->strikes = 0;
+	return EMOTE_RATE_ALLOW;
+}
+
+//===== Handling emotion playback requests =====
+// Validates whether the requested emotion exists in the pack, whether the player owns it,
+// and whether the pack is active. Sends success or failure packet accordingly.
+void clif_send_emote_success(struct block_list* bl, int16 packId, int16 emoteId)
+{
+	nullpo_retv(bl);
+
+	struct PACKET_ZC_EMOTION_SUCCESS p;
+	p.packetType = HEADER_ZC_EMOTION_SUCCESS;
+	p.GID = bl->id;
+	p.packId = packId;
+	p.emoteId = emoteId;
+
+	ns_trace(&emote_trace, EMOTE_TRACE_USE, EMOTE_EV_EMOTION_SUCCESS, p.GID, p.packId, p.emoteId, 0);
+
+	// Crowd selection is made over a whole tick, so crowd maps always go through the queue
+	if (EMOTE_BROADCAST_COALESCE || emote_crowd_get(bl->m)->enabled)
+		emote_broadcast_queue_add(bl, &p);
+	else
+		emote_broadcast_send(bl, &p);
+}
+
+void clif_send_emote_fail(struct map_session_data* sd, int16 packId, int16 emoteId, enum emote_msg emote_status)
+{
+	nullpo_retv(sd);
+
+	struct PACKET_ZC_EMOTION_FAIL p;
+	p.packetType = HEADER_ZC_EMOTION_FAIL;
+	p.packId = packId;
+	p.emoteId = emoteId;
+	p.status = (uint8)emote_status;
+
+	ns_trace(&emote_trace, EMOTE_TRACE_USE, EMOTE_EV_EMOTION_FAIL, sd->status.account_id, p.packId, p.emoteId, p.status);
+
+	clif->send(&p, sizeof(p), &sd->bl, SELF);
+}
+
+void emote_check_before_use(struct map_session_data* sd, int16 packId, int16 emoteId)
+{
+	nullpo_retv(sd);
+
+	enum emote_rate_result rate = emote_rate_check(sd);
+	if (rate == EMOTE_RATE_DROP)
+		return;
+
+	if (rate == EMOTE_RATE_REJECT) {
+		clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_EXPANSION_USE_FAIL_UNKNOWN);
+		return;
+	}
+
+	if (battle->bc->basic_skill_check != 0 && pc->checkskill(sd, NV_BASIC) < 2 && pc->checkskill(sd, SU_BASIC_SKILL) < 1) {
+		clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_USE_FAIL_SKILL_LEVEL);
+		return;
+	}
+
+	if (emoteId < 0 || emoteId >= ET_EMOTION_LAST || emote_mask_test(emote_forbidden_mask, emoteId)) {
+		clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_EXPANSION_USE_FAIL_UNKNOWN);
+		return;
 	}
-	if (!found) {
+
+	pc->update_idle_time(sd, BCIDLE_EMOTION);
+
+	struct s_emotion_db* ce = emote_db_get(packId);
+	if (!ce) {
+		clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_EXPANSION_USE_FAIL_UNKNOWN);
+		return;
+	}
+
+	if (!emote_mask_test(ce->emote_mask, emoteId)) {
 		clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_EXPANSION_USE_FAIL_UNKNOWN);
 		return;
 	}
 
 	if (ce->packId != 0) {
-		char var_name[64];
-		snprintf(var_name, sizeof(var_name), "%scashemote_%d", ce->packType == 1 ? "#" : "", ce->packId);
-		int64 has_pack = pc_readglobalreg(sd, script->add_variable(var_name));
-		if (has_pack == 0) {
+		struct emote_session_data* esd = emote_session_get(sd);
+		if (!esd || !emote_session_owns(esd, emote_db_slot(ce))) {
 			clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_EXPANSION_USE_FAIL_UNPURCHASED);
 			return;
 		}
 
-		snprintf(var_name, sizeof(var_name), "%scashemoteexpire_%d", ce->packType == 1 ? "#" : "", ce->packId);
-		int64 expire_time = pc_readglobalreg(sd, script->add_variable(var_name));
-		if (ce->rental_period != 0 && time(NULL) > expire_time) {
+		if (ce->rental_period != 0 && time(NULL) > (time_t)emote_session_expire(esd)[emote_db_slot(ce)]) {
 			clif_send_emote_fail(sd, packId, emoteId, EMSG_EMOTION_EXPANSION_USE_FAIL_DATE);
 			return;
 		}
 	}
 	
+	emote_usage_add_use(ce, emoteId, 1);
+
 	if (battle->bc->client_reshuffle_dice && emoteId >= E_DICE1 && emoteId <= E_DICE6) {
 		emoteId = rnd() % 6 + E_DICE1;
 	}
@@ -667,17 +3823,175 @@ void clif_parse_emotion2(int fd)
 	nullpo_retv(sd);
 	struct PACKET_CZ_REQ_EMOTION2* p = (struct PACKET_CZ_REQ_EMOTION2*)RFIFOP(fd, 0);
 
-	if (SHOW_DEBUG_MES)
-		ShowDebug("clif_parse_emotion2: fd=%d, AID=%d, packId=%d, emoteId=%d\n",
-			fd, sd->status.account_id, p->packId, p->emoteId);
+	ns_trace(&emote_trace, EMOTE_TRACE_USE, EMOTE_EV_REQ_EMOTION2, fd, sd->status.account_id, p->packId, p->emoteId);
 
+	emote_client_mark(sd, EMOTE_CLIENT_NEW);
 	emote_check_before_use(sd, p->packId, p->emoteId);
 }
 
+//===== Ownership script commands =====
+// Let NPCs ask the plugin instead of reading (#)cashemote_* variables:
+// - hasemotepack(<pack id>): 1 if the attached player can use the pack, else 0.
+// - emotepackexpire(<pack id>): rental end (unix time), 0 for a permanent pack,
+//   -1 if the pack is not owned or the rental ran out.
+// - getemotepacks(<array>{, <expire array>}): fills the arrays with the usable
+//   packs and their emotepackexpire value, returns the number of packs.
+// All of them answer from the session cache with rental expiry applied, the same
+// state emote_check_before_use uses.
+
+// Rental end of a usable pack, 0 if it is permanent, -1 if it cannot be used
+static int64 emote_script_pack_expire(struct emote_session_data* esd, const struct s_emotion_db* ce, time_t now)
+{
+	if (ce->packId == 0)
+		return 0; // Free for everyone, see emote_check_before_use
+
+	int slot = emote_db_slot(ce);
+	if (!esd || !emote_session_owns(esd, slot))
+		return -1;
+	if (ce->rental_period == 0)
+		return 0;
+
+	uint32 expire_time = emote_session_expire(esd)[slot];
+	return now > (time_t)expire_time ? -1 : (int64)expire_time;
+}
+
+BUILDIN(hasemotepack)
+{
+	struct map_session_data* sd = script->rid2sd(st);
+	const struct s_emotion_db* ce = emote_db_get(script_getnum(st, 2));
+
+	if (!sd || !ce) {
+		script_pushint(st, 0);
+		return true;
+	}
+
+	script_pushint(st, emote_script_pack_expire(emote_session_get(sd), ce, time(NULL)) >= 0 ? 1 : 0);
+	return true;
+}
+
+BUILDIN(emotepackexpire)
+{
+	struct map_session_data* sd = script->rid2sd(st);
+	const struct s_emotion_db* ce = emote_db_get(script_getnum(st, 2));
+
+	if (!sd || !ce) {
+		script_pushint(st, -1);
+		return true;
+	}
+
+	script_pushint(st, (int)emote_script_pack_expire(emote_session_get(sd), ce, time(NULL)));
+	return true;
+}
+
+// Checks that argument i is an integer array variable
+static bool emote_script_int_array(struct script_state* st, int i, const char* func)
+{
+	struct script_data* data = script_getdata(st, i);
+
+	if (!data_isreference(data) || is_string_variable(reference_getname(data))) {
+		ShowError("buildin_%s: Argument %d must be an integer array variable.\n", func, i - 1);
+		return false;
+	}
+	return true;
+}
+
+BUILDIN(getemotepacks)
+{
+	struct map_session_data* sd = script->rid2sd(st);
+	bool with_expire = script_hasdata(st, 3);
+
+	if (!emote_script_int_array(st, 2, "getemotepacks") || (with_expire && !emote_script_int_array(st, 3, "getemotepacks"))) {
+		script_pushint(st, 0);
+		return false;
+	}
+
+	if (!sd) {
+		script_pushint(st, 0);
+		return true;
+	}
+
+	struct script_data* packs = script_getdata(st, 2);
+	struct script_data* expires = with_expire ? script_getdata(st, 3) : NULL;
+	struct emote_session_data* esd = emote_session_get(sd);
+	time_t now = time(NULL);
+	int count = 0;
+
+	for (int slot = 0; slot < emotion_db.count; ++slot) {
+		const struct s_emotion_db* ce = &emotion_db.packs[slot];
+		int64 expire_time = emote_script_pack_expire(esd, ce, now);
+		if (expire_time < 0)
+			continue;
+
+		script->set_reg(st, sd, reference_uid(reference_getid(packs), reference_getindex(packs) + count),
+			reference_getname(packs), (const void*)h64BPTRSIZE(ce->packId), reference_getref(packs));
+		if (expires)
+			script->set_reg(st, sd, reference_uid(reference_getid(expires), reference_getindex(expires) + count),
+				reference_getname(expires), (const void*)h64BPTRSIZE((int)expire_time), reference_getref(expires));
+		count++;
+	}
+
+	script_pushint(st, count);
+	return true;
+}
+
+//===== Trace command =====
+// Toggles trace categories and decodes the trace file, see ns_trace_command.
+ACMD(emotetrace)
+{
+	char reply[CHAT_SIZE_MAX];
+
+	ns_trace_command(&emote_trace, message, reply, sizeof(reply));
+	clif->message(fd, reply);
+	return true;
+}
+
+//===== Statistics =====
+ACMD(emotestats)
+{
+	char output[CHAT_SIZE_MAX];
+
+	safesnprintf(output, sizeof(output), "Emote broadcasts: %"PRIu64" queued, %"PRIu64" area scans (%"PRIu64" saved).",
+		emote_stat.emotes_queued, emote_stat.area_scans, emote_stat.emotes_queued - emote_stat.area_scans);
+	clif->message(fd, output);
+	safesnprintf(output, sizeof(output), "Emote packets: %"PRIu64" written in %"PRIu64" WFIFO writes (%"PRIu64" coalesced), %"PRIu64" as legacy ZC_EMOTION.",
+		emote_stat.packets_written, emote_stat.wfifo_writes, emote_stat.packets_written - emote_stat.wfifo_writes, emote_stat.legacy_written);
+	clif->message(fd, output);
+	safesnprintf(output, sizeof(output), "Rental sweeper: %"PRIu64" expired row(s) reclaimed in %d run(s), %"PRIu64" in the last run%s.",
+		emote_sweep_stat.rows, emote_sweep_stat.runs, emote_sweep_stat.last_rows, emote_sweep_stat.running ? " (running)" : "");
+	clif->message(fd, output);
+	safesnprintf(output, sizeof(output), "Crowd delivery: %"PRIu64" packet(s) culled, %"PRIu64" byte(s) saved.",
+		emote_stat.culled, emote_stat.culled_bytes);
+	clif->message(fd, output);
+	safesnprintf(output, sizeof(output), "Purchase ledger: %d queued, %"PRIu64" written, %"PRIu64" replayed request(s) answered from memory.",
+		emote_ledger.count, emote_ledger.written, emote_ledger.replays);
+	clif->message(fd, output);
+
+	int shown = 0;
+	for (int m = 0; m < emote_map_stat_size && shown < 10; ++m) {
+		if (emote_map_stat[m].rejected == 0 && emote_map_stat[m].dropped == 0)
+			continue;
+		safesnprintf(output, sizeof(output), "Rate limit on %s: %u rejected, %u dropped.",
+			map->list[m].name, emote_map_stat[m].rejected, emote_map_stat[m].dropped);
+		clif->message(fd, output);
+		shown++;
+	}
+	shown = 0;
+	for (int m = 0; m < emote_crowd_size && shown < 10; ++m) {
+		if (emote_crowd[m].culled == 0)
+			continue;
+		safesnprintf(output, sizeof(output), "Crowd delivery on %s: %"PRIu64" culled, %"PRIu64" byte(s) saved.",
+			map->list[m].name, emote_crowd[m].culled, emote_crowd[m].culled_bytes);
+		clif->message(fd, output);
+		shown++;
+	}
+	return true;
+}
+
 //===== Hook implementations for core functions =====
 // - clif_emotion_pre: overrides default emotion behavior to send ZC_EMOTION_SUCCESS.
 // - clif_parse_Emotion_pre: prevents default emotion parsing when custom handling is active.
-// - clif_parse_LoadEndAck_pre: sends emotion pack list to player on initial login only.
+// - clif_parse_LoadEndAck_pre: sends emotion pack list to player on initial login only,
+//   once the registry is loaded (pc_reg_received calls LoadEndAck again otherwise).
 static void clif_emotion_pre(struct block_list** bl, enum emotion_type* type)
 {
 	client_emotion_type client_type_emote = (client_emotion_type)(*type);
@@ -694,23 +4008,65 @@ static void clif_emotion_pre(struct block_list** bl, enum emotion_type* type)
 	}
 }
 
+static int map_quit_pre(struct map_session_data** sd)
+{
+	emote_rental_cancel_session(*sd);
+	emote_owner_free(*sd);
+	return 0;
+}
+
 static void clif_parse_Emotion_pre(int* fd, struct map_session_data** sd)
 {
+	// Legacy clients go through the core handler, which ends up in clif_emotion_pre.
+	// A session not yet known to be new is marked legacy by this packet.
+	if (*sd && emote_client_get(*sd) != EMOTE_CLIENT_NEW) {
+		emote_client_mark(*sd, EMOTE_CLIENT_LEGACY);
+		return;
+	}
 	hookStop();
 }
 
 static void clif_parse_LoadEndAck_pre(int* fd, struct map_session_data** sd)
 {
+	if (!(*sd)->state.active)
+		return;
+
 	if ((*sd)->state.connect_new) {
 		emote_get_player_packs(*sd);
 	}
 }
 
+// Scripts may still grant packs through cashemote_* variables. Such a write
+// marks the ownership data for migration and drops the cache, so the next
+// check converts the variable and rebuilds the cache.
+static int pc_setregistry_post(int retVal, struct map_session_data* sd, int64 reg, int val)
+{
+	if (emote_registry_sync || !sd)
+		return retVal;
+
+	struct emote_owner_data* od = getFromMSD(sd, 3);
+	if (!od)
+		return retVal;
+
+	const char* name = script->get_str(script_getvarid(reg));
+	if (name[0] == '#')
+		name++;
+
+	if (strncmp(name, "cashemote", 9) == 0) {
+		od->legacy_dirty = true;
+		if (getFromMSD(sd, 0))
+			removeFromMSD(sd, 0);
+	}
+
+	return retVal;
+}
+
 #if PACKETVER >= 20230802
 HPExport void plugin_init(void)
 {
 	addPacket(0x0be9, 6, clif_parse_emotion2, hpClif_Parse);
 	addPacket(0x0bec, 7, clif_parse_emote_expansion_request, hpClif_Parse);
+	addPacket(HEADER_EMOTE_CATALOG_DATA, -1, chrif_parse_emote_catalog_data, hpChrif_Parse);
 	packets->addLen(0x0bea, 10);
 	packets->addLen(0x0beb, 7);
 	packets->addLen(0x0bed, 9);
@@ -720,122 +4076,73 @@ HPExport void plugin_init(void)
 	addHookPre(clif, emotion, clif_emotion_pre);
 	addHookPre(clif, pEmotion, clif_parse_Emotion_pre);
 	addHookPre(clif, pLoadEndAck, clif_parse_LoadEndAck_pre);
+	addHookPost(pc, setregistry, pc_setregistry_post);
+	addHookPre(map, quit, map_quit_pre);
+	addHookPost(chrif, on_ready, chrif_on_ready_post);
+
+	addAtcommand("reloademotedb", reloademotedb);
+	addAtcommand("emotestats", emotestats);
+	addAtcommand("emotetrace", emotetrace);
+	addAtcommand("emotegrant", emotegrant);
+	addAtcommand("emoterevoke", emoterevoke);
+	addCPCommand("emote:reloaddb", reloademotedb);
+	addCPCommand("emote:sweep", emotesweep);
+	addScriptCommand("emotegrant", "iis", emotegrant);
+	addScriptCommand("emoterevoke", "is", emoterevoke);
+	addScriptCommand("hasemotepack", "i", hasemotepack);
+	addScriptCommand("emotepackexpire", "i", emotepackexpire);
+	addScriptCommand("getemotepacks", "r?", getemotepacks);
 
-	script->set_constant("ET_SURPRISE", ET_SURPRISE, false, false);
-	script->set_constant("ET_QUESTION", ET_QUESTION, false, false);
-	script->set_constant("ET_DELIGHT", ET_DELIGHT, false, false);
-	script->set_constant("ET_THROB", ET_THROB, false, false);
-	script->set_constant("ET_SWEAT", ET_SWEAT, false, false);
-	script->set_constant("ET_AHA", ET_AHA, false, false);
-	script->set_constant("ET_FRET", ET_FRET, false, false);
-	script->set_constant("ET_ANGER", ET_ANGER, false, false);
-	script->set_constant("ET_MONEY", ET_MONEY, false, false);
-	script->set_constant("ET_THINK", ET_THINK, false, false);
-	script->set_constant("ET_SCISSOR", ET_SCISSOR, false, false);
-	script->set_constant("ET_ROCK", ET_ROCK, false, false);
-	script->set_constant("ET_WRAP", ET_WRAP, false, false);
-	script->set_constant("ET_FLAG", ET_FLAG, false, false);
-	script->set_constant("ET_BIGTHROB", ET_BIGTHROB, false, false);
-	script->set_constant("ET_THANKS", ET_THANKS, false, false);
-	script->set_constant("ET_KEK", ET_KEK, false, false);
-	script->set_constant("ET_SORRY", ET_SORRY, false, false);
-	script->set_constant("ET_SMILE", ET_SMILE, false, false);
-	script->set_constant("ET_PROFUSELY_SWEAT", ET_PROFUSELY_SWEAT, false, false);
-	script->set_constant("ET_SCRATCH", ET_SCRATCH, false, false);
-	script->set_constant("ET_BEST", ET_BEST, false, false);
-	script->set_constant("ET_STARE_ABOUT", ET_STARE_ABOUT, false, false);
-	script->set_constant("ET_HUK", ET_HUK, false, false);
-	script->set_constant("ET_O", ET_O, false, false);
-	script->set_constant("ET_X", ET_X, false, false);
-	script->set_constant("ET_HELP", ET_HELP, false, false);
-	script->set_constant("ET_GO", ET_GO, false, false);
-	script->set_constant("ET_CRY", ET_CRY, false, false);
-	script->set_constant("ET_KIK", ET_KIK, false, false);
-	script->set_constant("ET_CHUP", ET_CHUP, false, false);
-	script->set_constant("ET_CHUPCHUP", ET_CHUPCHUP, false, false);
-	script->set_constant("ET_HNG", ET_HNG, false, false);
-	script->set_constant("ET_OK", ET_OK, false, false);
-	script->set_constant("ET_CHAT_PROHIBIT", ET_CHAT_PROHIBIT, false, false);
-	script->set_constant("ET_INDONESIA_FLAG", ET_INDONESIA_FLAG, false, false);
-	script->set_constant("ET_STARE", ET_STARE, false, false);
-	script->set_constant("ET_HUNGRY", ET_HUNGRY, false, false);
-	script->set_constant("ET_COOL", ET_COOL, false, false);
-	script->set_constant("ET_MERONG", ET_MERONG, false, false);
-	script->set_constant("ET_SHY", ET_SHY, false, false);
-	script->set_constant("ET_GOODBOY", ET_GOODBOY, false, false);
-	script->set_constant("ET_SPTIME", ET_SPTIME, false, false);
-	script->set_constant("ET_SEXY", ET_SEXY, false, false);
-	script->set_constant("ET_COMEON", ET_COMEON, false, false);
-	script->set_constant("ET_SLEEPY", ET_SLEEPY, false, false);
-	script->set_constant("ET_CONGRATULATION", ET_CONGRATULATION, false, false);
-	script->set_constant("ET_HPTIME", ET_HPTIME, false, false);
-	script->set_constant("ET_PH_FLAG", ET_PH_FLAG, false, false);
-	script->set_constant("ET_MY_FLAG", ET_MY_FLAG, false, false);
-	script->set_constant("ET_SI_FLAG", ET_SI_FLAG, false, false);
-	script->set_constant("ET_BR_FLAG", ET_BR_FLAG, false, false);
-	script->set_constant("ET_SPARK", ET_SPARK, false, false);
-	script->set_constant("ET_CONFUSE", ET_CONFUSE, false, false);
-	script->set_constant("ET_OHNO", ET_OHNO, false, false);
-	script->set_constant("ET_HUM", ET_HUM, false, false);
-	script->set_constant("ET_BLABLA", ET_BLABLA, false, false);
-	script->set_constant("ET_OTL", ET_OTL, false, false);
-	script->set_constant("ET_DICE1", ET_DICE1, false, false);
-	script->set_constant("ET_DICE2", ET_DICE2, false, false);
-	script->set_constant("ET_DICE3", ET_DICE3, false, false);
-	script->set_constant("ET_DICE4", ET_DICE4, false, false);
-	script->set_constant("ET_DICE5", ET_DICE5, false, false);
-	script->set_constant("ET_DICE6", ET_DICE6, false, false);
-	script->set_constant("ET_INDIA_FLAG", ET_INDIA_FLAG, false, false);
-	script->set_constant("ET_LUV", ET_LUV, false, false);
-	script->set_constant("ET_FLAG8", ET_FLAG8, false, false);
-	script->set_constant("ET_FLAG9", ET_FLAG9, false, false);
-	script->set_constant("ET_MOBILE", ET_MOBILE, false, false);
-	script->set_constant("ET_MAIL", ET_MAIL, false, false);
-	script->set_constant("ET_ANTENNA0", ET_ANTENNA0, false, false);
-	script->set_constant("ET_ANTENNA1", ET_ANTENNA1, false, false);
-	script->set_constant("ET_ANTENNA2", ET_ANTENNA2, false, false);
-	script->set_constant("ET_ANTENNA3", ET_ANTENNA3, false, false);
-	script->set_constant("ET_HUM2", ET_HUM2, false, false);
-	script->set_constant("ET_ABS", ET_ABS, false, false);
-	script->set_constant("ET_OOPS", ET_OOPS, false, false);
-	script->set_constant("ET_SPIT", ET_SPIT, false, false);
-	script->set_constant("ET_ENE", ET_ENE, false, false);
-	script->set_constant("ET_PANIC", ET_PANIC, false, false);
-	script->set_constant("ET_WHISP", ET_WHISP, false, false);
-	script->set_constant("ET_YUT1", ET_YUT1, false, false);
-	script->set_constant("ET_YUT2", ET_YUT2, false, false);
-	script->set_constant("ET_YUT3", ET_YUT3, false, false);
-	script->set_constant("ET_YUT4", ET_YUT4, false, false);
-	script->set_constant("ET_YUT5", ET_YUT5, false, false);
-	script->set_constant("ET_YUT6", ET_YUT6, false, false);
-	script->set_constant("ET_YUT7", ET_YUT7, false, false);
-	script->set_constant("ET_CLICK_ME", ET_CLICK_ME, false, false);
-	script->set_constant("ET_DAILY_QUEST", ET_DAILY_QUEST, false, false);
-	script->set_constant("ET_EVENT", ET_EVENT, false, false);
-	script->set_constant("ET_JOB_QUEST", ET_JOB_QUEST, false, false);
-	script->set_constant("ET_TRAFFIC_LINE_QUEST", ET_TRAFFIC_LINE_QUEST, false, false);
-	script->set_constant("ET_CUSTOM_1", ET_CUSTOM_1, false, false);
-	script->set_constant("ET_CUSTOM_2", ET_CUSTOM_2, false, false);
-	script->set_constant("ET_CUSTOM_3", ET_CUSTOM_3, false, false);
-	script->set_constant("ET_CUSTOM_4", ET_CUSTOM_4, false, false);
-	script->set_constant("ET_CUSTOM_5", ET_CUSTOM_5, false, false);
-	script->set_constant("ET_CUSTOM_6", ET_CUSTOM_6, false, false);
-	script->set_constant("ET_CUSTOM_7", ET_CUSTOM_7, false, false);
-	script->set_constant("ET_CUSTOM_8", ET_CUSTOM_8, false, false);
-	script->set_constant("ET_CUSTOM_9", ET_CUSTOM_9, false, false);
-	script->set_constant("ET_CUSTOM_10", ET_CUSTOM_10, false, false);
-	script->set_constant("ET_CUSTOM_11", ET_CUSTOM_11, false, false);
-	script->set_constant("ET_CUSTOM_12", ET_CUSTOM_12, false, false);
-	script->set_constant("ET_CUSTOM_13", ET_CUSTOM_13, false, false);
-	script->set_constant("ET_CUSTOM_14", ET_CUSTOM_14, false, false);
-	script->set_constant("ET_CUSTOM_15", ET_CUSTOM_15, false, false);
+	for (size_t i = 0; i < ARRAYLENGTH(emote_catalog_constants); ++i)
+		script->set_constant(emote_catalog_constants[i].name, emote_catalog_constants[i].value, false, false);
 
 	emote_db_init();
+	emote_legacy_init();
+	emote_crowd_load();
+	emote_usage_reset();
+	ns_trace_init(&emote_trace, "ns_emote", emote_trace_categories, emote_trace_events, ARRAYLENGTH(emote_trace_events), EMOTE_TRACE_CATEGORIES);
+
+	emote_wheel_next = (uint32)time(NULL);
+	timer->add_func_list(emote_rental_wheel_timer, "emote_rental_wheel_timer");
+	timer->add_interval(timer->gettick() + 1000, emote_rental_wheel_timer, 0, 0, 1000);
+	timer->add_func_list(emote_broadcast_flush_timer, "emote_broadcast_flush_timer");
+	emote_worker_init();
+
+	timer->add_func_list(emote_sweep_timer, "emote_sweep_timer");
+	if (EMOTE_SWEEP_INTERVAL > 0)
+		timer->add_interval(timer->gettick() + EMOTE_SWEEP_INTERVAL * 60 * 1000, emote_sweep_timer, 0, 0, EMOTE_SWEEP_INTERVAL * 60 * 1000);
+
+	timer->add_func_list(emote_ledger_timer, "emote_ledger_timer");
+	timer->add_interval(timer->gettick() + EMOTE_LEDGER_FLUSH_MS, emote_ledger_timer, 0, 0, max(EMOTE_LEDGER_FLUSH_MS, 100));
+
+	timer->add_func_list(emote_usage_timer, "emote_usage_timer");
+	if (EMOTE_USAGE_INTERVAL > 0)
+		timer->add_interval(timer->gettick() + EMOTE_USAGE_INTERVAL * 60 * 1000, emote_usage_timer, 0, 0, EMOTE_USAGE_INTERVAL * 60 * 1000);
 }
 
 HPExport void plugin_final(void)
 {
+	emote_ledger_flush(); // Both written out by the worker before it stops
+	emote_usage_flush();
+	emote_worker_final();
+	emote_rental_final();
 	emote_db_final();
+	aFree(emote_bcast.list);
+	aFree(emote_map_stat);
+	aFree(emote_list_buf);
+	aFree(emote_crowd);
+	aFree(emote_crowd_idx);
+	aFree(emote_crowd_tick.pool);
+	aFree(emote_crowd_tick.viewers);
+	aFree(emote_crowd_tick.cands);
+	aFree(emote_crowd_tick.kept);
+	aFree(emote_usage.uses);
+	aFree(emote_usage.purchases);
+	aFree(emote_catalog_in.buf);
+	if (emote_ledger.count > 0)
+		ShowError("plugin_final: %d purchase ledger entries could not be written.\n", emote_ledger.count);
+	aFree(emote_ledger.list);
+	ns_trace_final(&emote_trace);
 }
 #else
 HPExport void plugin_init(void)
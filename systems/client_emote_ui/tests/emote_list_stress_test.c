@@ -0,0 +1,108 @@
+//===== Standalone Test ======================================
+//= Emotion Pack List Chunking Stress Test
+//===== By: =================================================
+//= AcidMarco
+//===== Description: =========================================
+//= Splits owned pack lists of up to several thousand packs
+//= the way clif_send_emote_expansion_list does and checks
+//= that every packet stays within the client packet limit,
+//= that packetLength fits its int16 field and that every
+//= entry is sent exactly once, in order.
+//===== Usage: ===============================================
+//= gcc -std=gnu99 -Wall -Wextra -o emote_list_stress_test emote_list_stress_test.c
+//= ./emote_list_stress_test
+//===== Repository Link: =====================================
+//= https://github.com/AcidMarco/ro-releases
+//============================================================
+
+#include "../server_plugin_herc/emote_list.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SOCKET_MAX_CLIENT_PACKET 0x6000		// Hercules default socket_max_client_packet
+
+// Same layout as the plugin's packet structs (newest PACKETVER, the larger header)
+#pragma pack(push, 1)
+struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub {
+	uint16_t packId;
+	uint8_t isRented;
+	uint32_t timestamp;
+} __attribute__((packed));
+
+struct PACKET_ZC_EMOTION_EXPANSION_LIST {
+	int16_t packetType;
+	int16_t packetLength;
+	uint32_t timestamp;
+	int16_t timezone;
+	struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub list[];
+} __attribute__((packed));
+#pragma pack(pop)
+
+static int failures = 0;
+
+#define CHECK(cond, count, msg) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL (%d packs): %s\n", (count), (msg)); \
+		failures++; \
+		return; \
+	} \
+} while (0)
+
+// Sends count owned packs and checks every packet of the list
+static void stress_list(int count)
+{
+	const size_t header = sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST);
+	const size_t entry = sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub);
+	int per_packet = emote_list_per_packet(header, entry);
+	int chunk_max = count < per_packet ? count : per_packet;
+	int sent = 0, packets = 0;
+	int next_id = 0;
+
+	struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub* list = calloc(count > 0 ? count : 1, entry);
+	CHECK(list != NULL, count, "out of memory");
+	for (int i = 0; i < count; i++)
+		list[i].packId = (uint16_t)i;
+
+	do {
+		int chunk = emote_list_chunk(count, sent, chunk_max);
+		size_t packet_len = header + chunk * entry;
+
+		CHECK(chunk >= 0, count, "negative chunk");
+		CHECK(packet_len <= EMOTE_LIST_PACKET_MAX, count, "packet above EMOTE_LIST_PACKET_MAX");
+		CHECK(packet_len <= SOCKET_MAX_CLIENT_PACKET, count, "packet above socket_max_client_packet");
+		CHECK(packet_len <= INT16_MAX, count, "packetLength overflows int16");
+		CHECK(chunk > 0 || count == 0, count, "empty packet in a non-empty list");
+
+		for (int i = 0; i < chunk; i++) {
+			if (list[sent + i].packId != (uint16_t)next_id++) {
+				free(list);
+				CHECK(0, count, "entries out of order");
+			}
+		}
+
+		sent += chunk;
+		packets++;
+	} while (sent < count);
+
+	free(list);
+	CHECK(sent == count, count, "not every entry was sent");
+	CHECK(packets == (count == 0 ? 1 : (count + per_packet - 1) / per_packet), count, "unexpected packet count");
+}
+
+int main(void)
+{
+	for (int count = 0; count <= 5000; count++)
+		stress_list(count);
+	stress_list(UINT16_MAX);
+
+	if (failures > 0) {
+		fprintf(stderr, "%d failure(s)\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("emote_list_stress_test: OK (%d packs per packet)\n",
+		emote_list_per_packet(sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST), sizeof(struct PACKET_ZC_EMOTION_EXPANSION_LIST_sub)));
+	return EXIT_SUCCESS;
+}